@@ -2,20 +2,98 @@
 #include <linux/init.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#ifdef CONFIG_X86
+#include <asm/set_memory.h>
+#endif
+#ifdef CONFIG_ARCH_HAS_DMA_WRITE_COMBINE
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/dma-map-ops.h>
+#else
+#include <linux/dma-noncoherent.h>
+#endif
+#endif
 
 #define DRV_NAME "memcache_test"
 #define DEV_BASENAME "memcache"
 
+/* Largest chunk tried by region_alloc(): 2 MiB with 4 KiB pages. */
+#define REGION_MAX_ORDER 9
+/* Regions below this many pages are zeroed on the allocating thread. */
+#define REGION_ZERO_MIN_PAGES 4096
+/* read()/write() copy at most this much between two cond_resched(). */
+#define REGION_RW_CHUNK (1UL << 20)
+
+/* Mirrored in user/target.c and user/pat.c. */
+#define MEMCACHE_IOCTL_GET_SIZE 0
+#define MEMCACHE_IOCTL_SET_ATTR _IOWR('m', 1, struct memcache_attr_req)
+
+/*
+ * Switch the direct map of a page range to attr (MEMCACHE_WB, or the region's
+ * own UC/WC type) and zap the user PTEs over it. Times are filled in on return.
+ */
+struct memcache_attr_req {
+	__u64 offset;
+	__u64 length;
+	__u32 attr;
+	/* set_memory_*() calls, one per physically contiguous run that changed */
+	__u32 runs;
+	__u64 set_ns;
+	__u64 zap_ns;
+	__u64 total_ns;
+};
+
 enum memcache_type {
 	MEMCACHE_WB = 0,
 	MEMCACHE_UC = 1,
 	MEMCACHE_WC = 2,
-	MEMCACHE_MAX = 3,
+	/* Buffers from the DMA API on a dummy platform device, mmapped with dma_mmap_*(). */
+	MEMCACHE_DMA_WB = 3,
+	MEMCACHE_DMA_COHERENT = 4,
+	MEMCACHE_DMA_WC = 5,
+	MEMCACHE_MAX = 6,
+};
+
+#ifdef CONFIG_X86
+#define MEMTYPE_NUM _PAGE_CACHE_MODE_NUM
+#else
+#define MEMTYPE_NUM 1
+#endif
+
+/*
+ * Counters exported through debugfs. Mapping counts follow vm_ops open/close;
+ * splitting a mapping is refused so each vma is accounted exactly once.
+ */
+struct memcache_stats {
+	atomic64_t maps_active;
+	atomic64_t maps_total;
+	atomic64_t bytes_mapped;
+	atomic64_t memtype_maps[MEMTYPE_NUM];
+	atomic64_t faults;
+	atomic64_t fault_ns;
+	atomic64_t inserts;
+	atomic64_t insert_ns;
+	atomic64_t reads;
+	atomic64_t read_bytes;
+	atomic64_t writes;
+	atomic64_t write_bytes;
+	atomic64_t attr_changes;
+	atomic64_t attr_ns;
 };
 
 struct memcache_region {
@@ -23,15 +101,49 @@ struct memcache_region {
 	size_t size_bytes;
 	unsigned long nr_pages;
 	struct page **pages;
+	/* vmap() of pages with the region's cache type, for read()/write(). */
+	void *vaddr;
+	/* Pages whose direct map MEMCACHE_IOCTL_SET_ATTR switched to the region's type. */
+	unsigned long *attr_set;
+	/* DMA backend only; pages is NULL for those regions. */
+	void *cpu_addr;
+	struct page *dma_page;
+	dma_addr_t dma_handle;
+	struct mutex lock;
+	unsigned int users;
+	struct memcache_stats stats;
 };
 
 static unsigned int size_mb = 16;
 module_param(size_mb, uint, 0644);
 
+/* Per-type region sizes; 0 falls back to size_mb. Read at allocation time. */
+static unsigned int wb_size_mb;
+module_param(wb_size_mb, uint, 0644);
+
+static unsigned int uc_size_mb;
+module_param(uc_size_mb, uint, 0644);
+
+static unsigned int wc_size_mb;
+module_param(wc_size_mb, uint, 0644);
+
+/* Physically contiguous without an IOMMU, so keep it small unless CMA is set up. */
+static unsigned int dma_size_mb = 4;
+module_param(dma_size_mb, uint, 0644);
+
 static int numa_node = -1;
 module_param(numa_node, int, 0644);
 
+/*
+ * 0: populate the whole mapping at mmap time (batched vm_insert_pages).
+ * 1: map nothing up front and insert pages from the fault handler.
+ */
+static unsigned int mmap_fault;
+module_param(mmap_fault, uint, 0644);
+
 static dev_t memcache_devt;
+static struct platform_device *memcache_pdev;
+static struct dentry *memcache_debugfs;
 static struct class *memcache_class;
 static struct cdev memcache_cdev;
 static struct memcache_region regions[MEMCACHE_MAX];
@@ -45,11 +157,22 @@ static const char *type_name(enum memcache_type t)
 		return "uc";
 	case MEMCACHE_WC:
 		return "wc";
+	case MEMCACHE_DMA_WB:
+		return "dma_wb";
+	case MEMCACHE_DMA_COHERENT:
+		return "dma_coherent";
+	case MEMCACHE_DMA_WC:
+		return "dma_wc";
 	default:
 		return "unknown";
 	}
 }
 
+static bool type_is_dma(enum memcache_type t)
+{
+	return t >= MEMCACHE_DMA_WB && t <= MEMCACHE_DMA_WC;
+}
+
 static pgprot_t type_pgprot(enum memcache_type t, pgprot_t prot)
 {
 	switch (t) {
@@ -64,92 +187,197 @@ static pgprot_t type_pgprot(enum memcache_type t, pgprot_t prot)
 	}
 }
 
-static int memcache_open(struct inode *inode, struct file *file)
+#ifdef CONFIG_X86
+static unsigned int vma_memtype(struct vm_area_struct *vma)
 {
-	unsigned int minor = iminor(inode);
-
-	if (minor >= MEMCACHE_MAX)
-		return -ENODEV;
+	return pgprot2cachemode(vma->vm_page_prot);
+}
 
-	file->private_data = &regions[minor];
+static const char *memtype_name(unsigned int mt)
+{
+	switch (mt) {
+	case _PAGE_CACHE_MODE_WB:
+		return "wb";
+	case _PAGE_CACHE_MODE_WC:
+		return "wc";
+	case _PAGE_CACHE_MODE_UC_MINUS:
+		return "uc-";
+	case _PAGE_CACHE_MODE_UC:
+		return "uc";
+	case _PAGE_CACHE_MODE_WT:
+		return "wt";
+	case _PAGE_CACHE_MODE_WP:
+		return "wp";
+	default:
+		return "unknown";
+	}
+}
+#else
+static unsigned int vma_memtype(struct vm_area_struct *vma)
+{
 	return 0;
 }
 
-static long memcache_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static const char *memtype_name(unsigned int mt)
 {
-	struct memcache_region *r = file->private_data;
-	u64 v;
+	return "n/a";
+}
+#endif
 
-	switch (cmd) {
-	case 0:
-		v = r->size_bytes;
-		if (copy_to_user((void __user *)arg, &v, sizeof(v)))
-			return -EFAULT;
-		return 0;
-	default:
-		return -ENOTTY;
+struct region_zero_work {
+	struct work_struct work;
+	struct page **pages;
+	unsigned long nr_pages;
+};
+
+static void region_zero_fn(struct work_struct *work)
+{
+	struct region_zero_work *zw = container_of(work, struct region_zero_work, work);
+	unsigned long i;
+
+	for (i = 0; i < zw->nr_pages; i++) {
+		clear_highpage(zw->pages[i]);
+		if ((i & 1023) == 1023)
+			cond_resched();
 	}
 }
 
-static int memcache_mmap(struct file *file, struct vm_area_struct *vma)
+/*
+ * Zero the region with one work item per online CPU of the target node (or
+ * every online CPU without a node), so first-touch of the zeroing also stays
+ * node local.
+ */
+static void region_zero(struct memcache_region *r)
 {
-	struct memcache_region *r = file->private_data;
-	unsigned long requested = vma->vm_end - vma->vm_start;
-	unsigned long i;
-	int ret;
+	const struct cpumask *mask = cpu_online_mask;
+	struct region_zero_work *works;
+	unsigned long per, off = 0;
+	unsigned int nr_cpus = 0, n = 0, i;
+	int cpu;
 
-	if (!r)
-		return -EINVAL;
+	if (numa_node >= 0 && cpumask_intersects(cpumask_of_node(numa_node), cpu_online_mask))
+		mask = cpumask_of_node(numa_node);
 
-	if (requested > r->size_bytes)
-		return -EINVAL;
+	for_each_cpu_and(cpu, mask, cpu_online_mask)
+		nr_cpus++;
 
-	pr_info(DRV_NAME ": mmap %s requested=%lu bytes (%lu pages)\n",
-		type_name(r->type), requested, requested >> PAGE_SHIFT);
+	works = NULL;
+	if (nr_cpus > 1 && r->nr_pages >= REGION_ZERO_MIN_PAGES)
+		works = kcalloc(nr_cpus, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		struct region_zero_work zw = {
+			.pages = r->pages,
+			.nr_pages = r->nr_pages,
+		};
 
-	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-	vma->vm_page_prot = type_pgprot(r->type, vma->vm_page_prot);
+		region_zero_fn(&zw.work);
+		return;
+	}
 
-	for (i = 0; i < (requested >> PAGE_SHIFT); i++) {
-		ret = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), r->pages[i]);
-		if (ret)
-			return ret;
+	per = DIV_ROUND_UP(r->nr_pages, nr_cpus);
+	for_each_cpu_and(cpu, mask, cpu_online_mask) {
+		struct region_zero_work *zw;
+
+		if (off >= r->nr_pages || n >= nr_cpus)
+			break;
+		zw = &works[n++];
+		INIT_WORK(&zw->work, region_zero_fn);
+		zw->pages = &r->pages[off];
+		zw->nr_pages = min(per, r->nr_pages - off);
+		off += zw->nr_pages;
+		queue_work_on(cpu, system_long_wq, &zw->work);
 	}
 
-	return 0;
+	for (i = 0; i < n; i++)
+		flush_work(&works[i].work);
+	kfree(works);
 }
 
-static const struct file_operations memcache_fops = {
-	.owner = THIS_MODULE,
-	.open = memcache_open,
-	.unlocked_ioctl = memcache_ioctl,
-	.mmap = memcache_mmap,
-	.llseek = no_llseek,
-};
+static struct page *region_alloc_chunk(unsigned int order)
+{
+	gfp_t gfp = GFP_KERNEL;
+
+	/* High orders are opportunistic: fail fast and fall back to a smaller one. */
+	if (order)
+		gfp |= __GFP_NORETRY | __GFP_NOWARN;
+
+	if (numa_node >= 0)
+		return alloc_pages_node(numa_node, gfp, order);
+	return alloc_pages(gfp, order);
+}
 
 static int region_alloc(struct memcache_region *r, enum memcache_type type, size_t size_bytes)
 {
-	unsigned long i;
+	unsigned long hist[REGION_MAX_ORDER + 1] = { 0 };
+	unsigned int order = REGION_MAX_ORDER;
+	ktime_t t0, t1, t2;
+	char buf[128];
+	unsigned long i, j;
+	int len = 0;
 	int ret = 0;
 
 	r->type = type;
 	r->size_bytes = size_bytes;
 	r->nr_pages = (size_bytes + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	r->pages = kcalloc(r->nr_pages, sizeof(r->pages[0]), GFP_KERNEL);
+	r->pages = kvcalloc(r->nr_pages, sizeof(r->pages[0]), GFP_KERNEL);
 	if (!r->pages)
 		return -ENOMEM;
+	r->attr_set = kvcalloc(BITS_TO_LONGS(r->nr_pages), sizeof(unsigned long), GFP_KERNEL);
+	if (!r->attr_set) {
+		kvfree(r->pages);
+		r->pages = NULL;
+		return -ENOMEM;
+	}
 
-	for (i = 0; i < r->nr_pages; i++) {
-		if (numa_node >= 0)
-			r->pages[i] = alloc_pages_node(numa_node, GFP_KERNEL | __GFP_ZERO, 0);
-		else
-			r->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (!r->pages[i]) {
-			ret = -ENOMEM;
-			goto err;
+	t0 = ktime_get();
+	i = 0;
+	while (i < r->nr_pages) {
+		struct page *page;
+
+		while (order && (1UL << order) > r->nr_pages - i)
+			order--;
+
+		page = region_alloc_chunk(order);
+		if (!page) {
+			if (!order) {
+				ret = -ENOMEM;
+				goto err;
+			}
+			/* Stay at the lower order: memory is fragmented at this size. */
+			order--;
+			continue;
 		}
+
+		/* Split so every page is refcounted and freed on its own. */
+		split_page(page, order);
+		for (j = 0; j < (1UL << order); j++)
+			r->pages[i + j] = page + j;
+		i += 1UL << order;
+		hist[order]++;
+		cond_resched();
 	}
 
+	t1 = ktime_get();
+	region_zero(r);
+	t2 = ktime_get();
+
+	/*
+	 * Same cache type as the user mappings, so a read()/write() copy pays
+	 * what a load/store through the mapping pays.
+	 */
+	r->vaddr = vmap(r->pages, r->nr_pages, VM_MAP, type_pgprot(type, PAGE_KERNEL));
+	if (!r->vaddr) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (j = REGION_MAX_ORDER + 1; j-- > 0;) {
+		if (hist[j])
+			len += scnprintf(buf + len, sizeof(buf) - len, " o%lu=%lu", j, hist[j]);
+	}
+	pr_info(DRV_NAME ": alloc %s pages=%lu alloc=%lld us zero=%lld us chunks:%s\n", type_name(type),
+		r->nr_pages, ktime_us_delta(t1, t0), ktime_us_delta(t2, t1), len ? buf : " none");
+
 	return 0;
 
 err:
@@ -157,13 +385,61 @@ err:
 		if (r->pages[i])
 			__free_page(r->pages[i]);
 	}
-	kfree(r->pages);
+	kvfree(r->attr_set);
+	r->attr_set = NULL;
+	kvfree(r->pages);
 	r->pages = NULL;
 	r->nr_pages = 0;
 	r->size_bytes = 0;
 	return ret;
 }
 
+#ifdef CONFIG_X86
+/*
+ * Direct map of the pages in [first, first + n) whose attr_set bit differs
+ * from set: to the region's type when set, else back to WB. One
+ * set_memory_*() per physically contiguous run; each one reserves the
+ * memtype, flushes the caches of the range and flushes the kernel TLB on
+ * every CPU.
+ */
+static int region_set_direct(struct memcache_region *r, unsigned long first, unsigned long n, bool set, u32 *runs)
+{
+	unsigned long i = first, end = first + n;
+
+	while (i < end) {
+		unsigned long addr, j;
+		int ret;
+
+		if (!!test_bit(i, r->attr_set) == set) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < end && !!test_bit(j, r->attr_set) != set &&
+		     page_to_pfn(r->pages[j]) == page_to_pfn(r->pages[j - 1]) + 1; j++)
+			;
+
+		addr = (unsigned long)page_address(r->pages[i]);
+		if (!set)
+			ret = set_memory_wb(addr, j - i);
+		else if (r->type == MEMCACHE_UC)
+			ret = set_memory_uc(addr, j - i);
+		else
+			ret = set_memory_wc(addr, j - i);
+		if (ret)
+			return ret;
+		if (set)
+			bitmap_set(r->attr_set, i, j - i);
+		else
+			bitmap_clear(r->attr_set, i, j - i);
+		if (runs)
+			(*runs)++;
+		i = j;
+		cond_resched();
+	}
+	return 0;
+}
+#endif
+
 static void region_free(struct memcache_region *r)
 {
 	unsigned long i;
@@ -171,38 +447,648 @@ static void region_free(struct memcache_region *r)
 	if (!r || !r->pages)
 		return;
 
+	if (r->vaddr)
+		vunmap(r->vaddr);
+	r->vaddr = NULL;
+
+#ifdef CONFIG_X86
+	/* Pages go back to the allocator with a WB direct map, or not at all. */
+	if (r->attr_set && region_set_direct(r, 0, r->nr_pages, false, NULL)) {
+		pr_err(DRV_NAME ": %s: restoring WB failed, leaking %lu pages\n", type_name(r->type), r->nr_pages);
+		kvfree(r->attr_set);
+		r->attr_set = NULL;
+		kvfree(r->pages);
+		r->pages = NULL;
+		r->nr_pages = 0;
+		r->size_bytes = 0;
+		return;
+	}
+#endif
+	kvfree(r->attr_set);
+	r->attr_set = NULL;
+
 	for (i = 0; i < r->nr_pages; i++) {
 		if (r->pages[i])
 			__free_page(r->pages[i]);
+		if ((i & 1023) == 1023)
+			cond_resched();
 	}
 
-	kfree(r->pages);
+	kvfree(r->pages);
 	r->pages = NULL;
 	r->nr_pages = 0;
 	r->size_bytes = 0;
 }
 
+static int region_dma_alloc(struct memcache_region *r, size_t size_bytes)
+{
+	struct device *dev;
+	ktime_t t0;
+
+	if (!memcache_pdev)
+		return -ENODEV;
+	dev = &memcache_pdev->dev;
+	size_bytes = PAGE_ALIGN(size_bytes);
+
+	t0 = ktime_get();
+	switch (r->type) {
+	case MEMCACHE_DMA_WB:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		r->dma_page = dma_alloc_pages(dev, size_bytes, &r->dma_handle, DMA_BIDIRECTIONAL,
+					      GFP_KERNEL);
+		if (r->dma_page)
+			r->cpu_addr = page_address(r->dma_page);
+		break;
+#else
+		return -EOPNOTSUPP;
+#endif
+	case MEMCACHE_DMA_COHERENT:
+		r->cpu_addr = dma_alloc_coherent(dev, size_bytes, &r->dma_handle, GFP_KERNEL);
+		break;
+	case MEMCACHE_DMA_WC:
+		r->cpu_addr = dma_alloc_wc(dev, size_bytes, &r->dma_handle, GFP_KERNEL);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (!r->cpu_addr)
+		return -ENOMEM;
+
+	r->size_bytes = size_bytes;
+	r->nr_pages = size_bytes >> PAGE_SHIFT;
+	pr_info(DRV_NAME ": alloc %s pages=%lu dma_addr=%pad alloc=%lld us\n", type_name(r->type),
+		r->nr_pages, &r->dma_handle, ktime_us_delta(ktime_get(), t0));
+	return 0;
+}
+
+static void region_dma_free(struct memcache_region *r)
+{
+	struct device *dev = &memcache_pdev->dev;
+
+	if (!r->cpu_addr)
+		return;
+
+	switch (r->type) {
+	case MEMCACHE_DMA_WB:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		dma_free_pages(dev, r->size_bytes, r->dma_page, r->dma_handle, DMA_BIDIRECTIONAL);
+#endif
+		break;
+	case MEMCACHE_DMA_COHERENT:
+		dma_free_coherent(dev, r->size_bytes, r->cpu_addr, r->dma_handle);
+		break;
+	case MEMCACHE_DMA_WC:
+		dma_free_wc(dev, r->size_bytes, r->cpu_addr, r->dma_handle);
+		break;
+	default:
+		break;
+	}
+
+	r->cpu_addr = NULL;
+	r->dma_page = NULL;
+	r->nr_pages = 0;
+	r->size_bytes = 0;
+}
+
+static size_t type_size_bytes(enum memcache_type t)
+{
+	unsigned int mb = 0;
+
+	switch (t) {
+	case MEMCACHE_WB:
+		mb = wb_size_mb;
+		break;
+	case MEMCACHE_UC:
+		mb = uc_size_mb;
+		break;
+	case MEMCACHE_WC:
+		mb = wc_size_mb;
+		break;
+	case MEMCACHE_DMA_WB:
+	case MEMCACHE_DMA_COHERENT:
+	case MEMCACHE_DMA_WC:
+		mb = dma_size_mb;
+		break;
+	default:
+		break;
+	}
+	if (!mb)
+		mb = size_mb;
+
+	return (size_t)mb * 1024 * 1024;
+}
+
+static int memcache_open(struct inode *inode, struct file *file)
+{
+	unsigned int minor = iminor(inode);
+	struct memcache_region *r;
+	int ret = 0;
+
+	if (minor >= MEMCACHE_MAX)
+		return -ENODEV;
+
+	r = &regions[minor];
+	mutex_lock(&r->lock);
+	if (!r->users) {
+		size_t size_bytes = type_size_bytes(r->type);
+
+		if (!size_bytes)
+			ret = -EINVAL;
+		else if (type_is_dma(r->type))
+			ret = region_dma_alloc(r, size_bytes);
+		else
+			ret = region_alloc(r, r->type, size_bytes);
+		if (!ret && r->pages)
+			pr_info(DRV_NAME ": alloc %s size_bytes=%zu pages=%lu first_page_nid=%d\n",
+				type_name(r->type), r->size_bytes, r->nr_pages,
+				r->pages[0] ? page_to_nid(r->pages[0]) : -1);
+	}
+	if (!ret)
+		r->users++;
+	mutex_unlock(&r->lock);
+	if (ret)
+		return ret;
+
+	file->private_data = r;
+	return 0;
+}
+
+/*
+ * Every mapping holds a reference on the file, so release only runs once the
+ * last mmap is gone and the pages can be returned.
+ */
+static int memcache_release(struct inode *inode, struct file *file)
+{
+	struct memcache_region *r = file->private_data;
+
+	if (!r)
+		return 0;
+
+	mutex_lock(&r->lock);
+	if (!--r->users) {
+		pr_info(DRV_NAME ": free %s size_bytes=%zu\n", type_name(r->type), r->size_bytes);
+		if (type_is_dma(r->type))
+			region_dma_free(r);
+		else
+			region_free(r);
+	}
+	mutex_unlock(&r->lock);
+	return 0;
+}
+
+/*
+ * Only WB or the attribute the user mappings already have, so a switch never
+ * adds an alias with a cache type the module does not create anyway.
+ */
+static long region_set_attr(struct file *file, struct memcache_region *r, void __user *arg)
+{
+#ifdef CONFIG_X86
+	struct memcache_attr_req req;
+	unsigned long first, n;
+	u64 t0, t1, t2;
+	int ret;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (!r->pages)
+		return -EOPNOTSUPP;
+	if (req.attr != MEMCACHE_WB && (req.attr != r->type || r->type == MEMCACHE_WB))
+		return -EINVAL;
+	if (!req.length || !PAGE_ALIGNED(req.offset) || !PAGE_ALIGNED(req.length))
+		return -EINVAL;
+	first = req.offset >> PAGE_SHIFT;
+	n = req.length >> PAGE_SHIFT;
+	if (first >= r->nr_pages || n > r->nr_pages - first)
+		return -EINVAL;
+
+	mutex_lock(&r->lock);
+	req.runs = 0;
+	t0 = ktime_get_ns();
+	ret = region_set_direct(r, first, n, req.attr != MEMCACHE_WB, &req.runs);
+	t1 = ktime_get_ns();
+	/* Shoots down the TLBs of every CPU running a process that maps the range; it refaults. */
+	unmap_mapping_range(file->f_mapping, req.offset, req.length, 1);
+	t2 = ktime_get_ns();
+	mutex_unlock(&r->lock);
+
+	req.set_ns = t1 - t0;
+	req.zap_ns = t2 - t1;
+	req.total_ns = t2 - t0;
+	atomic64_inc(&r->stats.attr_changes);
+	atomic64_add(req.total_ns, &r->stats.attr_ns);
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+	return ret;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static long memcache_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct memcache_region *r = file->private_data;
+	u64 v;
+
+	switch (cmd) {
+	case MEMCACHE_IOCTL_GET_SIZE:
+		v = r->size_bytes;
+		if (copy_to_user((void __user *)arg, &v, sizeof(v)))
+			return -EFAULT;
+		return 0;
+	case MEMCACHE_IOCTL_SET_ATTR:
+		return region_set_attr(file, r, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static loff_t memcache_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct memcache_region *r = file->private_data;
+
+	return fixed_size_llseek(file, offset, whence, r->size_bytes);
+}
+
+/*
+ * dma_alloc_wc() only remaps its kernel alias write-combined for non-coherent
+ * devices on architectures with DMA write combining. Elsewhere (any x86) the
+ * alias is the WB linear map, and read()/write() would time WB as "dma_wc".
+ */
+static bool dma_wc_alias_is_wc(void)
+{
+#ifdef CONFIG_ARCH_HAS_DMA_WRITE_COMBINE
+	return !dev_is_dma_coherent(&memcache_pdev->dev);
+#else
+	return false;
+#endif
+}
+
+/* Copy between the iterator and the region through its kernel alias. */
+static ssize_t region_rw(struct kiocb *iocb, struct iov_iter *iter, bool write)
+{
+	struct memcache_region *r = iocb->ki_filp->private_data;
+	char *kaddr = r->pages ? r->vaddr : r->cpu_addr;
+	loff_t pos = iocb->ki_pos;
+	size_t left, done = 0;
+
+	if (!kaddr)
+		return -ENXIO;
+	if (r->type == MEMCACHE_DMA_WC && !dma_wc_alias_is_wc())
+		return -EOPNOTSUPP;
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= r->size_bytes)
+		return write && iov_iter_count(iter) ? -ENOSPC : 0;
+
+	left = min_t(size_t, iov_iter_count(iter), r->size_bytes - pos);
+	while (left) {
+		size_t n = min_t(size_t, left, REGION_RW_CHUNK);
+		size_t copied;
+
+		if (write)
+			copied = copy_from_iter(kaddr + pos + done, n, iter);
+		else
+			copied = copy_to_iter(kaddr + pos + done, n, iter);
+		done += copied;
+		left -= copied;
+		if (copied != n)
+			break;
+		cond_resched();
+	}
+	/* Drain write-combining buffers before returning to the caller. */
+	if (write)
+		wmb();
+	if (!done && left)
+		return -EFAULT;
+
+	iocb->ki_pos = pos + done;
+	if (write) {
+		atomic64_inc(&r->stats.writes);
+		atomic64_add(done, &r->stats.write_bytes);
+	} else {
+		atomic64_inc(&r->stats.reads);
+		atomic64_add(done, &r->stats.read_bytes);
+	}
+	return done;
+}
+
+static ssize_t memcache_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return region_rw(iocb, to, false);
+}
+
+static ssize_t memcache_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return region_rw(iocb, from, true);
+}
+
+static void region_map_account(struct memcache_region *r, struct vm_area_struct *vma, int delta)
+{
+	struct memcache_stats *st = &r->stats;
+
+	atomic64_add(delta, &st->maps_active);
+	atomic64_add(delta * (s64)(vma->vm_end - vma->vm_start), &st->bytes_mapped);
+	atomic64_add(delta, &st->memtype_maps[vma_memtype(vma)]);
+	if (delta > 0)
+		atomic64_inc(&st->maps_total);
+}
+
+static void memcache_vm_open(struct vm_area_struct *vma)
+{
+	region_map_account(vma->vm_file->private_data, vma, 1);
+}
+
+static void memcache_vm_close(struct vm_area_struct *vma)
+{
+	region_map_account(vma->vm_file->private_data, vma, -1);
+}
+
+/*
+ * __split_vma() calls ->open on the new piece, which would count a partial
+ * munmap/mprotect as a fresh mapping and skew bytes_mapped.
+ */
+static int memcache_vm_may_split(struct vm_area_struct *vma, unsigned long addr)
+{
+	return -EINVAL;
+}
+
+static vm_fault_t memcache_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct memcache_region *r = vma->vm_file->private_data;
+	vm_fault_t ret;
+	u64 t0;
+
+	if (vmf->pgoff >= r->nr_pages)
+		return VM_FAULT_SIGBUS;
+
+	t0 = ktime_get_ns();
+	/* Returns VM_FAULT_NOPAGE also when another thread won the race. */
+	ret = vmf_insert_page(vma, vmf->address & PAGE_MASK, r->pages[vmf->pgoff]);
+	atomic64_add(ktime_get_ns() - t0, &r->stats.fault_ns);
+	atomic64_inc(&r->stats.faults);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define MEMCACHE_VM_SPLIT .may_split = memcache_vm_may_split,
+#else
+#define MEMCACHE_VM_SPLIT .split = memcache_vm_may_split,
+#endif
+
+static const struct vm_operations_struct memcache_vm_ops = {
+	.open = memcache_vm_open,
+	.close = memcache_vm_close,
+	MEMCACHE_VM_SPLIT
+	.fault = memcache_vm_fault,
+};
+
+static int region_insert_pages(struct memcache_region *r, struct vm_area_struct *vma)
+{
+	unsigned long nr = vma_pages(vma);
+	unsigned long off = vma->vm_pgoff;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	while (nr) {
+		unsigned long left = nr;
+
+		ret = vm_insert_pages(vma, vma->vm_start + ((off - vma->vm_pgoff) << PAGE_SHIFT),
+				      &r->pages[off], &left);
+		if (ret)
+			return ret;
+		/* vm_insert_pages() may stop early; left is what it did not map. */
+		off += nr - left;
+		nr = left;
+	}
+#else
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		ret = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), r->pages[off + i]);
+		if (ret)
+			return ret;
+	}
+#endif
+	return 0;
+}
+
+static const struct vm_operations_struct memcache_dma_vm_ops = {
+	.open = memcache_vm_open,
+	.close = memcache_vm_close,
+	MEMCACHE_VM_SPLIT
+};
+
+/* Map exactly the way a driver would: dma_mmap_*() picks the page protection. */
+static int memcache_dma_mmap(struct memcache_region *r, struct vm_area_struct *vma)
+{
+	struct device *dev = &memcache_pdev->dev;
+	ktime_t t0, dt;
+	int ret;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &memcache_dma_vm_ops;
+
+	t0 = ktime_get();
+	switch (r->type) {
+	case MEMCACHE_DMA_WB:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		ret = dma_mmap_pages(dev, vma, r->size_bytes, r->dma_page);
+#else
+		ret = -EOPNOTSUPP;
+#endif
+		break;
+	case MEMCACHE_DMA_COHERENT:
+		ret = dma_mmap_coherent(dev, vma, r->cpu_addr, r->dma_handle, r->size_bytes);
+		break;
+	case MEMCACHE_DMA_WC:
+		ret = dma_mmap_wc(dev, vma, r->cpu_addr, r->dma_handle, r->size_bytes);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+	dt = ktime_sub(ktime_get(), t0);
+	pr_info(DRV_NAME ": mmap %s requested=%lu bytes (%lu pages) pgoff=%lu remap=%lld us memtype=%s ret=%d\n",
+		type_name(r->type), vma->vm_end - vma->vm_start, vma_pages(vma), vma->vm_pgoff,
+		ktime_to_us(dt), memtype_name(vma_memtype(vma)), ret);
+	if (ret)
+		return ret;
+
+	atomic64_add(vma_pages(vma), &r->stats.inserts);
+	atomic64_add(ktime_to_ns(dt), &r->stats.insert_ns);
+	region_map_account(r, vma, 1);
+	return 0;
+}
+
+static int memcache_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct memcache_region *r = file->private_data;
+	unsigned long requested = vma->vm_end - vma->vm_start;
+	ktime_t t0, dt;
+	int ret;
+
+	if (!r)
+		return -EINVAL;
+
+	if (vma->vm_pgoff >= r->nr_pages || vma_pages(vma) > r->nr_pages - vma->vm_pgoff)
+		return -EINVAL;
+
+	if (type_is_dma(r->type))
+		return memcache_dma_mmap(r, vma);
+
+	/* VM_MIXEDMAP up front: the fault handler inserts pages under the mmap read lock. */
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP;
+	vma->vm_page_prot = type_pgprot(r->type, vma->vm_page_prot);
+	vma->vm_ops = &memcache_vm_ops;
+
+	if (mmap_fault) {
+		pr_info(DRV_NAME ": mmap %s requested=%lu bytes (%lu pages) pgoff=%lu fault memtype=%s\n",
+			type_name(r->type), requested, requested >> PAGE_SHIFT, vma->vm_pgoff,
+			memtype_name(vma_memtype(vma)));
+		region_map_account(r, vma, 1);
+		return 0;
+	}
+
+	t0 = ktime_get();
+	ret = region_insert_pages(r, vma);
+	dt = ktime_sub(ktime_get(), t0);
+	pr_info(DRV_NAME ": mmap %s requested=%lu bytes (%lu pages) pgoff=%lu insert=%lld us memtype=%s ret=%d\n",
+		type_name(r->type), requested, requested >> PAGE_SHIFT, vma->vm_pgoff,
+		ktime_to_us(dt), memtype_name(vma_memtype(vma)), ret);
+	if (ret)
+		return ret;
+
+	atomic64_add(vma_pages(vma), &r->stats.inserts);
+	atomic64_add(ktime_to_ns(dt), &r->stats.insert_ns);
+	region_map_account(r, vma, 1);
+	return 0;
+}
+
+static int region_stats_show(struct seq_file *m, void *v)
+{
+	struct memcache_region *r = m->private;
+	struct memcache_stats *st = &r->stats;
+	unsigned long runs = 0, run = 0, max_run = 0;
+	unsigned long *node_pages;
+	unsigned long i;
+	unsigned int mt;
+	int nid;
+
+	mutex_lock(&r->lock);
+	seq_printf(m, "type: %s\n", type_name(r->type));
+	seq_printf(m, "users: %u\n", r->users);
+	seq_printf(m, "size_bytes: %zu\n", r->size_bytes);
+	seq_printf(m, "pages: %lu\n", r->nr_pages);
+	if (r->cpu_addr) {
+		seq_printf(m, "dma_addr: %pad\n", &r->dma_handle);
+		if (virt_addr_valid(r->cpu_addr))
+			seq_printf(m, "node_pages: %d=%lu\n", page_to_nid(virt_to_page(r->cpu_addr)),
+				   r->nr_pages);
+	}
+	if (r->pages) {
+		node_pages = kcalloc(nr_node_ids, sizeof(*node_pages), GFP_KERNEL);
+		for (i = 0; i < r->nr_pages; i++) {
+			if (node_pages)
+				node_pages[page_to_nid(r->pages[i])]++;
+			if (i && page_to_pfn(r->pages[i]) == page_to_pfn(r->pages[i - 1]) + 1) {
+				run++;
+			} else {
+				runs++;
+				run = 1;
+			}
+			if (run > max_run)
+				max_run = run;
+		}
+		seq_puts(m, "node_pages:");
+		if (node_pages) {
+			for_each_node(nid) {
+				if (node_pages[nid])
+					seq_printf(m, " %d=%lu", nid, node_pages[nid]);
+			}
+		}
+		seq_putc(m, '\n');
+		kfree(node_pages);
+		seq_printf(m, "phys_runs: %lu\n", runs);
+		seq_printf(m, "max_run_pages: %lu\n", max_run);
+		if (r->attr_set)
+			seq_printf(m, "attr_pages: %u\n", bitmap_weight(r->attr_set, r->nr_pages));
+	}
+	mutex_unlock(&r->lock);
+
+	seq_printf(m, "mmaps_active: %lld\n", atomic64_read(&st->maps_active));
+	seq_printf(m, "mmaps_total: %lld\n", atomic64_read(&st->maps_total));
+	seq_printf(m, "bytes_mapped: %lld\n", atomic64_read(&st->bytes_mapped));
+	seq_puts(m, "mmap_memtype:");
+	for (mt = 0; mt < MEMTYPE_NUM; mt++) {
+		if (atomic64_read(&st->memtype_maps[mt]))
+			seq_printf(m, " %s=%lld", memtype_name(mt), atomic64_read(&st->memtype_maps[mt]));
+	}
+	seq_putc(m, '\n');
+	seq_printf(m, "faults: %lld\n", atomic64_read(&st->faults));
+	seq_printf(m, "fault_ns: %lld\n", atomic64_read(&st->fault_ns));
+	seq_printf(m, "inserts: %lld\n", atomic64_read(&st->inserts));
+	seq_printf(m, "insert_ns: %lld\n", atomic64_read(&st->insert_ns));
+	seq_printf(m, "reads: %lld\n", atomic64_read(&st->reads));
+	seq_printf(m, "read_bytes: %lld\n", atomic64_read(&st->read_bytes));
+	seq_printf(m, "writes: %lld\n", atomic64_read(&st->writes));
+	seq_printf(m, "write_bytes: %lld\n", atomic64_read(&st->write_bytes));
+	seq_printf(m, "attr_changes: %lld\n", atomic64_read(&st->attr_changes));
+	seq_printf(m, "attr_ns: %lld\n", atomic64_read(&st->attr_ns));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(region_stats);
+
+static const struct file_operations memcache_fops = {
+	.owner = THIS_MODULE,
+	.open = memcache_open,
+	.release = memcache_release,
+	.unlocked_ioctl = memcache_ioctl,
+	.mmap = memcache_mmap,
+	.llseek = memcache_llseek,
+	.read_iter = memcache_read_iter,
+	.write_iter = memcache_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+};
+
 static int __init memcache_init(void)
 {
 	int ret;
 	int i;
-	size_t size_bytes;
 
-	size_bytes = (size_t)size_mb * 1024 * 1024;
-	if (!size_bytes)
-		return -EINVAL;
+	for (i = 0; i < MEMCACHE_MAX; i++) {
+		if (!type_size_bytes((enum memcache_type)i))
+			return -EINVAL;
+	}
 
 	if (numa_node >= 0 && !node_online(numa_node)) {
 		pr_err(DRV_NAME ": numa_node=%d is not online\n", numa_node);
 		return -EINVAL;
 	}
 
-	pr_info(DRV_NAME ": init size_mb=%u size_bytes=%zu numa_node=%d\n", size_mb, size_bytes,
-		numa_node);
+	pr_info(DRV_NAME ": init size_mb=%u wb_size_mb=%u uc_size_mb=%u wc_size_mb=%u numa_node=%d\n",
+		size_mb, wb_size_mb, uc_size_mb, wc_size_mb, numa_node);
+
+	for (i = 0; i < MEMCACHE_MAX; i++) {
+		regions[i].type = (enum memcache_type)i;
+		mutex_init(&regions[i].lock);
+	}
+
+	/* The DMA devices are optional: without the platform device they fail to open. */
+	memcache_pdev = platform_device_register_simple(DRV_NAME "_dma", PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(memcache_pdev)) {
+		pr_warn(DRV_NAME ": dma platform device failed: %ld\n", PTR_ERR(memcache_pdev));
+		memcache_pdev = NULL;
+	} else if (dma_coerce_mask_and_coherent(&memcache_pdev->dev, DMA_BIT_MASK(64))) {
+		pr_warn(DRV_NAME ": dma mask setup failed\n");
+		platform_device_unregister(memcache_pdev);
+		memcache_pdev = NULL;
+	}
 
 	ret = alloc_chrdev_region(&memcache_devt, 0, MEMCACHE_MAX, DRV_NAME);
 	if (ret)
-		return ret;
+		goto err_pdev;
 
 	cdev_init(&memcache_cdev, &memcache_fops);
 	memcache_cdev.owner = THIS_MODULE;
@@ -217,31 +1103,27 @@ static int __init memcache_init(void)
 		goto err_cdev;
 	}
 
-	for (i = 0; i < MEMCACHE_MAX; i++) {
-		ret = region_alloc(&regions[i], (enum memcache_type)i, size_bytes);
-		if (ret)
-			goto err_regions;
-	}
+	memcache_debugfs = debugfs_create_dir(DRV_NAME, NULL);
 
 	for (i = 0; i < MEMCACHE_MAX; i++) {
+		struct dentry *dir = debugfs_create_dir(type_name((enum memcache_type)i), memcache_debugfs);
+
+		debugfs_create_file("stats", 0444, dir, &regions[i], &region_stats_fops);
 		device_create(memcache_class, NULL, memcache_devt + i, NULL, "%s_%s", DEV_BASENAME,
 			      type_name((enum memcache_type)i));
-		pr_info(DRV_NAME ": /dev/%s_%s size_bytes=%zu pages=%lu first_page_nid=%d\n", DEV_BASENAME,
-			type_name((enum memcache_type)i), regions[i].size_bytes, regions[i].nr_pages,
-			(regions[i].pages && regions[i].pages[0]) ? page_to_nid(regions[i].pages[0]) : -1);
+		pr_info(DRV_NAME ": /dev/%s_%s size_bytes=%zu (allocated on first open)\n", DEV_BASENAME,
+			type_name((enum memcache_type)i), type_size_bytes((enum memcache_type)i));
 	}
 
 	return 0;
 
-err_regions:
-	for (i = 0; i < MEMCACHE_MAX; i++)
-		region_free(&regions[i]);
-	if (memcache_class)
-		class_destroy(memcache_class);
 err_cdev:
 	cdev_del(&memcache_cdev);
 err_unreg:
 	unregister_chrdev_region(memcache_devt, MEMCACHE_MAX);
+err_pdev:
+	if (memcache_pdev)
+		platform_device_unregister(memcache_pdev);
 	return ret;
 }
 
@@ -249,6 +1131,8 @@ static void __exit memcache_exit(void)
 {
 	int i;
 
+	debugfs_remove_recursive(memcache_debugfs);
+
 	for (i = 0; i < MEMCACHE_MAX; i++)
 		device_destroy(memcache_class, memcache_devt + i);
 
@@ -260,6 +1144,9 @@ static void __exit memcache_exit(void)
 
 	cdev_del(&memcache_cdev);
 	unregister_chrdev_region(memcache_devt, MEMCACHE_MAX);
+
+	if (memcache_pdev)
+		platform_device_unregister(memcache_pdev);
 }
 
 module_init(memcache_init);
@@ -267,4 +1154,4 @@ module_exit(memcache_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("memcachetest");
-MODULE_DESCRIPTION("Cache attribute test: wb/uc/wc mmap regions");
+MODULE_DESCRIPTION("Cache attribute test: wb/uc/wc and DMA API mmap regions");
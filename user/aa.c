@@ -5,6 +5,8 @@
 #include <x86intrin.h>
 #include <string.h>
 #include <stdlib.h>
+#include "hist.h"
+#include "timing.h"
 
 // 测试结构
 #define BUFFER_SIZE (64 * 1024) // 64KB
@@ -14,26 +16,23 @@
 #define SFENCE() __asm__ volatile("sfence" ::: "memory")
 #define MFENCE() __asm__ volatile("mfence" ::: "memory")
 #define LFENCE() __asm__ volatile("lfence" ::: "memory")
-// 时间测量
-static inline uint64_t rdtsc_ordered(void)
-{
-	unsigned int lo, hi;
-	__asm__ volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
-	return ((uint64_t)hi << 32) | lo;
-}
 
-static void run_one_variant(const char *name, int do_uc_marker, int do_sfence,
+static void run_one_variant(const char *tag, const char *name, int do_uc_marker, int do_sfence,
 			    uint8_t *wc_buffer, uint8_t *uc_buffer, uint8_t *check_buffer)
 {
 	printf("%s\n", name);
 	uint64_t total_write = 0;
 	uint64_t total_read = 0;
 	int failures = 0;
+	struct samples ws, rs;
+	char label[128];
+	samples_init(&ws, "cycles");
+	samples_init(&rs, "cycles");
 	for (int i = 0; i < ITERATIONS; i++) {
 		// 重置检查缓冲区
 		memset(check_buffer, 0, ALIGN_SIZE);
 		SFENCE();
-		uint64_t w0 = rdtsc_ordered();
+		uint64_t w0 = tsc_begin();
 		// 使用MOVNT向WC缓冲区写入
 		for (int j = 0; j < ALIGN_SIZE; j += 8) {
 			_mm_stream_si64((long long*)(wc_buffer + j), 0x0123456789ABCDEF);
@@ -43,13 +42,15 @@ static void run_one_variant(const char *name, int do_uc_marker, int do_sfence,
 			*((volatile uint64_t*)uc_buffer) = 0xDEADBEEFCAFEBABE;
 		if (do_sfence)
 			SFENCE();
-		uint64_t w1 = rdtsc_ordered();
-		total_write += (w1 - w0);
+		uint64_t w1 = tsc_end();
+		total_write += tsc_delta(w0, w1);
+		samples_add(&ws, tsc_delta(w0, w1));
 		// 立即从WC缓冲区读取数据到检查缓冲区
-		uint64_t start = rdtsc_ordered();
+		uint64_t start = tsc_begin();
 		memcpy(check_buffer, wc_buffer, ALIGN_SIZE);
-		uint64_t end = rdtsc_ordered();
-		total_read += (end - start);
+		uint64_t end = tsc_end();
+		total_read += tsc_delta(start, end);
+		samples_add(&rs, tsc_delta(start, end));
 		// 检查数据一致性
 		int valid = 1;
 		for (int j = 0; j < ALIGN_SIZE; j += 8) {
@@ -64,6 +65,12 @@ static void run_one_variant(const char *name, int do_uc_marker, int do_sfence,
 	}
 	printf(" 平均写入耗时: %lu cycles\n", total_write / ITERATIONS);
 	printf(" 平均读取延迟: %lu cycles\n", total_read / ITERATIONS);
+	snprintf(label, sizeof(label), " %s write", tag);
+	samples_report(label, &ws, "cycles", 1.0);
+	snprintf(label, sizeof(label), " %s read", tag);
+	samples_report(label, &rs, "cycles", 1.0);
+	samples_free(&ws);
+	samples_free(&rs);
 	printf(" 数据不一致次数: %d/%d (%.1f%%)\n", failures, ITERATIONS, (failures * 100.0) / ITERATIONS);
 	if (failures)
 		printf(" 结论: 观察到数据不一致，可能存在排序/可见性问题\n\n");
@@ -73,20 +80,20 @@ static void run_one_variant(const char *name, int do_uc_marker, int do_sfence,
 
 void test_a(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer)
 {
-	run_one_variant("测试A: baseline (no uc marker, no sfence)", 0, 0, wc_buffer, uc_buffer, check_buffer);
+	run_one_variant("A", "测试A: baseline (no uc marker, no sfence)", 0, 0, wc_buffer, uc_buffer, check_buffer);
 }
 
 void test_b(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer)
 {
-	run_one_variant("测试B: sfence after nt stores", 0, 1, wc_buffer, uc_buffer, check_buffer);
+	run_one_variant("B", "测试B: sfence after nt stores", 0, 1, wc_buffer, uc_buffer, check_buffer);
 }
 
 void test_c(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer)
 {
-	run_one_variant("测试C: uc marker only (no sfence)", 1, 0, wc_buffer, uc_buffer, check_buffer);
+	run_one_variant("C", "测试C: uc marker only (no sfence)", 1, 0, wc_buffer, uc_buffer, check_buffer);
 }
 
 void test_d(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer)
 {
-	run_one_variant("测试D: uc marker + sfence", 1, 1, wc_buffer, uc_buffer, check_buffer);
+	run_one_variant("D", "测试D: uc marker + sfence", 1, 1, wc_buffer, uc_buffer, check_buffer);
 }
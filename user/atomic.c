@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "atomic.h"
+#include "hist.h"
+#include "timing.h"
+#include "topo.h"
+
+#define ATOMIC_LINE 64
+/* Ops between two timer reads on the calling thread, and between stop checks on helpers. */
+#define ATOMIC_BATCH 32
+/* Seconds per point. */
+#define ATOMIC_WINDOW 0.05
+
+enum atomic_op {
+	ATOMIC_XADD,
+	ATOMIC_CMPXCHG,
+	ATOMIC_CMPXCHG16B,
+	ATOMIC_XCHG,
+	ATOMIC_OP_NR,
+};
+
+static const char *const atomic_op_names[ATOMIC_OP_NR] = {
+	[ATOMIC_XADD] = "xadd",
+	[ATOMIC_CMPXCHG] = "cmpxchg",
+	[ATOMIC_CMPXCHG16B] = "cmpxchg16b",
+	[ATOMIC_XCHG] = "xchg",
+};
+
+/* Point results for the table. */
+#define ATOMIC_SKIPPED -1.0
+#define ATOMIC_TRAPPED -2.0
+
+struct atomic_helper {
+	enum atomic_op op;
+	volatile void *p;
+	/* Ops so far; read by the calling thread at the window edges. */
+	uint64_t ops;
+	uint64_t sink;
+} __attribute__((aligned(ATOMIC_LINE)));
+
+static int atomic_counts[ATOMIC_MAX_COUNTS];
+static int atomic_ncounts;
+static char atomic_place[64];
+static int atomic_on;
+
+static int have_cx16;
+static int have_split_detect;
+static int have_bus_detect;
+static char split_mode[32] = "unsupported";
+static int split_mitigate = -1;
+
+static struct atomic_helper helpers[ATOMIC_MAX_THREADS];
+static struct topo_group atomic_group;
+static int atomic_go;
+static volatile uint64_t atomic_sink;
+
+/* Where a SIGBUS from a split lock returns to, per thread. */
+static __thread sigjmp_buf *trap_jmp;
+static volatile sig_atomic_t atomic_trapped;
+
+int atomic_parse(const char *spec)
+{
+	char buf[256];
+	char *place, *save, *tok;
+
+	atomic_ncounts = 0;
+	atomic_place[0] = '\0';
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+	place = strchr(buf, ':');
+	if (place) {
+		*place++ = '\0';
+		if (!*place || snprintf(atomic_place, sizeof(atomic_place), "%s", place) >= (int)sizeof(atomic_place))
+			return -1;
+	}
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *end;
+		long v = strtol(tok, &end, 10);
+
+		if (atomic_ncounts >= ATOMIC_MAX_COUNTS || end == tok || *end || v < 1 || v > ATOMIC_MAX_THREADS)
+			return -1;
+		atomic_counts[atomic_ncounts++] = (int)v;
+	}
+	if (!atomic_ncounts)
+		atomic_counts[atomic_ncounts++] = 1;
+	atomic_on = 1;
+	return 0;
+}
+
+int atomic_enabled(void)
+{
+	return atomic_on;
+}
+
+/* Whether /proc/cpuinfo lists flag for the first CPU. */
+static int cpuinfo_flag(const char *flag)
+{
+	char line[8192];
+	size_t len = strlen(flag);
+	int found = 0;
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *c;
+
+		if (strncmp(line, "flags", 5))
+			continue;
+		for (c = strstr(line, flag); c; c = strstr(c + 1, flag)) {
+			if (c[-1] == ' ' && (c[len] == ' ' || c[len] == '\n')) {
+				found = 1;
+				break;
+			}
+		}
+		break;
+	}
+	fclose(f);
+	return found;
+}
+
+void atomic_init(void)
+{
+	char line[4096], *c;
+	FILE *f;
+
+#if defined(__x86_64__)
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		have_cx16 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_CMPXCHG16B);
+	}
+#endif
+	have_split_detect = cpuinfo_flag("split_lock_detect");
+	have_bus_detect = cpuinfo_flag("bus_lock_detect");
+	if (!have_split_detect)
+		return;
+	/* warn unless the command line says otherwise. */
+	snprintf(split_mode, sizeof(split_mode), "warn");
+	f = fopen("/proc/cmdline", "r");
+	if (f) {
+		if (fgets(line, sizeof(line), f) && (c = strstr(line, "split_lock_detect="))) {
+			c += strlen("split_lock_detect=");
+			c[strcspn(c, " \n")] = '\0';
+			snprintf(split_mode, sizeof(split_mode), "%s", c);
+		}
+		fclose(f);
+	}
+	f = fopen("/proc/sys/kernel/split_lock_mitigate", "r");
+	if (f) {
+		if (fgets(line, sizeof(line), f))
+			split_mitigate = atoi(line);
+		fclose(f);
+	}
+}
+
+void atomic_print(void)
+{
+	int k;
+
+	if (!atomic_on)
+		return;
+	printf("atomic: threads=");
+	for (k = 0; k < atomic_ncounts; k++)
+		printf("%s%d", k ? "," : "", atomic_counts[k]);
+	if (atomic_place[0])
+		printf(":%s", atomic_place);
+	printf(" cmpxchg16b=%s split_lock_detect=%s", have_cx16 ? "yes" : "no", split_mode);
+	if (split_mitigate >= 0)
+		printf(" split_lock_mitigate=%d", split_mitigate);
+	printf(" bus_lock_detect=%s\n", have_bus_detect ? "yes" : "no");
+}
+
+#if defined(__x86_64__)
+static __inline__ __attribute__((always_inline)) uint64_t lock_xadd(volatile void *p, uint64_t v)
+{
+	asm volatile("lock xaddq %0, %1" : "+r"(v), "+m"(*(volatile uint64_t *)p) :: "memory");
+	return v;
+}
+
+/* Returns the old value; the store happened when it equals expect. */
+static __inline__ __attribute__((always_inline)) uint64_t lock_cmpxchg(volatile void *p, uint64_t expect,
+								       uint64_t v)
+{
+	asm volatile("lock cmpxchgq %2, %1" : "+a"(expect), "+m"(*(volatile uint64_t *)p) : "r"(v) : "memory", "cc");
+	return expect;
+}
+
+static __inline__ __attribute__((always_inline)) uint64_t lock_cmpxchg16b(volatile void *p, uint64_t lo,
+									  uint64_t hi)
+{
+	asm volatile("lock cmpxchg16b %2"
+		     : "+a"(lo), "+d"(hi), "+m"(*(volatile unsigned __int128 *)p)
+		     : "b"(lo + 1), "c"(hi)
+		     : "memory", "cc");
+	return lo;
+}
+
+/* xchg with memory is locked without the prefix. */
+static __inline__ __attribute__((always_inline)) uint64_t xchg(volatile void *p, uint64_t v)
+{
+	asm volatile("xchgq %0, %1" : "+r"(v), "+m"(*(volatile uint64_t *)p) :: "memory");
+	return v;
+}
+#else
+static __inline__ __attribute__((always_inline)) uint64_t lock_xadd(volatile void *p, uint64_t v)
+{
+	return __atomic_fetch_add((uint64_t *)p, v, __ATOMIC_SEQ_CST);
+}
+
+static __inline__ __attribute__((always_inline)) uint64_t lock_cmpxchg(volatile void *p, uint64_t expect,
+								       uint64_t v)
+{
+	__atomic_compare_exchange_n((uint64_t *)p, &expect, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return expect;
+}
+
+static __inline__ __attribute__((always_inline)) uint64_t lock_cmpxchg16b(volatile void *p, uint64_t lo,
+									  uint64_t hi)
+{
+	(void)p;
+	(void)hi;
+	return lo;
+}
+
+static __inline__ __attribute__((always_inline)) uint64_t xchg(volatile void *p, uint64_t v)
+{
+	return __atomic_exchange_n((uint64_t *)p, v, __ATOMIC_SEQ_CST);
+}
+#endif
+
+/* n ops; cmpxchg retries with the value it saw, so under contention some attempts fail. */
+static __attribute__((noinline)) uint64_t op_batch(enum atomic_op op, volatile void *p, unsigned int n)
+{
+	uint64_t v = 0, cur;
+	unsigned int i;
+
+	switch (op) {
+	case ATOMIC_XADD:
+		for (i = 0; i < n; i++)
+			v += lock_xadd(p, 1);
+		break;
+	case ATOMIC_CMPXCHG:
+		cur = *(volatile uint64_t *)p;
+		for (i = 0; i < n; i++) {
+			uint64_t old = lock_cmpxchg(p, cur, cur + 1);
+
+			cur = old == cur ? cur + 1 : old;
+		}
+		v = cur;
+		break;
+	case ATOMIC_CMPXCHG16B:
+		cur = *(volatile uint64_t *)p;
+		for (i = 0; i < n; i++) {
+			uint64_t old = lock_cmpxchg16b(p, cur, 0);
+
+			cur = old == cur ? cur + 1 : old;
+		}
+		v = cur;
+		break;
+	default:
+		for (i = 0; i < n; i++)
+			v = xchg(p, v + 1);
+		break;
+	}
+	return v;
+}
+
+static void on_sigbus(int sig)
+{
+	atomic_trapped = 1;
+	if (trap_jmp)
+		siglongjmp(*trap_jmp, 1);
+	/* Not ours: let the fault kill the process as it would have. */
+	signal(sig, SIG_DFL);
+}
+
+static void *helper_main(void *arg)
+{
+	struct atomic_helper *h = arg;
+	sigjmp_buf jb;
+
+	trap_jmp = &jb;
+	if (sigsetjmp(jb, 1))
+		return NULL;
+	topo_group_ready(&atomic_group);
+	while (!__atomic_load_n(&atomic_go, __ATOMIC_ACQUIRE))
+		if (topo_group_stopping(&atomic_group))
+			return NULL;
+	while (!topo_group_stopping(&atomic_group)) {
+		h->sink += op_batch(h->op, h->p, ATOMIC_BATCH);
+		__atomic_store_n(&h->ops, h->ops + ATOMIC_BATCH, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static int helpers_start(const int *cpus, int n, enum atomic_op op, volatile void *p)
+{
+	int i;
+
+	__atomic_store_n(&atomic_go, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < n; i++) {
+		memset(&helpers[i], 0, sizeof(helpers[i]));
+		helpers[i].op = op;
+		helpers[i].p = p;
+	}
+	return topo_group_start(&atomic_group, cpus, n, helper_main, helpers, sizeof(helpers[0]));
+}
+
+static uint64_t helpers_ops(int n)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += __atomic_load_n(&helpers[i].ops, __ATOMIC_RELAXED);
+	return sum;
+}
+
+/*
+ * One point: returns the Mops/s of all threads together, ATOMIC_SKIPPED or
+ * ATOMIC_TRAPPED after a SIGBUS; per-op latency of the calling thread goes
+ * to lat (ps).
+ */
+static double atomic_point(enum atomic_op op, volatile uint8_t *p, const int *cpus, int nhelpers,
+			   struct samples *lat)
+{
+	static sigjmp_buf jb;
+	double hz = timing_hz(), start, end;
+	uint64_t own = 0, h0, h1, sink = 0;
+
+	memset((void *)p, 0, 16);
+	atomic_trapped = 0;
+	if (nhelpers && helpers_start(cpus, nhelpers, op, p) != 0)
+		return ATOMIC_SKIPPED;
+	trap_jmp = &jb;
+	if (sigsetjmp(jb, 1)) {
+		trap_jmp = NULL;
+		topo_group_stop(&atomic_group);
+		return ATOMIC_TRAPPED;
+	}
+	__atomic_store_n(&atomic_go, 1, __ATOMIC_RELEASE);
+	h0 = helpers_ops(nhelpers);
+	start = now_sec();
+	do {
+		uint64_t t0, t1;
+
+		t0 = tsc_begin();
+		sink += op_batch(op, p, ATOMIC_BATCH);
+		t1 = tsc_end();
+		samples_add(lat, (uint64_t)((double)tsc_delta(t0, t1) * 1e12 / hz / ATOMIC_BATCH));
+		own += ATOMIC_BATCH;
+		end = now_sec();
+	} while (end - start < ATOMIC_WINDOW);
+	h1 = helpers_ops(nhelpers);
+	trap_jmp = NULL;
+	topo_group_stop(&atomic_group);
+	atomic_sink = sink;
+	if (atomic_trapped)
+		return ATOMIC_TRAPPED;
+	return (double)(own + h1 - h0) / (end - start) / 1e6;
+}
+
+void atomic_run(const struct bench_target *t, void *map)
+{
+	double mops[ATOMIC_OP_NR][2][ATOMIC_MAX_COUNTS];
+	struct sigaction sa, old;
+	struct samples lat;
+	int cpus[ATOMIC_MAX_THREADS];
+	int self = sched_getcpu(), ncpus;
+	int op, split, n;
+
+	if (t->size_bytes < 2 * ATOMIC_LINE) {
+		printf("%s atomic: target smaller than two lines\n", t->path);
+		return;
+	}
+	if (self < 0)
+		self = 0;
+	ncpus = topo_place_helpers(atomic_place, self, cpus, ATOMIC_MAX_THREADS);
+	if (ncpus < 0) {
+		printf("%s atomic: no cpus for %s\n", t->path, atomic_place);
+		return;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigbus;
+	sigaction(SIGBUS, &sa, &old);
+	samples_init(&lat, "ps");
+
+	for (op = 0; op < ATOMIC_OP_NR; op++) {
+		for (split = 0; split <= 1; split++) {
+			/* Split: the word straddles the first two lines. */
+			volatile uint8_t *p = (volatile uint8_t *)map + (split ? ATOMIC_LINE - 4 : 0);
+			int trapped = 0;
+
+			for (n = 0; n < atomic_ncounts; n++) {
+				int nhelpers = atomic_counts[n] - 1;
+				char label[384], place[512];
+				double v;
+
+				mops[op][split][n] = ATOMIC_SKIPPED;
+#if defined(__x86_64__)
+				/* cmpxchg16b needs 16-byte alignment; a split operand is #GP, not a split lock. */
+				if (op == ATOMIC_CMPXCHG16B && (split || !have_cx16))
+					continue;
+#else
+				if (op == ATOMIC_CMPXCHG16B || split)
+					continue;
+#endif
+				if (trapped)
+					continue;
+				if (nhelpers > ncpus) {
+					printf("%s atomic %s threads=%d: only %d helper cpus (%s)\n", t->path,
+					       atomic_op_names[op], atomic_counts[n], ncpus,
+					       atomic_place[0] ? atomic_place : "other online");
+					continue;
+				}
+				samples_reset(&lat);
+				v = atomic_point((enum atomic_op)op, p, cpus, nhelpers, &lat);
+				mops[op][split][n] = v;
+				if (v == ATOMIC_TRAPPED) {
+					printf("%s atomic %s %s threads=%d: split lock trapped (SIGBUS, split_lock_detect=%s)\n",
+					       t->path, atomic_op_names[op], split ? "split" : "aligned", atomic_counts[n],
+					       split_mode);
+					trapped = 1;
+					continue;
+				}
+				if (v == ATOMIC_SKIPPED)
+					continue;
+				topo_describe(place, sizeof(place), self, cpus, nhelpers);
+				printf("%s atomic %s %s threads=%d helpers=%s: %.4g Mops/s\n", t->path, atomic_op_names[op],
+				       split ? "split" : "aligned", atomic_counts[n], nhelpers ? place : "-", v);
+				snprintf(label, sizeof(label), "%.255s atomic %s %s threads=%d op", t->path,
+					 atomic_op_names[op], split ? "split" : "aligned", atomic_counts[n]);
+				samples_report(label, &lat, "ns", 1e3);
+			}
+		}
+	}
+	sigaction(SIGBUS, &old, NULL);
+	samples_free(&lat);
+
+	printf("\n==== atomic Mops/s: %s, split_lock_detect=%s ====\n", t->path, split_mode);
+	printf("%-20s", "op");
+	for (n = 0; n < atomic_ncounts; n++) {
+		char col[16];
+
+		snprintf(col, sizeof(col), "%dT", atomic_counts[n]);
+		printf(" %10s", col);
+	}
+	printf("\n");
+	for (op = 0; op < ATOMIC_OP_NR; op++) {
+		for (split = 0; split <= 1; split++) {
+			char row[32];
+
+			snprintf(row, sizeof(row), "%s %s", atomic_op_names[op], split ? "split" : "aligned");
+			printf("%-20s", row);
+			for (n = 0; n < atomic_ncounts; n++) {
+				double v = mops[op][split][n];
+
+				if (v == ATOMIC_TRAPPED)
+					printf(" %10s", "trap");
+				else if (v == ATOMIC_SKIPPED)
+					printf(" %10s", "-");
+				else
+					printf(" %10.4g", v);
+			}
+			printf("\n");
+		}
+	}
+}
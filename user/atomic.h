@@ -0,0 +1,30 @@
+#ifndef CACHE_BENCH_ATOMIC_H
+#define CACHE_BENCH_ATOMIC_H
+
+#include "target.h"
+
+/*
+ * Locked-operation throughput: lock xadd, lock cmpxchg, lock cmpxchg16b and
+ * xchg on one cache-line-aligned word and on one word split across two lines
+ * at the start of the mapping, from one thread and from several threads
+ * contending for the same address.
+ *
+ * Spec: threads[:cpus], e.g. 1,2,4:llc (threads default 1). The calling
+ * thread is one of them; helpers run on the CPUs of cpus (list or topo.h
+ * policy), or on the online CPUs after the calling thread's.
+ *
+ * Split locks trap with SIGBUS where the kernel runs split_lock_detect=fatal;
+ * the trap is caught and reported, and the remaining split points skipped.
+ */
+
+#define ATOMIC_MAX_COUNTS 8
+#define ATOMIC_MAX_THREADS 64
+
+int atomic_parse(const char *spec);
+int atomic_enabled(void);
+/* Reads the split-lock detection mode and the CPU features. */
+void atomic_init(void);
+void atomic_print(void);
+void atomic_run(const struct bench_target *t, void *map);
+
+#endif
@@ -8,202 +8,249 @@
 #include <sched.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#if defined(__x86_64__) || defined(__SSE2__)
-#include <emmintrin.h>
-#endif
-#if defined(__i386__) || defined(__x86_64__)
-#include <immintrin.h>
-#endif
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MEMCACHE_IOCTL_GET_SIZE 0
+#include "atomic.h"
+#include "daemon.h"
+#include "energy.h"
+#include "hist.h"
+#include "loaded.h"
+#include "pat.h"
+#include "precond.h"
+#include "prefetch.h"
+#include "replay.h"
+#include "results.h"
+#include "scenario.h"
+#include "store.h"
+#include "target.h"
+#include "timing.h"
+#include "topo.h"
+#include "uring.h"
+#include "verify.h"
+
+#define MAX_TARGETS 16
+#define MAX_MAPS 32
 
 #if defined(__i386__) || defined(__x86_64__)
-static __inline__ __attribute__((always_inline)) uint64_t rdtsc_ordered(void)
+static __inline__ __attribute__((always_inline)) void nt_fence(void)
 {
-	unsigned int lo, hi;
-	asm volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
-	return ((uint64_t)hi << 32) | lo;
+	asm volatile("sfence" ::: "memory");
 }
+#endif
 
-static double tsc_hz;
-
-static void tsc_init_once(void)
+static size_t page_size(void)
 {
-	struct timespec a, b, req;
-	uint64_t ta, tb;
-	double dt;
+	long page_sz = sysconf(_SC_PAGESIZE);
 
-	if (tsc_hz > 0.0)
-		return;
-
-	req.tv_sec = 0;
-	req.tv_nsec = 500000000;
+	return page_sz > 0 ? (size_t)page_sz : 4096;
+}
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &a);
-	ta = rdtsc_ordered();
-	nanosleep(&req, NULL);
-	tb = rdtsc_ordered();
-	clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+/* Write one word per page so fault-mode mappings are fully populated. */
+static void touch_pages(void *map, size_t len)
+{
+	volatile uint64_t *p;
+	size_t off, step = page_size();
 
-	dt = (double)(b.tv_sec - a.tv_sec) + (double)(b.tv_nsec - a.tv_nsec) / 1e9;
-	if (dt > 0.0 && tb > ta)
-		tsc_hz = (double)(tb - ta) / dt;
+	for (off = 0; off < len; off += step) {
+		p = (volatile uint64_t *)((char *)map + off);
+		*p = 0;
+	}
 }
 
-static __inline__ __attribute__((always_inline)) void nt_store_u64(uint64_t *addr, uint64_t v)
+static void *mmap_timed(const struct bench_target *t)
 {
-#if defined(__x86_64__)
-	asm volatile("movnti %1, %0" : "=m"(*addr) : "r"(v) : "memory");
-#else
-	asm volatile("movnti %1, %0" : "=m"(((uint32_t *)addr)[0]) : "r"((uint32_t)v) : "memory");
-	asm volatile("movnti %1, %0" : "=m"(((uint32_t *)addr)[1]) : "r"((uint32_t)(v >> 32)) : "memory");
-#endif
+	void *map;
+	double t0, t1, t2;
+
+	t0 = now_sec();
+	map = mmap(NULL, t->size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, t->offset);
+	t1 = now_sec();
+	if (map == MAP_FAILED)
+		return map;
+	touch_pages(map, t->size_bytes);
+	t2 = now_sec();
+
+	printf("%s mmap: %.3f ms first_touch: %.3f ms (%zu pages)\n", t->path, (t1 - t0) * 1e3,
+	       (t2 - t1) * 1e3, t->size_bytes / page_size());
+	return map;
 }
 
-static __inline__ __attribute__((always_inline)) void nt_store_2x64(uint64_t *addr, uint64_t lo, uint64_t hi)
+static volatile uint64_t *uc_fence_word;
+/* Kept open so targets backed by the same UC region can be recognised. */
+static struct bench_target uc_fence_target = { .fd = -1 };
+static size_t uc_fence_off;
+
+static void uc_fence_init(void)
 {
-#if defined(__x86_64__) || defined(__SSE2__)
-	if ((((uintptr_t)addr) & 0xf) == 0) {
-		__m128i v = _mm_set_epi64x((long long)hi, (long long)lo);
-		_mm_stream_si128((__m128i *)addr, v);
+	struct bench_target *t = &uc_fence_target;
+	void *map;
+	size_t map_len;
+
+	if (access(MEMCACHE_DEV_UC, F_OK) != 0)
+		return;
+	target_init(t, MEMCACHE_DEV_UC, 0);
+	if (target_open(t) != 0)
 		return;
-	}
-#endif
-	nt_store_u64(&addr[0], lo);
-	nt_store_u64(&addr[1], hi);
-}
 
-#if defined(__i386__) || defined(__x86_64__)
-static int nt_avx_supported;
+	map_len = (t->size_bytes >= page_size()) ? page_size() : t->size_bytes;
+	if (map_len < sizeof(uint64_t)) {
+		target_close(t);
+		return;
+	}
 
-static void nt_init_once(void)
-{
-	static int inited;
-	if (inited)
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (map == MAP_FAILED) {
+		target_close(t);
 		return;
-	inited = 1;
+	}
 
-#if defined(__GNUC__)
-	if (__builtin_cpu_supports("avx"))
-		nt_avx_supported = 1;
-#endif
+	uc_fence_off = map_len - sizeof(uint64_t);
+	uc_fence_word = (volatile uint64_t *)((char *)map + uc_fence_off);
+	*uc_fence_word = 0;
 }
 
-__attribute__((target("avx")))
-static void nt_store_4x64_avx(uint64_t *addr, uint64_t v0, uint64_t v1, uint64_t v2, uint64_t v3)
+/* Index of the UC fence word inside t's mapping, or n64 when they do not overlap. */
+static size_t uc_fence_index(const struct bench_target *t, size_t n64)
 {
-	__m256i v = _mm256_set_epi64x((long long)v3, (long long)v2, (long long)v1, (long long)v0);
-	_mm256_stream_si256((__m256i *)addr, v);
+	size_t off;
+
+	if (!uc_fence_word || !target_same_backing(t, &uc_fence_target))
+		return n64;
+	if (uc_fence_off < (size_t)t->offset)
+		return n64;
+	off = (uc_fence_off - (size_t)t->offset) / sizeof(uint64_t);
+	return off < n64 ? off : n64;
 }
 
-static __inline__ __attribute__((always_inline)) void nt_store_4x64(uint64_t *addr, uint64_t v0, uint64_t v1,
-						uint64_t v2, uint64_t v3)
+static __inline__ __attribute__((always_inline)) void uc_write_fence(uint64_t v)
 {
-	if (nt_avx_supported && ((((uintptr_t)addr) & 0x1f) == 0)) {
-		nt_store_4x64_avx(addr, v0, v1, v2, v3);
+	if (!uc_fence_word)
 		return;
-	}
-	nt_store_2x64(&addr[0], v0, v1);
-	nt_store_2x64(&addr[2], v2, v3);
+	*uc_fence_word = v;
+	//(void)*uc_fence_word;
 }
-#endif
 
-static __inline__ __attribute__((always_inline)) void nt_fence(void)
-{
-	asm volatile("sfence" ::: "memory");
-}
-#endif
+static int g_verify_failures;
 
-static double now_sec(void)
+/* Checks the store_word(i, iter) pattern, skipping word skip; reports the first bad word. */
+static int verify_pattern(const struct bench_target *t, const char *test, int iter, volatile uint64_t *p,
+			  size_t n64, size_t skip)
 {
-	struct timespec ts;
+	size_t bad = verify_seq_u64(p, n64, (uint64_t)iter, skip);
 
-#if defined(__i386__) || defined(__x86_64__)
-	tsc_init_once();
-	if (tsc_hz > 0.0) {
-		uint64_t t = rdtsc_ordered();
-		return (double)t / tsc_hz;
-	}
-#endif
-
-	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
-}
-
-static uint64_t get_size_ioctl(int fd)
-{
-	uint64_t sz = 0;
-	if (ioctl(fd, 0, &sz) != 0)
+	if (bad == n64)
 		return 0;
-	return sz;
+	fprintf(stderr,
+		"%s %s verify failed iter=%d idx=%zu offset=0x%llx got=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
+		t->path, test, iter, bad, (unsigned long long)t->offset + bad * sizeof(uint64_t), p[bad],
+		store_word(bad, (uint64_t)iter));
+	g_verify_failures++;
+	return -1;
 }
 
-static uint64_t expected_sum_u64(size_t n64, int iter)
+/* Per-iteration times of the test in progress, in ns. */
+static struct samples iter_samples;
+
+static double iter_lap(double t0, double t1)
 {
-	__uint128_t n = n64;
-	__uint128_t s0 = n * (n - 1) / 2;
-	__uint128_t si = (__uint128_t)iter * n;
-	__uint128_t s = s0 + si;
-	return (uint64_t)s;
+	samples_add(&iter_samples, (uint64_t)((t1 - t0) * 1e9));
+	return t1 - t0;
 }
 
-static volatile uint64_t *uc_fence_word;
+/* Energy and APERF/MPERF at the start of the test in progress. */
+static struct energy_snap test_snap;
 
-static void uc_fence_init(void)
+/*
+ * The window also covers verify passes, so energy is scaled to the timed
+ * passes by the window's average power.
+ */
+static void energy_report(const char *label, double mbps)
 {
-	int fd;
-	void *map;
-	uint64_t sz;
-	size_t map_len;
-	long page_sz;
+	struct energy_snap now;
+	struct energy_delta d;
+	double timed = iter_samples.h.sum / 1e9;
+	double gb = mbps * timed / 1024.0;
 
-	fd = open("/dev/memcache_uc", O_RDWR);
-	if (fd < 0)
-		return;
-
-	sz = get_size_ioctl(fd);
-	page_sz = sysconf(_SC_PAGESIZE);
-	if (page_sz <= 0)
-		page_sz = 4096;
-	map_len = (sz >= (uint64_t)page_sz) ? (size_t)page_sz : (size_t)sz;
-	if (map_len < sizeof(uint64_t)) {
-		close(fd);
+	if (!energy_available())
 		return;
-	}
-
-	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		close(fd);
+	energy_snap(&now);
+	energy_diff(&test_snap, &now, &d);
+	if (d.sec <= 0.0 || gb <= 0.0)
 		return;
-	}
-
-	uc_fence_word = (volatile uint64_t *)((char *)map + (map_len - sizeof(uint64_t)));
-	*uc_fence_word = 0;
-	close(fd);
+	printf("%s energy:", label);
+	if (d.have_pkg)
+		printf(" pkg=%.3f J/GB (%.1f W)", d.pkg_j / d.sec * timed / gb, d.pkg_j / d.sec);
+	if (d.have_dram)
+		printf(" dram=%.3f J/GB (%.1f W)", d.dram_j / d.sec * timed / gb, d.dram_j / d.sec);
+	if (d.mhz > 0.0)
+		printf(" freq=%.0f MHz", d.mhz);
+	printf("\n");
 }
 
-static __inline__ __attribute__((always_inline)) void uc_write_fence(uint64_t v)
+/* One line of the consolidated scenario report. */
+struct report_row {
+	char run[64];
+	char path[256];
+	char test[64];
+	double mbps;
+	double p50_us;
+	double p99_us;
+};
+
+/* Name of the scenario in progress; rows are only kept while it is set. */
+static const char *report_run;
+static struct report_row *report_rows;
+static size_t report_nrows;
+
+static void report_add(const char *path, const char *test, double mbps)
 {
-	if (!uc_fence_word)
+	struct report_row *r;
+
+	r = realloc(report_rows, (report_nrows + 1) * sizeof(*r));
+	if (!r)
 		return;
-	*uc_fence_word = v;
-	//(void)*uc_fence_word;
+	report_rows = r;
+	r = &report_rows[report_nrows++];
+	snprintf(r->run, sizeof(r->run), "%s", report_run);
+	snprintf(r->path, sizeof(r->path), "%s", path);
+	snprintf(r->test, sizeof(r->test), "%s", test);
+	r->mbps = mbps;
+	r->p50_us = (double)hist_percentile(&iter_samples.h, 50.0) / 1e3;
+	r->p99_us = (double)hist_percentile(&iter_samples.h, 99.0) / 1e3;
 }
 
-static int g_verify_failures;
+/* Cache state the tests in progress start from; NULL for none. */
+static const char *state_name;
+
+static void iter_report(const char *path, const char *test, double mbps)
+{
+	char label[336], name[64];
+
+	if (state_name)
+		snprintf(name, sizeof(name), "%.47s/%s", test, state_name);
+	else
+		snprintf(name, sizeof(name), "%s", test);
+	snprintf(label, sizeof(label), "%.255s %.63s iter", path, name);
+	samples_report(label, &iter_samples, "us", 1e3);
+	energy_report(label, mbps);
+	results_add(path, name, mbps, &iter_samples);
+	if (report_run)
+		report_add(path, name, mbps);
+	samples_reset(&iter_samples);
+}
 
 static void bench_ntwrite_readback(const char *path, size_t size_bytes, int iters, void *map, volatile uint64_t *p,
 				 size_t n64)
 {
+	store_fn nt = store_kernel(STORE_NT);
 	int nt_supported = 0;
 	int failures = 0;
 	int iter;
-	uint64_t i;
+	uint64_t i, expect;
 	double t0, t1;
 	double dt = 0.0;
 
@@ -212,21 +259,13 @@ static void bench_ntwrite_readback(const char *path, size_t size_bytes, int iter
 		uint64_t *np = (uint64_t *)map;
 		int ok = 1;
 		nt_supported = 1;
+		precond_apply(map, size_bytes);
 		t0 = now_sec();
-		for (i = 0; i + 3 < n64; i += 4)
-			nt_store_4x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-						(uint64_t)(i + 1 + (uint64_t)iter),
-						(uint64_t)(i + 2 + (uint64_t)iter),
-						(uint64_t)(i + 3 + (uint64_t)iter));
-		for (; i + 1 < n64; i += 2)
-			nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-						(uint64_t)(i + 1 + (uint64_t)iter));
-		if (i < n64)
-			nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
-
-		for (i = 0; i < n64; i++) {
+		store_fill(nt, np, n64, (uint64_t)iter, n64);
+
+		expect = store_word(0, (uint64_t)iter);
+		for (i = 0; i < n64; i++, expect += STORE_K_INDEX) {
 			uint64_t v = p[i];
-			uint64_t expect = (uint64_t)(i + (uint64_t)iter);
 			if (v != expect) {
 				fprintf(stderr,
 					"%s ntwrite_readback verify failed iter=%d idx=%" PRIu64 " got=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
@@ -238,7 +277,7 @@ static void bench_ntwrite_readback(const char *path, size_t size_bytes, int iter
 			}
 		}
 		t1 = now_sec();
-		dt += (t1 - t0);
+		dt += iter_lap(t0, t1);
 		if (!ok)
 			break;
 #else
@@ -255,181 +294,493 @@ static void bench_ntwrite_readback(const char *path, size_t size_bytes, int iter
 			double bytes = (double)size_bytes * (double)iters * 2.0;
 			printf("%s ntwrite_readback: %.2f MB/s (%.3f s)\n", path,
 			       (bytes / (1024.0 * 1024.0)) / dt, dt);
+			iter_report(path, "ntwrite_readback", (bytes / (1024.0 * 1024.0)) / dt);
 		}
 	} else {
 		printf("%s ntwrite_readback: unsupported arch\n", path);
 	}
 }
 
-static void bench_one(const char *path, size_t size_bytes, int iters)
+/* -P: prefetch distance in bytes, 0 when the prefetch tests are off; or sweep it. */
+static size_t pf_dist;
+static int pf_autotune;
+
+static const size_t pf_sweep[] = { 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536 };
+
+struct pf_test {
+	char name[32];
+	/* Index of the same kernel without prefetch, for the gain. */
+	int base;
+	enum pf_hint hint;
+	pf_read_fn read;
+	pf_copy_fn copy;
+};
+
+/* One pass; reads sweep the whole map, copies move the first half onto the second. */
+static void pf_pass(const struct pf_test *pt, uint64_t *base, size_t n64, size_t dist)
 {
-	int fd;
-	void *map;
-	volatile uint64_t *p;
-	size_t n64;
+	if (pt->read)
+		(void)pt->read(base, n64, dist);
+	else
+		pt->copy(base + n64 / 2, base, n64 / 2, dist);
+}
+
+/* Fastest distance from pf_sweep for pt, from the best of a few passes each. */
+static size_t pf_tune(const char *path, const struct pf_test *pt, uint64_t *base, size_t n64, double pass_mb,
+		      int iters)
+{
+	int tune_iters = iters / 5 > 2 ? iters / 5 : 2;
+	char line[512];
+	size_t len = 0;
+	size_t best_dist = pf_sweep[0];
+	double best = 0.0;
+	size_t k;
 	int iter;
-	uint64_t i;
-	double t0, t1;
-	uint64_t sum = 0;
 
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
-		exit(1);
+	for (k = 0; k < sizeof(pf_sweep) / sizeof(pf_sweep[0]); k++) {
+		double fastest = 0.0, mbps;
+
+		for (iter = 0; iter < tune_iters; iter++) {
+			double t0, t1;
+
+			t0 = now_sec();
+			pf_pass(pt, base, n64, pf_sweep[k]);
+			t1 = now_sec();
+			if (!iter || t1 - t0 < fastest)
+				fastest = t1 - t0;
+		}
+		mbps = pass_mb / fastest;
+		if (len < sizeof(line))
+			len += snprintf(line + len, sizeof(line) - len, " %zu:%.0f", pf_sweep[k], mbps);
+		if (mbps > best) {
+			best = mbps;
+			best_dist = pf_sweep[k];
+		}
 	}
+	printf("%s %s autotune MB/s by distance:%s best=%zu\n", path, pt->name, line, best_dist);
+	return best_dist;
+}
 
-	if (!size_bytes) {
-		uint64_t sz = get_size_ioctl(fd);
-		if (!sz) {
-			fprintf(stderr, "%s ioctl size failed\n", path);
-			close(fd);
-			return;
+static void bench_prefetch(const char *path, int iters, void *map, size_t n64)
+{
+	static const char *const read_names[] = { "read", "ntload" };
+	struct pf_test tests[3 * PF_HINT_NR];
+	size_t dists[3 * PF_HINT_NR];
+	double mbps[3 * PF_HINT_NR];
+	int ntests = 0;
+	int kind, h, k, iter;
+
+	for (kind = PF_READ_LOAD; kind <= PF_READ_NTLOAD; kind++) {
+		int base = ntests;
+
+		for (h = PF_NONE; h < PF_HINT_NR; h++) {
+			struct pf_test *pt = &tests[ntests];
+			pf_read_fn fn = pf_read_kernel(kind, h);
+
+			if (!fn)
+				continue;
+			memset(pt, 0, sizeof(*pt));
+			snprintf(pt->name, sizeof(pt->name), "pf_%s_%s", read_names[kind], pf_hint_name(h));
+			pt->base = base;
+			pt->hint = h;
+			pt->read = fn;
+			ntests++;
+		}
+	}
+	if (n64 >= 16) {
+		int base = ntests;
+
+		for (h = PF_NONE; h < PF_HINT_NR; h++) {
+			struct pf_test *pt = &tests[ntests];
+			pf_copy_fn fn = pf_copy_kernel(h);
+
+			if (!fn)
+				continue;
+			memset(pt, 0, sizeof(*pt));
+			snprintf(pt->name, sizeof(pt->name), "pf_copy_%s", pf_hint_name(h));
+			pt->base = base;
+			pt->hint = h;
+			pt->copy = fn;
+			ntests++;
 		}
-		size_bytes = (size_t)sz;
-		printf("%s size: %zu bytes (%.2f MiB) source=ioctl\n", path, size_bytes,
-		       (double)size_bytes / (1024.0 * 1024.0));
-	} else {
-		printf("%s size: %zu bytes (%.2f MiB) source=arg\n", path, size_bytes,
-		       (double)size_bytes / (1024.0 * 1024.0));
 	}
 
-#if defined(__i386__) || defined(__x86_64__)
-	nt_init_once();
-#endif
+	for (k = 0; k < ntests; k++) {
+		const struct pf_test *pt = &tests[k];
+		double pass_mb = (double)(pt->read ? n64 : n64 / 2) * sizeof(uint64_t) / (1024.0 * 1024.0);
+		double dt = 0.0;
 
-	map = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		fprintf(stderr, "%s mmap failed: %s\n", path, strerror(errno));
-		close(fd);
-		exit(1);
+		dists[k] = pt->hint == PF_NONE ? 0 : pf_dist;
+		if (pf_autotune && pt->hint != PF_NONE)
+			dists[k] = pf_tune(path, pt, (uint64_t *)map, n64, pass_mb, iters);
+		energy_snap(&test_snap);
+		for (iter = 0; iter < iters; iter++) {
+			double t0, t1;
+
+			precond_apply(map, n64 * sizeof(uint64_t));
+			t0 = now_sec();
+			pf_pass(pt, (uint64_t *)map, n64, dists[k]);
+			t1 = now_sec();
+			dt += iter_lap(t0, t1);
+		}
+		mbps[k] = pass_mb * iters / dt;
+		printf("%s %s: %.2f MB/s (%.3f s) dist=%zu\n", path, pt->name, mbps[k], dt, dists[k]);
+		iter_report(path, pt->name, mbps[k]);
+	}
+
+	for (k = 0; k < ntests; k++) {
+		if (tests[k].hint == PF_NONE)
+			continue;
+		printf("%s prefetch %s: dist=%zu %.2f MB/s (%+.1f%% vs %s)\n", path, tests[k].name, dists[k],
+		       mbps[k], (mbps[k] / mbps[tests[k].base] - 1.0) * 100.0, tests[tests[k].base].name);
+	}
+}
+
+/* -I: transfer sizes of the syscall I/O tests, none when they are off. */
+#define IO_MAX_SIZES 8
+/* io_uring requests per batch, and the buffer space one batch may take. */
+#define IO_URING_DEPTH 32
+#define IO_URING_BUF_MAX (16u << 20)
+
+static size_t io_sizes[IO_MAX_SIZES];
+static int io_nsizes;
+
+enum io_path {
+	IO_MMAP,	/* memcpy through the mapping */
+	IO_SYSCALL,	/* pread/pwrite, one call per chunk */
+	IO_URING,	/* io_uring read/write, up to IO_URING_DEPTH chunks per submit */
+	IO_PATH_NR,
+};
+
+static int io_parse(const char *s)
+{
+	char buf[128];
+	char *save, *tok;
+
+	io_nsizes = 0;
+	if (!strcmp(s, "off"))
+		return 0;
+	if (snprintf(buf, sizeof(buf), "%s", s) >= (int)sizeof(buf))
+		return -1;
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (io_nsizes >= IO_MAX_SIZES)
+			return -1;
+		io_sizes[io_nsizes] = parse_size(tok);
+		if (!io_sizes[io_nsizes])
+			return -1;
+		io_nsizes++;
+	}
+	return io_nsizes ? 0 : -1;
+}
+
+/* One pass over the target in chunks of sz; returns 0 or -errno. */
+static int io_pass(enum io_path how, int write, const struct bench_target *t, char *map, char *const *bufs,
+		   unsigned int depth, size_t sz, struct uring *u)
+{
+	size_t nchunks = t->size_bytes / sz;
+	off_t offs[IO_URING_DEPTH];
+	size_t k;
+	int ret;
+
+	switch (how) {
+	case IO_MMAP:
+		for (k = 0; k < nchunks; k++) {
+			if (write)
+				memcpy(map + k * sz, bufs[0], sz);
+			else
+				memcpy(bufs[0], map + k * sz, sz);
+		}
+		/* The kernel side drains WC buffers before returning; match it. */
+		if (write)
+			nt_fence();
+		return 0;
+	case IO_SYSCALL:
+		for (k = 0; k < nchunks; k++) {
+			off_t off = t->offset + (off_t)(k * sz);
+			ssize_t r = write ? pwrite(t->fd, bufs[0], sz, off) : pread(t->fd, bufs[0], sz, off);
+
+			if (r < 0)
+				return -errno;
+			if ((size_t)r != sz)
+				return -EIO;
+		}
+		return 0;
+	case IO_URING:
+		for (k = 0; k < nchunks; k += depth) {
+			unsigned int n = nchunks - k < depth ? (unsigned int)(nchunks - k) : depth;
+			unsigned int j;
+
+			for (j = 0; j < n; j++)
+				offs[j] = t->offset + (off_t)((k + j) * sz);
+			ret = uring_batch(u, write, t->fd, (void *const *)bufs, offs, sz, n);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Reads and writes the whole target per iteration through the mapping, through
+ * pread/pwrite and through io_uring, per transfer size, into user buffers.
+ */
+static void bench_io(const struct bench_target *t, void *map, int iters)
+{
+	static const char *const names[IO_PATH_NR][2] = {
+		[IO_MMAP] = { "mmap_read", "mmap_write" },
+		[IO_SYSCALL] = { "pread", "pwrite" },
+		[IO_URING] = { "uring_read", "uring_write" },
+	};
+	const char *path = t->path;
+	struct uring u;
+	int have_uring;
+	int k, how, write, iter;
+
+	have_uring = uring_init(&u, IO_URING_DEPTH) == 0;
+	if (!have_uring)
+		printf("%s io_uring unavailable: %s\n", path, strerror(errno));
+
+	for (k = 0; k < io_nsizes; k++) {
+		size_t sz = io_sizes[k];
+		size_t nchunks = t->size_bytes / sz;
+		double mbps[IO_PATH_NR][2] = { { 0.0 } };
+		char *bufs[IO_URING_DEPTH];
+		unsigned int depth, j;
+		char szname[24];
+		char *mem;
+		double pass_mb;
+
+		size_name(szname, sizeof(szname), sz);
+		if (!nchunks) {
+			printf("%s io %s: larger than the target\n", path, szname);
+			continue;
+		}
+		depth = IO_URING_BUF_MAX / sz;
+		if (depth > IO_URING_DEPTH)
+			depth = IO_URING_DEPTH;
+		if (!depth)
+			depth = 1;
+		if (have_uring && depth > u.entries)
+			depth = u.entries;
+		if (posix_memalign((void **)&mem, 4096, depth * sz) != 0) {
+			printf("%s io %s: out of memory\n", path, szname);
+			continue;
+		}
+		memset(mem, 0x5a, depth * sz);
+		for (j = 0; j < depth; j++)
+			bufs[j] = mem + j * sz;
+		pass_mb = (double)(nchunks * sz) / (1024.0 * 1024.0);
+
+		for (write = 0; write <= 1; write++) {
+			for (how = IO_MMAP; how < IO_PATH_NR; how++) {
+				char name[64];
+				double dt = 0.0;
+				int err = 0;
+
+				if (how == IO_URING && !have_uring)
+					continue;
+				snprintf(name, sizeof(name), "io_%s_%s", names[how][write], szname);
+				energy_snap(&test_snap);
+				for (iter = 0; iter < iters; iter++) {
+					double t0, t1;
+
+					precond_apply(map, t->size_bytes);
+					t0 = now_sec();
+					err = io_pass((enum io_path)how, write, t, map, bufs, depth, sz, &u);
+					t1 = now_sec();
+					if (err)
+						break;
+					dt += iter_lap(t0, t1);
+				}
+				if (err) {
+					printf("%s %s: %s\n", path, name, strerror(-err));
+					samples_reset(&iter_samples);
+					continue;
+				}
+				mbps[how][write] = pass_mb * iters / dt;
+				printf("%s %s: %.2f MB/s (%.3f s) %.2f us/op\n", path, name, mbps[how][write], dt,
+				       dt / ((double)iters * (double)nchunks) * 1e6);
+				iter_report(path, name, mbps[how][write]);
+			}
+		}
+
+		for (write = 0; write <= 1; write++) {
+			if (mbps[IO_MMAP][write] <= 0.0)
+				continue;
+			printf("%s io %s %s vs mmap:", path, szname, write ? "write" : "read");
+			for (how = IO_SYSCALL; how < IO_PATH_NR; how++) {
+				if (mbps[how][write] > 0.0)
+					printf(" %s=%.2fx", names[how][write], mbps[how][write] / mbps[IO_MMAP][write]);
+			}
+			printf("\n");
+		}
+		free(mem);
 	}
+	if (have_uring)
+		uring_exit(&u);
+}
+
+/*
+ * Tests of bench_one() in run order; "prefetch" stands for all -P kernels,
+ * "io" for all -I paths and sizes, "atomic" for all -X ops.
+ */
+static const char *const bench_tests[] = {
+	"write", "write_nofence", "write_ucfence", "ntwrite", "ntwrite_nofence", "ntwrite_readback",
+	"ntwrite_nofence_deferred", "ntwrite_ucfence", "read", "prefetch", "io", "atomic",
+};
+
+/* Comma separated subset of bench_tests to run; NULL or empty runs all. */
+static const char *test_filter;
+
+static int list_has(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *c = list;
+
+	while (c) {
+		if (!strncmp(c, name, len) && (c[len] == ',' || !c[len]))
+			return 1;
+		c = strchr(c, ',');
+		if (c)
+			c++;
+	}
+	return 0;
+}
+
+static int test_enabled(const char *name)
+{
+	return !test_filter || !test_filter[0] || list_has(test_filter, name);
+}
+
+/* test_enabled(), and if so opens the test's energy window. */
+static int test_begin(const char *name)
+{
+	if (!test_enabled(name))
+		return 0;
+	energy_snap(&test_snap);
+	return 1;
+}
+
+/* Names the first entry of list that is not a test, or NULL. */
+static const char *tests_unknown(const char *list)
+{
+	static char bad[64];
+	const char *c = list;
+	size_t k;
+
+	while (c && *c) {
+		size_t len = strcspn(c, ",");
+
+		for (k = 0; k < sizeof(bench_tests) / sizeof(bench_tests[0]); k++) {
+			if (strlen(bench_tests[k]) == len && !strncmp(c, bench_tests[k], len))
+				break;
+		}
+		if (k == sizeof(bench_tests) / sizeof(bench_tests[0])) {
+			snprintf(bad, sizeof(bad), "%.*s", (int)(len < 63 ? len : 63), c);
+			return bad;
+		}
+		c = c[len] ? c + len + 1 : NULL;
+	}
+	return NULL;
+}
+
+static void bench_state(struct bench_target *t, void *map, int iters)
+{
+	const char *path = t->path;
+	store_fn plain = store_kernel(STORE_PLAIN);
+	store_fn nt = store_kernel(STORE_NT);
+	size_t size_bytes = t->size_bytes;
+	volatile uint64_t *p;
+	size_t n64;
+	int iter;
+	uint64_t i;
+	double t0, t1;
+	uint64_t sum = 0;
 
 	n64 = size_bytes / sizeof(uint64_t);
 	p = (volatile uint64_t *)map;
-	{
+	if (!iter_samples.unit)
+		samples_init(&iter_samples, "ns");
+	else
+		samples_reset(&iter_samples);
+	if (test_begin("write")) {
 		int fail_before = g_verify_failures;
 		double dt = 0.0;
 		for (iter = 0; iter < iters; iter++) {
-			int ok = 1;
+			precond_apply(map, size_bytes);
 			t0 = now_sec();
-			for (i = 0; i < n64; i++)
-				p[i] = (uint64_t)(i + (uint64_t)iter);
+			store_fill(plain, (uint64_t *)map, n64, (uint64_t)iter, n64);
 
 			nt_fence();
 			t1 = now_sec();
-			dt += (t1 - t0);
+			dt += iter_lap(t0, t1);
 
-			sum = 0;
-			for (i = 0; i < n64; i++)
-				sum += p[i];
-			{
-				uint64_t expect = expected_sum_u64(n64, iter);
-				if (sum != expect) {
-					fprintf(stderr,
-						"%s write verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-						path, iter, sum, expect);
-					g_verify_failures++;
-					ok = 0;
-				}
-			}
-			if (!ok)
+			if (verify_due(iter, iters) && verify_pattern(t, "write", iter, p, n64, n64) != 0)
 				break;
 		}
 
 		if (g_verify_failures == fail_before) {
-			printf("%s write verify: ok\n", path);
+			printf("%s write verify: %s\n", path, verify_enabled() ? "ok" : "off");
 		} else {
 			printf("%s write verify: failed\n", path);
 		}
 		{
 			double bytes = (double)size_bytes * (double)iters;
 			printf("%s write: %.2f MB/s (%.3f s)\n", path, (bytes / (1024.0 * 1024.0)) / dt, dt);
+			iter_report(path, "write", (bytes / (1024.0 * 1024.0)) / dt);
 		}
 	}
 
-	{
+	if (test_begin("write_nofence")) {
 		int failures = 0;
 		double dt = 0.0;
 		for (iter = 0; iter < iters; iter++) {
+			precond_apply(map, size_bytes);
 			t0 = now_sec();
-			for (i = 0; i < n64; i++)
-				p[i] = (uint64_t)(i + (uint64_t)iter);
+			store_fill(plain, (uint64_t *)map, n64, (uint64_t)iter, n64);
 			t1 = now_sec();
-			dt += (t1 - t0);
+			dt += iter_lap(t0, t1);
 
-			sum = 0;
-			for (i = 0; i < n64; i++)
-				sum += p[i];
-			{
-				uint64_t expect = expected_sum_u64(n64, iter);
-				if (sum != expect) {
-					fprintf(stderr,
-						"%s write_nofence verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-						path, iter, sum, expect);
-					g_verify_failures++;
-					failures++;
-				}
-			}
+			if (verify_due(iter, iters) && verify_pattern(t, "write_nofence", iter, p, n64, n64) != 0)
+				failures++;
 		}
 
 		if (!failures)
-			printf("%s write_nofence verify: ok\n", path);
+			printf("%s write_nofence verify: %s\n", path, verify_enabled() ? "ok" : "off");
 		else
 			printf("%s write_nofence verify: failed (%d)\n", path, failures);
 		{
 			double bytes = (double)size_bytes * (double)iters;
 			printf("%s write_nofence: %.2f MB/s (%.3f s)\n", path,
 			       (bytes / (1024.0 * 1024.0)) / dt, dt);
+			iter_report(path, "write_nofence", (bytes / (1024.0 * 1024.0)) / dt);
 		}
 	}
 
-	{
+	if (test_begin("write_ucfence")) {
 		int fail_before = g_verify_failures;
 		double dt = 0.0;
 		if (!uc_fence_word) {
 			printf("%s write_ucfence: uc_fence unavailable\n", path);
 		} else {
-			int overlap_uc = (strcmp(path, "/dev/memcache_uc") == 0);
-			long page_sz = sysconf(_SC_PAGESIZE);
-			size_t fence_idx = (((size_t)(page_sz > 0 ? page_sz : 4096)) / sizeof(uint64_t)) - 1;
-			if (fence_idx >= n64)
-				overlap_uc = 0;
+			size_t fence_idx = uc_fence_index(t, n64);
 			for (iter = 0; iter < iters; iter++) {
-				int ok = 1;
+				precond_apply(map, size_bytes);
 				t0 = now_sec();
-				for (i = 0; i < n64; i++) {
-					if (overlap_uc && i == fence_idx)
-						continue;
-					p[i] = (uint64_t)(i + (uint64_t)iter);
-				}
+				store_fill(plain, (uint64_t *)map, n64, (uint64_t)iter, fence_idx);
 				uc_write_fence((uint64_t)iter);
 				t1 = now_sec();
-				dt += (t1 - t0);
+				dt += iter_lap(t0, t1);
 
-				sum = 0;
-				for (i = 0; i < n64; i++) {
-					if (overlap_uc && i == fence_idx)
-						continue;
-					sum += p[i];
-				}
-				{
-					uint64_t expect = expected_sum_u64(n64, iter);
-					if (overlap_uc)
-						expect -= (uint64_t)(fence_idx + (uint64_t)iter);
-					if (sum != expect) {
-						fprintf(stderr,
-							"%s write_ucfence verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-							path, iter, sum, expect);
-						g_verify_failures++;
-						ok = 0;
-					}
-				}
-				if (!ok)
+				if (verify_due(iter, iters) &&
+				    verify_pattern(t, "write_ucfence", iter, p, n64, fence_idx) != 0)
 					break;
 			}
 
 			if (g_verify_failures == fail_before) {
-				printf("%s write_ucfence verify: ok\n", path);
+				printf("%s write_ucfence verify: %s\n", path, verify_enabled() ? "ok" : "off");
 			} else {
 				printf("%s write_ucfence verify: failed\n", path);
 			}
@@ -437,11 +788,12 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 				double bytes = (double)size_bytes * (double)iters;
 				printf("%s write_ucfence: %.2f MB/s (%.3f s)\n", path,
 				       (bytes / (1024.0 * 1024.0)) / dt, dt);
+				iter_report(path, "write_ucfence", (bytes / (1024.0 * 1024.0)) / dt);
 			}
 		}
 	}
 
-	{
+	if (test_begin("ntwrite")) {
 		int nt_supported = 0;
 		int fail_before = g_verify_failures;
 		double dt = 0.0;
@@ -450,38 +802,15 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 			uint64_t *np = (uint64_t *)map;
 			nt_supported = 1;
 			{
-				int ok = 1;
+				precond_apply(map, size_bytes);
 				t0 = now_sec();
-				for (i = 0; i + 3 < n64; i += 4)
-					nt_store_4x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter),
-							(uint64_t)(i + 2 + (uint64_t)iter),
-							(uint64_t)(i + 3 + (uint64_t)iter));
-				for (; i + 1 < n64; i += 2)
-					nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter));
-				if (i < n64)
-					nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
+				store_fill(nt, np, n64, (uint64_t)iter, n64);
 				nt_fence();
 				t1 = now_sec();
-				dt += (t1 - t0);
+				dt += iter_lap(t0, t1);
 
-				sum = 0;
-				for (i = 0; i < n64; i++)
-					sum += p[i];
-				{
-					uint64_t expect = expected_sum_u64(n64, iter);
-					if (sum != expect) {
-						fprintf(stderr,
-							"%s ntwrite verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-							path, iter, sum, expect);
-						g_verify_failures++;
-						ok = 0;
-					}
-				}
-				if (!ok)
+				if (verify_due(iter, iters) && verify_pattern(t, "ntwrite", iter, p, n64, n64) != 0)
 					break;
-
 			}
 #else
 			break;
@@ -490,20 +819,21 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 
 		if (nt_supported) {
 			if (g_verify_failures == fail_before)
-				printf("%s ntwrite verify: ok\n", path);
+				printf("%s ntwrite verify: %s\n", path, verify_enabled() ? "ok" : "off");
 			else
 				printf("%s ntwrite verify: failed\n", path);
 			{
 				double bytes = (double)size_bytes * (double)iters;
 				printf("%s ntwrite: %.2f MB/s (%.3f s)\n", path,
 				       (bytes / (1024.0 * 1024.0)) / dt, dt);
+				iter_report(path, "ntwrite", (bytes / (1024.0 * 1024.0)) / dt);
 			}
 		} else {
 			printf("%s ntwrite: unsupported arch\n", path);
 		}
 	}
 
-	{
+	if (test_begin("ntwrite_nofence")) {
 		int nt_supported = 0;
 		int failures = 0;
 		double dt = 0.0;
@@ -511,33 +841,14 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 #if defined(__i386__) || defined(__x86_64__)
 			uint64_t *np = (uint64_t *)map;
 			nt_supported = 1;
+			precond_apply(map, size_bytes);
 			t0 = now_sec();
-			for (i = 0; i + 3 < n64; i += 4)
-				nt_store_4x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter),
-							(uint64_t)(i + 2 + (uint64_t)iter),
-							(uint64_t)(i + 3 + (uint64_t)iter));
-			for (; i + 1 < n64; i += 2)
-				nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter));
-			if (i < n64)
-				nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
+			store_fill(nt, np, n64, (uint64_t)iter, n64);
 			t1 = now_sec();
-			dt += (t1 - t0);
+			dt += iter_lap(t0, t1);
 
-			sum = 0;
-			for (i = 0; i < n64; i++)
-				sum += p[i];
-			{
-				uint64_t expect = expected_sum_u64(n64, iter);
-				if (sum != expect) {
-					fprintf(stderr,
-						"%s ntwrite_nofence verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-						path, iter, sum, expect);
-					g_verify_failures++;
-					failures++;
-				}
-			}
+			if (verify_due(iter, iters) && verify_pattern(t, "ntwrite_nofence", iter, p, n64, n64) != 0)
+				failures++;
 #else
 			break;
 #endif
@@ -545,22 +856,24 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 
 		if (nt_supported) {
 			if (!failures)
-				printf("%s ntwrite_nofence verify: ok\n", path);
+				printf("%s ntwrite_nofence verify: %s\n", path, verify_enabled() ? "ok" : "off");
 			else
 				printf("%s ntwrite_nofence verify: failed (%d)\n", path, failures);
 			{
 				double bytes = (double)size_bytes * (double)iters;
 				printf("%s ntwrite_nofence: %.2f MB/s (%.3f s)\n", path,
 				       (bytes / (1024.0 * 1024.0)) / dt, dt);
+				iter_report(path, "ntwrite_nofence", (bytes / (1024.0 * 1024.0)) / dt);
 			}
 		} else {
 			printf("%s ntwrite_nofence: unsupported arch\n", path);
 		}
 	}
 
-	bench_ntwrite_readback(path, size_bytes, iters, map, p, n64);
+	if (test_begin("ntwrite_readback"))
+		bench_ntwrite_readback(path, size_bytes, iters, map, p, n64);
 
-	{
+	if (test_begin("ntwrite_nofence_deferred")) {
 		int nt_supported = 0;
 		int failures = 0;
 		double dt = 0.0;
@@ -568,125 +881,59 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 #if defined(__i386__) || defined(__x86_64__)
 			uint64_t *np = (uint64_t *)map;
 			nt_supported = 1;
+			precond_apply(map, size_bytes);
 			t0 = now_sec();
-			for (i = 0; i + 3 < n64; i += 4)
-				nt_store_4x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter),
-							(uint64_t)(i + 2 + (uint64_t)iter),
-							(uint64_t)(i + 3 + (uint64_t)iter));
-			for (; i + 1 < n64; i += 2)
-				nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-							(uint64_t)(i + 1 + (uint64_t)iter));
-			if (i < n64)
-				nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
+			store_fill(nt, np, n64, (uint64_t)iter, n64);
 			t1 = now_sec();
-			dt += (t1 - t0);
+			dt += iter_lap(t0, t1);
 #else
 			break;
 #endif
 		}
 
 		if (nt_supported) {
-			sum = 0;
-			for (i = 0; i < n64; i++)
-				sum += p[i];
-			{
-				int last_iter = iters > 0 ? (iters - 1) : 0;
-				uint64_t expect = expected_sum_u64(n64, last_iter);
-				if (sum != expect) {
-					fprintf(stderr,
-						"%s ntwrite_nofence_deferred verify failed sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-						path, sum, expect);
-					g_verify_failures++;
-					failures++;
-				}
-			}
+			/* Deferred by design: only the last iteration is checked unless -V off. */
+			if (iters > 0 && verify_due(iters - 1, iters) &&
+			    verify_pattern(t, "ntwrite_nofence_deferred", iters - 1, p, n64, n64) != 0)
+				failures++;
 
 			if (!failures)
-				printf("%s ntwrite_nofence_deferred verify: ok\n", path);
+				printf("%s ntwrite_nofence_deferred verify: %s\n", path, verify_enabled() ? "ok" : "off");
 			else
 				printf("%s ntwrite_nofence_deferred verify: failed (%d)\n", path, failures);
 			{
 				double bytes = (double)size_bytes * (double)iters;
 				printf("%s ntwrite_nofence_deferred: %.2f MB/s (%.3f s)\n", path,
 				       (bytes / (1024.0 * 1024.0)) / dt, dt);
+				iter_report(path, "ntwrite_nofence_deferred", (bytes / (1024.0 * 1024.0)) / dt);
 			}
 		} else {
 			printf("%s ntwrite_nofence_deferred: unsupported arch\n", path);
 		}
 	}
 
-	{
+	if (test_begin("ntwrite_ucfence")) {
 		int nt_supported = 0;
 		int fail_before = g_verify_failures;
 		double dt = 0.0;
 		if (!uc_fence_word) {
 			printf("%s ntwrite_ucfence: uc_fence unavailable\n", path);
 		} else {
-			int overlap_uc = (strcmp(path, "/dev/memcache_uc") == 0);
-			long page_sz = sysconf(_SC_PAGESIZE);
-			size_t fence_idx = (((size_t)(page_sz > 0 ? page_sz : 4096)) / sizeof(uint64_t)) - 1;
-			if (fence_idx >= n64)
-				overlap_uc = 0;
+			size_t fence_idx = uc_fence_index(t, n64);
 			for (iter = 0; iter < iters; iter++) {
 #if defined(__i386__) || defined(__x86_64__)
 				uint64_t *np = (uint64_t *)map;
 				nt_supported = 1;
 				{
-					int ok = 1;
+					precond_apply(map, size_bytes);
 					t0 = now_sec();
-					if (!overlap_uc) {
-						for (i = 0; i + 3 < n64; i += 4)
-							nt_store_4x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-										(uint64_t)(i + 1 + (uint64_t)iter),
-										(uint64_t)(i + 2 + (uint64_t)iter),
-										(uint64_t)(i + 3 + (uint64_t)iter));
-						for (; i + 1 < n64; i += 2)
-							nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-										(uint64_t)(i + 1 + (uint64_t)iter));
-						if (i < n64)
-							nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
-					} else {
-						for (i = 0; i + 1 < n64; i += 2) {
-							if (i == fence_idx || (i + 1) == fence_idx) {
-								if (i != fence_idx)
-									nt_store_u64(&np[i], (uint64_t)(i + (uint64_t)iter));
-								if ((i + 1) != fence_idx)
-									nt_store_u64(&np[i + 1], (uint64_t)(i + 1 + (uint64_t)iter));
-								continue;
-							}
-							nt_store_2x64(&np[i], (uint64_t)(i + (uint64_t)iter),
-										(uint64_t)(i + 1 + (uint64_t)iter));
-						}
-						if (n64 & 1) {
-							size_t last = n64 - 1;
-							if (last != fence_idx)
-								nt_store_u64(&np[last], (uint64_t)(last + (uint64_t)iter));
-						}
-					}
+					store_fill(nt, np, n64, (uint64_t)iter, fence_idx);
 					uc_write_fence((uint64_t)iter);
 					t1 = now_sec();
-					dt += (t1 - t0);
-
-					sum = 0;
-					for (i = 0; i < n64; i++) {
-						if (overlap_uc && i == fence_idx)
-							continue;
-						sum += p[i];
-					}
-					{
-						uint64_t expect = expected_sum_u64(n64, iter);
-						if (overlap_uc)
-							expect -= (uint64_t)(fence_idx + (uint64_t)iter);
-						if (sum != expect) {
-							fprintf(stderr,
-								"%s ntwrite_ucfence verify failed iter=%d sum=0x%" PRIx64 " expect=0x%" PRIx64 "\n",
-								path, iter, sum, expect);
-							g_verify_failures++;
-							ok = 0;
-						}
-					}
-					if (!ok)
+					dt += iter_lap(t0, t1);
+
+					if (verify_due(iter, iters) &&
+					    verify_pattern(t, "ntwrite_ucfence", iter, p, n64, fence_idx) != 0)
 						break;
 				}
 #else
@@ -696,13 +943,14 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 
 			if (nt_supported) {
 				if (g_verify_failures == fail_before)
-					printf("%s ntwrite_ucfence verify: ok\n", path);
+					printf("%s ntwrite_ucfence verify: %s\n", path, verify_enabled() ? "ok" : "off");
 				else
 					printf("%s ntwrite_ucfence verify: failed\n", path);
 				{
 					double bytes = (double)size_bytes * (double)iters;
 					printf("%s ntwrite_ucfence: %.2f MB/s (%.3f s)\n", path,
 					       (bytes / (1024.0 * 1024.0)) / dt, dt);
+					iter_report(path, "ntwrite_ucfence", (bytes / (1024.0 * 1024.0)) / dt);
 				}
 			} else {
 				printf("%s ntwrite_ucfence: unsupported arch\n", path);
@@ -710,27 +958,485 @@ static void bench_one(const char *path, size_t size_bytes, int iters)
 		}
 	}
 
+	if (test_begin("read")) {
+		double dt = 0.0;
+		for (iter = 0; iter < iters; iter++) {
+			precond_apply(map, size_bytes);
+			t0 = now_sec();
+			for (i = 0; i < n64; i++)
+				sum += p[i];
+			t1 = now_sec();
+			dt += iter_lap(t0, t1);
+		}
+		{
+			double bytes = (double)size_bytes * (double)iters;
+			printf("%s read : %.2f MB/s (%.3f s) sum=0x%" PRIx64 "\n", path,
+			       (bytes / (1024.0 * 1024.0)) / dt, dt, sum);
+			iter_report(path, "read", (bytes / (1024.0 * 1024.0)) / dt);
+		}
+	}
+
+	if ((pf_dist || pf_autotune) && test_enabled("prefetch"))
+		bench_prefetch(path, iters, map, n64);
+
+	if (io_nsizes && test_enabled("io"))
+		bench_io(t, map, iters);
+}
+
+/* The tests once per -C cache state; result names get a /state suffix unless it is none. */
+static void bench_one(struct bench_target *t, void *map, int iters)
+{
+	int k;
+
+	for (k = 0; k < precond_count(); k++) {
+		const char *name = precond_select(k);
+
+		state_name = strcmp(name, "none") ? name : NULL;
+		if (state_name)
+			printf("%s cache state: %s\n", t->path, state_name);
+		bench_state(t, map, iters);
+	}
+	state_name = NULL;
+
+	/* Locked ops run on a word or two, where the cache state of the region does not matter. */
+	if (atomic_enabled() && test_enabled("atomic"))
+		atomic_run(t, map);
+}
+
+/* mmap setup, first-touch and teardown cost only; no bandwidth tests. */
+static void bench_map(struct bench_target *t)
+{
+	void *map;
+	double t0, t1;
+
+	if (target_open(t) != 0)
+		return;
+
+	map = mmap_timed(t);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s mmap failed: %s\n", t->path, strerror(errno));
+		target_close(t);
+		return;
+	}
+
 	t0 = now_sec();
-	for (iter = 0; iter < iters; iter++) {
-		for (i = 0; i < n64; i++)
-			sum += p[i];
+	munmap(map, t->size_bytes);
+	t1 = now_sec();
+	printf("%s munmap: %.3f ms\n", t->path, (t1 - t0) * 1e3);
+	target_close(t);
+}
+
+/* Open targets and their mappings, kept until exit so scenarios can share them. */
+struct map_ent {
+	struct bench_target t;
+	/* Size asked for, 0 when probed; the lookup key with path and offset. */
+	size_t req_size;
+	void *map;
+};
+
+static struct map_ent map_cache[MAX_MAPS];
+static int map_cache_n;
+
+/* Opens and maps req, or returns the cached mapping of an identical request. */
+static struct bench_target *map_get(const struct bench_target *req, void **map)
+{
+	struct map_ent *e;
+	int i;
+
+	for (i = 0; i < map_cache_n; i++) {
+		e = &map_cache[i];
+		if (!strcmp(e->t.path, req->path) && e->t.offset == req->offset && e->req_size == req->size_bytes) {
+			printf("%s mapping reused: %zu bytes offset=%lld\n", e->t.path, e->t.size_bytes,
+			       (long long)e->t.offset);
+			*map = e->map;
+			return &e->t;
+		}
+	}
+	if (map_cache_n >= MAX_MAPS) {
+		fprintf(stderr, "%s: more than %d mappings\n", req->path, MAX_MAPS);
+		return NULL;
+	}
+
+	e = &map_cache[map_cache_n];
+	e->t = *req;
+	e->req_size = req->size_bytes;
+	if (target_open(&e->t) != 0)
+		return NULL;
+	printf("%s size: %zu bytes (%.2f MiB) offset=%lld type=%s source=%s\n", e->t.path, e->t.size_bytes,
+	       (double)e->t.size_bytes / (1024.0 * 1024.0), (long long)e->t.offset, e->t.type->name,
+	       e->t.size_from_arg ? "arg" : e->t.type->size_source);
+	e->map = mmap_timed(&e->t);
+	if (e->map == MAP_FAILED) {
+		fprintf(stderr, "%s mmap failed: %s\n", e->t.path, strerror(errno));
+		target_close(&e->t);
+		return NULL;
+	}
+	map_cache_n++;
+	*map = e->map;
+	return &e->t;
+}
+
+static void map_put_all(void)
+{
+	int i;
+
+	for (i = 0; i < map_cache_n; i++) {
+		munmap(map_cache[i].map, map_cache[i].t.size_bytes);
+		target_close(&map_cache[i].t);
+	}
+	map_cache_n = 0;
+}
+
+static int pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		fprintf(stderr, "sched_setaffinity cpu=%d failed: %s\n", cpu, strerror(errno));
+		return -1;
+	}
+	printf("pinned to cpu %d\n", cpu);
+	return 0;
+}
+
+static int prefetch_parse(const char *s)
+{
+	pf_autotune = 0;
+	pf_dist = 0;
+	if (!strcmp(s, "auto")) {
+		pf_autotune = 1;
+		return 0;
 	}
+	if (!strcmp(s, "off"))
+		return 0;
+	pf_dist = (size_t)strtoul(s, NULL, 0);
+	return pf_dist ? 0 : -1;
+}
+
+/* Command line values that scenario fields fall back to. */
+struct run_defaults {
+	int iters;
+	int cpu;
+	int pin;
+	const char *store;
+	const char *verify;
+	const char *prefetch;
+	const char *io;
+	const char *precond;
+};
+
+/* Iterations that make one test take about budget seconds, from one write and one read pass. */
+static int budget_iters(void *map, size_t n64, double budget)
+{
+	pf_read_fn rd = pf_read_kernel(PF_READ_LOAD, PF_NONE);
+	double t0, t1, t2, pass, n;
+
+	t0 = now_sec();
+	store_fill(store_kernel(STORE_PLAIN), (uint64_t *)map, n64, 0, n64);
 	t1 = now_sec();
-	{
-		double dt = t1 - t0;
-		double bytes = (double)size_bytes * (double)iters;
-		printf("%s read : %.2f MB/s (%.3f s) sum=0x%" PRIx64 "\n", path,
-		       (bytes / (1024.0 * 1024.0)) / dt, dt, sum);
+	(void)rd((const uint64_t *)map, n64, 0);
+	t2 = now_sec();
+	pass = t1 - t0 > t2 - t1 ? t1 - t0 : t2 - t1;
+	n = pass > 0.0 ? budget / pass : 1.0;
+	return n < 1.0 ? 1 : n > 1e6 ? 1000000 : (int)n;
+}
+
+static int scenario_apply(const struct scenario *s, const struct run_defaults *d)
+{
+	const char *v;
+
+	v = s->verify[0] ? s->verify : d->verify;
+	if (verify_parse(v) != 0) {
+		fprintf(stderr, "bad verify policy: %s\n", v);
+		return -1;
+	}
+	v = s->store[0] ? s->store : d->store;
+	if (store_parse(v) != 0 || store_init() != 0) {
+		fprintf(stderr, "bad store kernel: %s\n", v);
+		return -1;
+	}
+	v = s->prefetch[0] ? s->prefetch : d->prefetch;
+	if (prefetch_parse(v) != 0) {
+		fprintf(stderr, "bad prefetch distance: %s\n", v);
+		return -1;
+	}
+	v = s->io[0] ? s->io : d->io;
+	if (io_parse(v) != 0) {
+		fprintf(stderr, "bad io sizes: %s\n", v);
+		return -1;
 	}
+	if (s->cpu >= 0 && pin_cpu(s->cpu) != 0)
+		return -1;
+	if (s->cpu < 0 && d->pin && pin_cpu(d->cpu) != 0)
+		return -1;
+	/* After pinning: the remote state's CPU is picked relative to this one. */
+	v = s->state[0] ? s->state : d->precond;
+	if (precond_parse(v) != 0) {
+		fprintf(stderr, "bad cache state: %s\n", v);
+		return -1;
+	}
+	if (precond_init() != 0)
+		return -1;
+	test_filter = s->tests;
+	return 0;
+}
+
+static void report_print(const struct scenario *runs, const int *status, int nruns)
+{
+	size_t k;
+	int i;
+
+	printf("\n==== report: %d runs ====\n", nruns);
+	printf("%-16s %-28s %-26s %12s %10s %10s\n", "run", "target", "test", "MB/s", "p50 us", "p99 us");
+	for (k = 0; k < report_nrows; k++) {
+		const struct report_row *r = &report_rows[k];
 
-	munmap(map, size_bytes);
-	close(fd);
+		printf("%-16s %-28s %-26s %12.2f %10.1f %10.1f\n", r->run, r->path, r->test, r->mbps, r->p50_us,
+		       r->p99_us);
+	}
+	for (i = 0; i < nruns; i++) {
+		printf("run %s (line %d): %s", runs[i].name, runs[i].line,
+		       status[i] < 0 ? "not run" : status[i] ? "verify failed" : "ok");
+		if (status[i] > 0)
+			printf(" (%d)", status[i]);
+		printf("\n");
+	}
+}
+
+/* Runs every scenario of path in this process; returns the exit status. */
+static int run_scenarios(const char *path, const struct run_defaults *d)
+{
+	struct scenario *runs;
+	int *status;
+	int nruns, i, failed = 0;
+
+	nruns = scenario_load(path, &runs);
+	if (nruns < 0)
+		return 1;
+	for (i = 0; i < nruns; i++) {
+		const char *bad = tests_unknown(runs[i].tests);
+
+		if (bad) {
+			fprintf(stderr, "%s:%d: unknown test %s\n", path, runs[i].line, bad);
+			free(runs);
+			return 1;
+		}
+	}
+	status = calloc((size_t)nruns, sizeof(*status));
+	if (!status) {
+		free(runs);
+		return 1;
+	}
+
+	for (i = 0; i < nruns; i++) {
+		const struct scenario *s = &runs[i];
+		struct bench_target req, *t;
+		void *map;
+		int iters = s->iters ? s->iters : d->iters;
+		int fail_before = g_verify_failures;
+
+		printf("\n==== run %s: target=%s tests=%s ====\n", s->name, s->target, s->tests[0] ? s->tests : "all");
+		status[i] = -1;
+		if (target_parse(s->target, &req) != 0) {
+			fprintf(stderr, "%s:%d: bad target %s\n", path, s->line, s->target);
+			failed = 1;
+			continue;
+		}
+		if (scenario_apply(s, d) != 0) {
+			failed = 1;
+			continue;
+		}
+		verify_print();
+		store_print();
+		t = map_get(&req, &map);
+		if (!t) {
+			failed = 1;
+			continue;
+		}
+		if (!s->iters && s->budget > 0.0) {
+			iters = budget_iters(map, t->size_bytes / sizeof(uint64_t), s->budget);
+			printf("%s budget %.2f s per test: iters=%d\n", t->path, s->budget, iters);
+		}
+		report_run = s->name;
+		bench_one(t, map, iters);
+		report_run = NULL;
+		status[i] = g_verify_failures - fail_before;
+		if (status[i])
+			failed = 1;
+	}
+
+	report_print(runs, status, nruns);
+	map_put_all();
+	free(status);
+	free(runs);
+	return failed;
+}
+
+/*
+ * Loaded latency on each target. The traffic goes to bg when it is a separate
+ * object, else to the upper half of the target's own mapping.
+ */
+static int run_loaded(struct bench_target *targets, int ntargets, const struct bench_target *bg, int samples)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct bench_target *t, *b;
+		void *map, *bmap;
+		size_t half;
+
+		t = map_get(&targets[i], &map);
+		if (!t)
+			return 1;
+		if (bg) {
+			b = map_get(bg, &bmap);
+			if (!b)
+				return 1;
+			if (b != t && !target_same_backing(b, t)) {
+				loaded_run(t->path, b->path, map, t->size_bytes, bmap, b->size_bytes, samples);
+				continue;
+			}
+		}
+		half = t->size_bytes / 2 & ~(size_t)4095;
+		loaded_run(t->path, t->path, map, half, (char *)map + half, t->size_bytes - half, samples);
+	}
+	map_put_all();
+	return 0;
+}
+
+/* Attribute transition cost on each target, instead of the matrix. */
+static int run_pat(struct bench_target *targets, int ntargets, int iters)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct bench_target *t;
+		void *map;
+
+		t = map_get(&targets[i], &map);
+		if (!t)
+			return 1;
+		pat_run(t, map, iters);
+	}
+	map_put_all();
+	return 0;
+}
+
+/* Trace replay on each target instead of the matrix; iters passes, each from the -C state. */
+static int run_replay(const char *trace, struct bench_target *targets, int ntargets, int iters)
+{
+	struct replay_trace tr;
+	int i, k, iter;
+
+	if (replay_open(trace, &tr) != 0)
+		return 1;
+	replay_print(&tr);
+	if (!iter_samples.unit)
+		samples_init(&iter_samples, "ns");
+	for (i = 0; i < ntargets; i++) {
+		struct bench_target *t;
+		void *map;
+
+		t = map_get(&targets[i], &map);
+		if (!t) {
+			replay_close(&tr);
+			return 1;
+		}
+		if (tr.span > t->size_bytes)
+			printf("%s replay: trace spans %" PRIu64 " bytes, offsets wrap at %zu\n", t->path, tr.span,
+			       t->size_bytes);
+		for (k = 0; k < precond_count(); k++) {
+			const char *name = precond_select(k);
+			double dt = 0.0, mbps;
+
+			state_name = strcmp(name, "none") ? name : NULL;
+			energy_snap(&test_snap);
+			for (iter = 0; iter < iters; iter++) {
+				double pass;
+
+				precond_apply(map, t->size_bytes);
+				pass = replay_pass(&tr, map, t->size_bytes);
+				samples_add(&iter_samples, (uint64_t)(pass * 1e9));
+				dt += pass;
+			}
+			mbps = (double)tr.bytes * iters / (1024.0 * 1024.0) / dt;
+			printf("%s replay%s%s: %.2f MB/s %.2f ns/op (%.3f s)\n", t->path, state_name ? "/" : "",
+			       state_name ? state_name : "", mbps, dt * 1e9 / ((double)tr.nrecs * iters), dt);
+			iter_report(t->path, "replay", mbps);
+		}
+		state_name = NULL;
+	}
+	map_put_all();
+	replay_close(&tr);
+	return 0;
+}
+
+/* Probe daemon: maps each probe's target once, then runs the rounds until stopped. */
+static int run_daemon(void)
+{
+	int i, ret;
+
+	for (i = 0; i < daemon_nprobes(); i++) {
+		struct bench_target *t;
+		void *map;
+
+		t = map_get(daemon_probe_target(i), &map);
+		if (!t)
+			return 1;
+		daemon_probe_bind(i, t, map);
+	}
+	daemon_print();
+	ret = daemon_run();
+	map_put_all();
+	return ret;
 }
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [-s size_mb] [-i iters] [-c cpu]\n", argv0);
+	fprintf(stderr, "Usage: %s [-s size_mb] [-i iters] [-c cpu] [-m] [-d path[:size[:offset]]]... [-f scenarios]\n"
+			"       [-R file] [-S store] [-V every|sample[:N]|deferred|off]\n"
+			"       [-K auto|movnti|sse2|avx|avx2|avx512] [-P bytes|auto|off]\n"
+			"       [-L read|write|ntwrite:cpus[:rates]] [-B path[:size[:offset]]] [-I sizes|off]\n"
+			"       [-A sizes[:threads[:cpus]]] [-C none|cold|evict|clean|dirty|remote,...]\n"
+			"       [-X threads[:cpus]] [-T trace]\n"
+			"       [-D file[:interval[:budget%%[:rounds]]] [-p kind:path[:size[:offset]]]...]\n",
+		argv0);
 	fprintf(stderr, "Default size uses kernel module ioctl.\n");
+	fprintf(stderr, "-m: only time mmap setup and first touch per device.\n");
+	fprintf(stderr, "-d: run the benchmark matrix on a target (memcache device, device-DAX,\n"
+			"    hugetlbfs/tmpfs file or PCI resource file); size/offset take k/m/g\n"
+			"    suffixes, a bare number is MiB. May be repeated.\n");
+	fprintf(stderr, "-f: run the scenarios of a file in one process, reusing mappings, and print\n"
+			"    one report at the end; targets come from the file, not -d.\n");
+	fprintf(stderr, "-V: when to check the written pattern: every iteration (default), every N-th\n"
+			"    and the last, the last only, or never.\n");
+	fprintf(stderr, "-K: non-temporal store kernel; auto takes the widest the cpu supports.\n");
+	fprintf(stderr, "-P: also run the prefetch read/copy kernels at this distance in bytes,\n"
+			"    or sweep the distance per kernel and report the best (auto).\n");
+	fprintf(stderr, "-I: also move the whole target through the mapping, pread/pwrite and io_uring\n"
+			"    in chunks of each size (e.g. 4k,64k,1m; a bare number is MiB).\n");
+	fprintf(stderr, "-C: cache state of the target before every timed pass; a list runs the tests\n"
+			"    once per state (evict:<size>, remote:<cpus> pick the buffer and cpu).\n");
+	fprintf(stderr, "-X: also time lock xadd/cmpxchg/cmpxchg16b and xchg on an aligned and a\n"
+			"    line-split word from each thread count (e.g. 1,2,4), contending for it.\n");
+	fprintf(stderr, "-L: loaded latency instead of the matrix: one traffic thread per cpu (2,3 or\n"
+			"    2-5) at each per-thread rate (MB/s, N%% of max, or max) while this thread\n"
+			"    chases pointers on each -d target, -i samples per rate.\n"
+			"-B: traffic target for -L; default is the upper half of each -d target.\n");
+	fprintf(stderr, "-A: attribute transition cost instead of the matrix: switch the first bytes of\n"
+			"    each uc/wc memcache target to its type and back to WB, -i round trips per\n"
+			"    size (e.g. 4k,2m,16m) and thread count (e.g. 1,2,4; default 1).\n");
+	fprintf(stderr, "-T: replay a binary access trace on each -d target instead of the matrix, -i\n"
+			"    passes; make one from text with %s trace [-b base] in.txt out.cbt\n", argv0);
+	fprintf(stderr, "-D: probe daemon: every interval seconds (default 10) run the -p probes (read,\n"
+			"    write, ntwrite or latency; default read on wb, ntwrite on wc, latency on uc)\n"
+			"    within a CPU budget (default 1%%) and rewrite a node-exporter textfile.\n");
+	fprintf(stderr, "-m, -f, -D, -T, -A and -L replace the matrix; at most one may be given.\n");
+	fprintf(stderr, "-R: dump every per-iteration sample to a binary file.\n");
+	fprintf(stderr, "-S: append this run's results to a store; compare runs with\n"
+			"    %s compare [-b run] [-r run] [-t pct] [-a alpha] store\n", argv0);
 }
 
 extern void test_a(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer);
@@ -738,25 +1444,23 @@ extern void test_b(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer
 extern void test_c(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer);
 extern void test_d(uint8_t* wc_buffer, uint8_t* uc_buffer, uint8_t* check_buffer);
 
-static void run_test_without_fence(void)
+static void run_test_without_fence(const char *wc_path, const char *uc_path)
 {
 	const size_t sz = 4096;
-	int fd_wc = -1, fd_uc = -1;
+	struct bench_target wc, uc;
 	uint8_t *wc_map = MAP_FAILED;
 	uint8_t *uc_map = MAP_FAILED;
 	uint8_t *check = NULL;
 
-	fd_wc = open("/dev/memcache_wc", O_RDWR);
-	if (fd_wc < 0)
-		goto out;
-	fd_uc = open("/dev/memcache_uc", O_RDWR);
-	if (fd_uc < 0)
+	target_init(&wc, wc_path, sz);
+	target_init(&uc, uc_path, sz);
+	if (target_open(&wc) != 0 || target_open(&uc) != 0)
 		goto out;
 
-	wc_map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd_wc, 0);
+	wc_map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, wc.fd, wc.offset);
 	if (wc_map == MAP_FAILED)
 		goto out;
-	uc_map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd_uc, 0);
+	uc_map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, uc.fd, uc.offset);
 	if (uc_map == MAP_FAILED)
 		goto out;
 
@@ -776,10 +1480,55 @@ out:
 		munmap(uc_map, sz);
 	if (wc_map != MAP_FAILED)
 		munmap(wc_map, sz);
-	if (fd_uc >= 0)
-		close(fd_uc);
-	if (fd_wc >= 0)
-		close(fd_wc);
+	target_close(&uc);
+	target_close(&wc);
+}
+
+/*
+ * -m, -f, -D, -T, -A and -L each run instead of the benchmark matrix, so at
+ * most one may be given, and an option the chosen mode would ignore is an
+ * error rather than silently dropped.
+ */
+static int check_modes(const char *seen)
+{
+	static const char modes[] = "mfDTAL";
+	/* Modes each option is used by; '-' is the matrix. */
+	static const struct {
+		char opt;
+		const char *modes;
+	} uses[] = {
+		{ 'd', "-mTAL" },
+		{ 'X', "-f" },
+		{ 'P', "-f" },
+		{ 'I', "-f" },
+		{ 'V', "-f" },
+		{ 'C', "-fT" },
+		{ 'K', "-fDL" },
+		{ 'B', "L" },
+		{ 'p', "D" },
+	};
+	char mode = '-';
+	size_t k;
+
+	for (k = 0; modes[k]; k++) {
+		if (!seen[(unsigned char)modes[k]])
+			continue;
+		if (mode != '-') {
+			fprintf(stderr, "-%c and -%c cannot be combined\n", mode, modes[k]);
+			return -1;
+		}
+		mode = modes[k];
+	}
+	for (k = 0; k < sizeof(uses) / sizeof(uses[0]); k++) {
+		if (!seen[(unsigned char)uses[k].opt] || strchr(uses[k].modes, mode))
+			continue;
+		if (mode == '-')
+			fprintf(stderr, "-%c needs -%c\n", uses[k].opt, uses[k].modes[0]);
+		else
+			fprintf(stderr, "-%c has no effect with -%c\n", uses[k].opt, mode);
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -788,9 +1537,28 @@ int main(int argc, char **argv)
 	int iters = 50;
 	int cpu = 0;
 	int pin = 0;
+	int map_only = 0;
+	struct bench_target targets[MAX_TARGETS];
+	int ntargets = 0;
+	int run_matrix;
+	const char *scenario_file = NULL;
+	const char *trace_file = NULL;
+	struct bench_target bg;
+	int have_bg = 0;
+	struct run_defaults defaults = { .store = "auto", .verify = "every", .prefetch = "off", .io = "off",
+					 .precond = "none" };
+	char seen[128] = { 0 };
 	int opt;
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "compare") == 0)
+		return results_compare_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "trace") == 0)
+		return replay_convert_main(argc - 1, argv + 1);
 
-	while ((opt = getopt(argc, argv, "s:i:c:h")) != -1) {
+	while ((opt = getopt(argc, argv, "s:i:c:md:f:R:S:V:K:P:I:C:X:L:B:A:T:D:p:h")) != -1) {
+		if (opt > 0 && opt < (int)sizeof(seen))
+			seen[opt] = 1;
 		switch (opt) {
 		case 's':
 			size_bytes = (size_t)strtoul(optarg, NULL, 0) * 1024 * 1024;
@@ -802,34 +1570,218 @@ int main(int argc, char **argv)
 			cpu = atoi(optarg);
 			pin = 1;
 			break;
+		case 'm':
+			map_only = 1;
+			break;
+		case 'R':
+			if (samples_dump_open(optarg) != 0) {
+				fprintf(stderr, "open %s failed: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			atexit(samples_dump_close);
+			break;
+		case 'S':
+			if (results_open(optarg) != 0) {
+				fprintf(stderr, "open %s failed: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			atexit(results_close);
+			break;
+		case 'V':
+			if (verify_parse(optarg) != 0) {
+				fprintf(stderr, "bad verify policy: %s\n", optarg);
+				return 1;
+			}
+			defaults.verify = optarg;
+			break;
+		case 'K':
+			if (store_parse(optarg) != 0) {
+				fprintf(stderr, "bad store kernel: %s\n", optarg);
+				return 1;
+			}
+			defaults.store = optarg;
+			break;
+		case 'P':
+			if (prefetch_parse(optarg) != 0) {
+				fprintf(stderr, "bad prefetch distance: %s\n", optarg);
+				return 1;
+			}
+			defaults.prefetch = optarg;
+			break;
+		case 'I':
+			if (io_parse(optarg) != 0) {
+				fprintf(stderr, "bad io sizes: %s\n", optarg);
+				return 1;
+			}
+			defaults.io = optarg;
+			break;
+		case 'C':
+			if (precond_parse(optarg) != 0) {
+				fprintf(stderr, "bad cache state: %s\n", optarg);
+				return 1;
+			}
+			defaults.precond = optarg;
+			break;
+		case 'A':
+			if (pat_parse(optarg) != 0) {
+				fprintf(stderr, "bad attribute transition spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'X':
+			if (atomic_parse(optarg) != 0) {
+				fprintf(stderr, "bad atomic spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'L':
+			if (loaded_parse(optarg) != 0) {
+				fprintf(stderr, "bad loaded latency spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			if (target_parse(optarg, &bg) != 0) {
+				fprintf(stderr, "bad traffic target: %s\n", optarg);
+				return 1;
+			}
+			have_bg = 1;
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'D':
+			if (daemon_parse(optarg) != 0) {
+				fprintf(stderr, "bad daemon spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (daemon_probe_parse(optarg) != 0) {
+				fprintf(stderr, "bad or too many probes: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			scenario_file = optarg;
+			break;
+		case 'd':
+			if (ntargets >= MAX_TARGETS || target_parse(optarg, &targets[ntargets]) != 0) {
+				fprintf(stderr, "bad or too many targets: %s\n", optarg);
+				return 1;
+			}
+			ntargets++;
+			break;
 		case 'h':
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
+	if (check_modes(seen) != 0) {
+		usage(argv[0]);
+		return 1;
+	}
 
 #if defined(__i386__) || defined(__x86_64__)
 	if (!pin)
 		pin = 1;
 #endif
 
-	if (pin) {
-		cpu_set_t set;
-		CPU_ZERO(&set);
-		CPU_SET(cpu, &set);
-		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
-			fprintf(stderr, "sched_setaffinity cpu=%d failed: %s\n", cpu, strerror(errno));
-			return 1;
+	if (pin && pin_cpu(cpu) != 0)
+		return 1;
+
+	timing_init();
+	timing_print();
+	verify_init();
+	verify_print();
+	energy_init();
+	energy_print();
+	topo_init();
+	topo_print();
+	if (store_init() != 0)
+		return 1;
+	store_print();
+	if (loaded_enabled() && loaded_init() != 0)
+		return 1;
+	loaded_print();
+	if (precond_init() != 0)
+		return 1;
+	precond_print();
+	atomic_init();
+	atomic_print();
+
+	if (daemon_enabled())
+		return run_daemon();
+
+	/* Without -d the module devices are the targets and only the micro-test runs. */
+	run_matrix = ntargets > 0;
+	if (!ntargets) {
+		target_init(&targets[ntargets++], MEMCACHE_DEV_WB, size_bytes);
+		target_init(&targets[ntargets++], MEMCACHE_DEV_UC, size_bytes);
+		target_init(&targets[ntargets++], MEMCACHE_DEV_WC, size_bytes);
+	} else if (size_bytes) {
+		for (i = 0; i < ntargets; i++) {
+			if (!targets[i].size_bytes) {
+				targets[i].size_bytes = size_bytes;
+				targets[i].size_from_arg = 1;
+			}
 		}
-		printf("pinned to cpu %d\n", cpu);
+	}
+
+	if (map_only) {
+		for (i = 0; i < ntargets; i++)
+			bench_map(&targets[i]);
+		return 0;
 	}
 
 	uc_fence_init();
 
-	//bench_one("/dev/memcache_wb", size_bytes, iters);
-	//bench_one("/dev/memcache_uc", size_bytes/8, iters/4);
-	//bench_one("/dev/memcache_wc", size_bytes, iters);
-	run_test_without_fence();
+	if (scenario_file) {
+		defaults.iters = iters;
+		defaults.cpu = cpu;
+		defaults.pin = pin;
+		return run_scenarios(scenario_file, &defaults);
+	}
+
+	if (trace_file) {
+		if (!run_matrix) {
+			fprintf(stderr, "-T needs at least one -d target\n");
+			return 1;
+		}
+		return run_replay(trace_file, targets, ntargets, iters);
+	}
+
+	if (pat_enabled()) {
+		if (!run_matrix) {
+			fprintf(stderr, "-A needs at least one -d target\n");
+			return 1;
+		}
+		return run_pat(targets, ntargets, iters);
+	}
+
+	if (loaded_enabled()) {
+		if (!run_matrix) {
+			fprintf(stderr, "-L needs at least one -d target\n");
+			return 1;
+		}
+		return run_loaded(targets, ntargets, have_bg ? &bg : NULL, iters);
+	}
+
+	if (run_matrix) {
+		for (i = 0; i < ntargets; i++) {
+			struct bench_target *t;
+			void *map;
+
+			t = map_get(&targets[i], &map);
+			if (!t)
+				exit(1);
+			bench_one(t, map, iters);
+		}
+		map_put_all();
+		return g_verify_failures ? 1 : 0;
+	}
+
+	run_test_without_fence(MEMCACHE_DEV_WC, MEMCACHE_DEV_UC);
 	return g_verify_failures ? 1 : 0;
 }
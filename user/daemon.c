@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "daemon.h"
+#include "loaded.h"
+#include "prefetch.h"
+#include "store.h"
+#include "timing.h"
+
+#define DAEMON_INTERVAL_DEFAULT 10.0
+#define DAEMON_BUDGET_DEFAULT 0.01
+#define DAEMON_PROBE_SIZE_DEFAULT (1u << 20)
+/* Passes per probe per round; the fastest one counts. */
+#define DAEMON_REPS 3
+/* Rounds the rolling statistics cover. */
+#define DAEMON_WINDOW 60
+#define DAEMON_LINE 64
+
+enum probe_kind {
+	PROBE_READ,
+	PROBE_WRITE,
+	PROBE_NTWRITE,
+	PROBE_LATENCY,
+	PROBE_KIND_NR,
+};
+
+static const char *const probe_kind_names[PROBE_KIND_NR] = {
+	[PROBE_READ] = "read",
+	[PROBE_WRITE] = "write",
+	[PROBE_NTWRITE] = "ntwrite",
+	[PROBE_LATENCY] = "latency",
+};
+
+struct probe {
+	enum probe_kind kind;
+	struct bench_target req;
+	const struct bench_target *t;
+	void *map;
+	/* Ring of the last DAEMON_WINDOW values, MB/s or ns. */
+	double win[DAEMON_WINDOW];
+	int nwin;
+	int head;
+	uint64_t runs;
+	double busy;
+};
+
+static char daemon_file[256];
+static double daemon_interval = DAEMON_INTERVAL_DEFAULT;
+static double daemon_budget = DAEMON_BUDGET_DEFAULT;
+static unsigned long daemon_rounds;
+static int daemon_on;
+
+static struct probe probes[DAEMON_MAX_PROBES];
+static int nprobes;
+
+static volatile sig_atomic_t daemon_stop;
+static volatile uint64_t daemon_sink;
+
+int daemon_parse(const char *spec)
+{
+	char buf[sizeof(daemon_file) + 64];
+	char *f[4] = { NULL, NULL, NULL, NULL };
+	char *end;
+	int n = 0;
+
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+	f[n++] = buf;
+	for (end = buf; n < 4 && (end = strchr(end, ':')); n++) {
+		*end++ = '\0';
+		f[n] = end;
+	}
+	if (!f[0][0] || snprintf(daemon_file, sizeof(daemon_file), "%s", f[0]) >= (int)sizeof(daemon_file))
+		return -1;
+	if (f[1] && f[1][0]) {
+		daemon_interval = strtod(f[1], &end);
+		if (end == f[1] || *end || daemon_interval <= 0.0)
+			return -1;
+	}
+	if (f[2] && f[2][0]) {
+		daemon_budget = strtod(f[2], &end) / 100.0;
+		if (end == f[2] || strcmp(end, "%") || daemon_budget <= 0.0 || daemon_budget > 1.0)
+			return -1;
+	}
+	if (f[3] && f[3][0]) {
+		daemon_rounds = strtoul(f[3], &end, 10);
+		if (end == f[3] || *end)
+			return -1;
+	}
+	daemon_on = 1;
+	return 0;
+}
+
+int daemon_probe_parse(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	struct probe *p;
+	int k;
+
+	if (!colon || nprobes >= DAEMON_MAX_PROBES)
+		return -1;
+	for (k = 0; k < PROBE_KIND_NR; k++) {
+		if (strlen(probe_kind_names[k]) == (size_t)(colon - spec) &&
+		    !strncmp(spec, probe_kind_names[k], (size_t)(colon - spec)))
+			break;
+	}
+	if (k == PROBE_KIND_NR)
+		return -1;
+	p = &probes[nprobes];
+	memset(p, 0, sizeof(*p));
+	p->kind = (enum probe_kind)k;
+	if (target_parse(colon + 1, &p->req) != 0)
+		return -1;
+	if (!p->req.size_bytes) {
+		p->req.size_bytes = DAEMON_PROBE_SIZE_DEFAULT;
+		p->req.size_from_arg = 1;
+	}
+	nprobes++;
+	return 0;
+}
+
+int daemon_enabled(void)
+{
+	return daemon_on;
+}
+
+int daemon_nprobes(void)
+{
+	if (!nprobes) {
+		daemon_probe_parse("read:" MEMCACHE_DEV_WB);
+		daemon_probe_parse("ntwrite:" MEMCACHE_DEV_WC);
+		daemon_probe_parse("latency:" MEMCACHE_DEV_UC ":64k");
+	}
+	return nprobes;
+}
+
+const struct bench_target *daemon_probe_target(int i)
+{
+	return &probes[i].req;
+}
+
+void daemon_probe_bind(int i, const struct bench_target *t, void *map)
+{
+	probes[i].t = t;
+	probes[i].map = map;
+}
+
+void daemon_print(void)
+{
+	int i;
+
+	if (!daemon_on)
+		return;
+	printf("daemon: file=%s interval=%.3gs budget=%.3g%% rounds=%lu probes=", daemon_file, daemon_interval,
+	       daemon_budget * 100.0, daemon_rounds);
+	for (i = 0; i < daemon_nprobes(); i++)
+		printf("%s%s:%s:%zuk", i ? "," : "", probe_kind_names[probes[i].kind], probes[i].req.path,
+		       probes[i].req.size_bytes >> 10);
+	printf("\n");
+}
+
+static void fence(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	_mm_sfence();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/* One round of one probe: MB/s or ns per load from the fastest of DAEMON_REPS passes. */
+static int probe_run(struct probe *p, double *value)
+{
+	size_t len = p->t->size_bytes;
+	size_t n64 = len / sizeof(uint64_t);
+	size_t lines = len / DAEMON_LINE;
+	double best = 0.0;
+	void *cur = p->map;
+	store_fn st = store_kernel(p->kind == PROBE_NTWRITE ? STORE_NT : STORE_PLAIN);
+	int rep;
+
+	if ((p->kind == PROBE_WRITE || p->kind == PROBE_NTWRITE) && !st)
+		return -1;
+	/* Another probe may have written over the chain since the last round. */
+	if (p->kind == PROBE_LATENCY && (lines < 2 || chase_build(p->map, lines) != 0))
+		return -1;
+	for (rep = 0; rep < DAEMON_REPS; rep++) {
+		double t0, t1;
+
+		t0 = now_sec();
+		switch (p->kind) {
+		case PROBE_READ:
+			daemon_sink += pf_read_kernel(PF_READ_LOAD, PF_NONE)(p->map, n64, 0);
+			break;
+		case PROBE_WRITE:
+		case PROBE_NTWRITE:
+			store_fill(st, p->map, n64, p->runs + (uint64_t)rep, n64);
+			fence();
+			break;
+		default:
+			cur = chase_hops(cur, lines);
+			break;
+		}
+		t1 = now_sec();
+		if (!rep || t1 - t0 < best)
+			best = t1 - t0;
+	}
+	daemon_sink += (uintptr_t)cur;
+	if (best <= 0.0)
+		return -1;
+	if (p->kind == PROBE_LATENCY)
+		*value = best * 1e9 / (double)lines;
+	else
+		*value = (double)len / (1024.0 * 1024.0) / best;
+	return 0;
+}
+
+static void probe_add(struct probe *p, double v)
+{
+	p->win[p->head] = v;
+	p->head = (p->head + 1) % DAEMON_WINDOW;
+	if (p->nwin < DAEMON_WINDOW)
+		p->nwin++;
+	p->runs++;
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+struct probe_stats {
+	double last, mean, p50, min, max;
+};
+
+static void probe_stats(const struct probe *p, struct probe_stats *s)
+{
+	double sorted[DAEMON_WINDOW];
+	double sum = 0.0;
+	int i;
+
+	memcpy(sorted, p->win, (size_t)p->nwin * sizeof(double));
+	qsort(sorted, (size_t)p->nwin, sizeof(double), dbl_cmp);
+	for (i = 0; i < p->nwin; i++)
+		sum += sorted[i];
+	s->last = p->win[(p->head + DAEMON_WINDOW - 1) % DAEMON_WINDOW];
+	s->mean = sum / p->nwin;
+	s->p50 = sorted[p->nwin / 2];
+	s->min = sorted[0];
+	s->max = sorted[p->nwin - 1];
+}
+
+/* Label value with \, " and newline escaped as the text format wants. */
+static void put_label(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			fprintf(f, "\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+}
+
+static void put_probe_labels(FILE *f, const struct probe *p)
+{
+	fprintf(f, "{probe=\"%s\",target=\"", probe_kind_names[p->kind]);
+	put_label(f, p->t->path);
+	fprintf(f, "\",size=\"%zu\"", p->t->size_bytes);
+}
+
+static void write_metric(FILE *f, const char *name, const char *help, int latency)
+{
+	static const char *const stat_names[] = { "last", "mean", "p50", "min", "max" };
+	int i, k;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+	for (i = 0; i < nprobes; i++) {
+		const struct probe *p = &probes[i];
+		struct probe_stats s;
+		const double *v = &s.last;
+
+		if ((p->kind == PROBE_LATENCY) != latency || !p->nwin)
+			continue;
+		probe_stats(p, &s);
+		for (k = 0; k < 5; k++) {
+			fputs(name, f);
+			put_probe_labels(f, p);
+			fprintf(f, ",stat=\"%s\"} %.6g\n", stat_names[k], v[k]);
+		}
+	}
+}
+
+/* Written next to the file and renamed over it, so the exporter never reads half a file. */
+static int write_textfile(double busy_ratio, double spacing)
+{
+	char tmp[sizeof(daemon_file) + 32];
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", daemon_file, (int)getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "open %s failed: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	write_metric(f, "cache_bench_probe_mbps", "Probe bandwidth in MiB/s over the rolling window.", 0);
+	write_metric(f, "cache_bench_probe_latency_ns", "Probe dependent-load latency in ns over the rolling window.",
+		     1);
+	fprintf(f, "# HELP cache_bench_probe_runs_total Probe rounds since start.\n"
+		   "# TYPE cache_bench_probe_runs_total counter\n");
+	for (i = 0; i < nprobes; i++) {
+		fputs("cache_bench_probe_runs_total", f);
+		put_probe_labels(f, &probes[i]);
+		fprintf(f, "} %llu\n", (unsigned long long)probes[i].runs);
+	}
+	fprintf(f, "# HELP cache_bench_probe_busy_seconds_total Seconds spent in the probe since start.\n"
+		   "# TYPE cache_bench_probe_busy_seconds_total counter\n");
+	for (i = 0; i < nprobes; i++) {
+		fputs("cache_bench_probe_busy_seconds_total", f);
+		put_probe_labels(f, &probes[i]);
+		fprintf(f, "} %.6f\n", probes[i].busy);
+	}
+	fprintf(f, "# HELP cache_bench_daemon_busy_ratio Share of one CPU the probes take at the last round's spacing.\n"
+		   "# TYPE cache_bench_daemon_busy_ratio gauge\n"
+		   "cache_bench_daemon_busy_ratio %.6f\n", busy_ratio);
+	fprintf(f, "# HELP cache_bench_daemon_round_seconds Spacing of the rounds; the interval unless the budget\n"
+		   "# stretches it.\n"
+		   "# TYPE cache_bench_daemon_round_seconds gauge\n"
+		   "cache_bench_daemon_round_seconds %.3f\n", spacing);
+	fprintf(f, "# HELP cache_bench_daemon_last_round_timestamp_seconds Unix time of the last round.\n"
+		   "# TYPE cache_bench_daemon_last_round_timestamp_seconds gauge\n"
+		   "cache_bench_daemon_last_round_timestamp_seconds %lld\n", (long long)time(NULL));
+	if (fclose(f) != 0 || rename(tmp, daemon_file) != 0) {
+		fprintf(stderr, "write %s failed: %s\n", daemon_file, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	daemon_stop = 1;
+}
+
+/* Sleeps until deadline (now_sec() time) unless a signal asks to stop. */
+static void sleep_until(double deadline)
+{
+	double left;
+
+	while (!daemon_stop && (left = deadline - now_sec()) > 0.0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)left;
+		ts.tv_nsec = (long)((left - (double)ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+}
+
+int daemon_run(void)
+{
+	struct sigaction sa;
+	unsigned long round;
+	int i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (round = 0; !daemon_stop && (!daemon_rounds || round < daemon_rounds); round++) {
+		double start = now_sec(), busy, wait;
+
+		for (i = 0; i < nprobes; i++) {
+			struct probe *p = &probes[i];
+			double t0 = now_sec(), v;
+
+			if (probe_run(p, &v) == 0)
+				probe_add(p, v);
+			p->busy += now_sec() - t0;
+		}
+		busy = now_sec() - start;
+		/* The interval, stretched when the round would take more than the budget. */
+		wait = daemon_interval;
+		if (busy / daemon_budget > wait)
+			wait = busy / daemon_budget;
+		if (write_textfile(busy / wait, wait) != 0)
+			return 1;
+
+		printf("daemon round %lu:", round);
+		for (i = 0; i < nprobes; i++) {
+			const struct probe *p = &probes[i];
+
+			if (p->nwin)
+				printf(" %s %s=%.1f%s", probe_kind_names[p->kind], p->t->path,
+				       p->win[(p->head + DAEMON_WINDOW - 1) % DAEMON_WINDOW],
+				       p->kind == PROBE_LATENCY ? "ns" : "MB/s");
+		}
+		printf(" busy=%.1fms\n", busy * 1e3);
+		fflush(stdout);
+
+		if (daemon_rounds && round + 1 >= daemon_rounds)
+			break;
+		sleep_until(start + wait);
+	}
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef CACHE_BENCH_DAEMON_H
+#define CACHE_BENCH_DAEMON_H
+
+#include "target.h"
+
+/*
+ * Probe daemon: keeps a few small probes mapped and runs them every interval
+ * under a CPU budget, keeping rolling statistics per probe and rewriting a
+ * node-exporter textfile after every round.
+ *
+ * -D file[:interval[:budget[:rounds]]]
+ *   interval  seconds between rounds (default 10)
+ *   budget    share of one CPU the probes may take, N% (default 1%); rounds
+ *             are spaced further apart when a round takes longer
+ *   rounds    stop after this many, 0 (default) runs until SIGINT/SIGTERM
+ *
+ * -p kind:path[:size[:offset]], repeatable
+ *   kind      read | write | ntwrite (MB/s) or latency (ns per dependent load)
+ *   size      default 1m
+ * Without -p: read on the WB, ntwrite on the WC and latency on the UC device.
+ */
+
+#define DAEMON_MAX_PROBES 16
+
+int daemon_parse(const char *spec);
+int daemon_probe_parse(const char *spec);
+int daemon_enabled(void);
+int daemon_nprobes(void);
+/* The probe's requested target, for the caller to map. */
+const struct bench_target *daemon_probe_target(int i);
+void daemon_probe_bind(int i, const struct bench_target *t, void *map);
+void daemon_print(void);
+/* Runs the rounds; returns the exit code. */
+int daemon_run(void);
+
+#endif
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+#include "energy.h"
+#include "timing.h"
+#include "topo.h"
+
+#define POWERCAP_DIR "/sys/class/powercap"
+#define MSR_IA32_MPERF 0xe7
+#define MSR_IA32_APERF 0xe8
+
+struct rapl_domain {
+	char name[32];
+	char energy_path[300];
+	/* energy_uj wraps at this value */
+	uint64_t range;
+	int dram;
+};
+
+static struct rapl_domain rapl[ENERGY_MAX_DOMAINS];
+static int nrapl;
+
+/* APERF/MPERF of freq_cpu, from the msr device or else the perf msr PMU. */
+static const char *freq_source = "unavailable";
+static int freq_cpu = -1;
+static int msr_fd = -1;
+static int perf_aperf_fd = -1;
+static int perf_mperf_fd = -1;
+
+static int read_u64_file(const char *path, uint64_t *v)
+{
+	unsigned long long x;
+	FILE *f;
+	int ok;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ok = fscanf(f, "%llu", &x) == 1;
+	fclose(f);
+	if (!ok)
+		return -1;
+	*v = x;
+	return 0;
+}
+
+/* Package and DRAM zones; core, uncore and psys would count twice. */
+static void rapl_init(void)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(POWERCAP_DIR);
+	if (!d)
+		return;
+	while ((de = readdir(d)) && nrapl < ENERGY_MAX_DOMAINS) {
+		struct rapl_domain *r = &rapl[nrapl];
+		char path[300];
+		uint64_t v;
+
+		if (strncmp(de->d_name, "intel-rapl:", 11))
+			continue;
+		snprintf(path, sizeof(path), POWERCAP_DIR "/%s/name", de->d_name);
+		if (sysfs_read_line(path, r->name, sizeof(r->name)) != 0)
+			continue;
+		if (!strncmp(r->name, "package-", 8))
+			r->dram = 0;
+		else if (!strcmp(r->name, "dram"))
+			r->dram = 1;
+		else
+			continue;
+		snprintf(r->energy_path, sizeof(r->energy_path), POWERCAP_DIR "/%s/energy_uj", de->d_name);
+		/* Readable by root only on kernels with the RAPL side-channel fix. */
+		if (read_u64_file(r->energy_path, &v) != 0)
+			continue;
+		snprintf(path, sizeof(path), POWERCAP_DIR "/%s/max_energy_range_uj", de->d_name);
+		if (read_u64_file(path, &r->range) != 0)
+			r->range = 0;
+		nrapl++;
+	}
+	closedir(d);
+}
+
+static int perf_msr_open(int type, const char *event, int cpu)
+{
+	struct perf_event_attr attr;
+	char path[128], buf[64];
+	unsigned long long config;
+
+	snprintf(path, sizeof(path), "/sys/bus/event_source/devices/msr/events/%s", event);
+	if (sysfs_read_line(path, buf, sizeof(buf)) != 0 || sscanf(buf, "event=%llx", &config) != 1)
+		return -1;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = (unsigned int)type;
+	attr.config = config;
+	return (int)syscall(SYS_perf_event_open, &attr, -1, cpu, -1, 0);
+}
+
+static void freq_close(void)
+{
+	if (msr_fd >= 0)
+		close(msr_fd);
+	if (perf_aperf_fd >= 0)
+		close(perf_aperf_fd);
+	if (perf_mperf_fd >= 0)
+		close(perf_mperf_fd);
+	msr_fd = perf_aperf_fd = perf_mperf_fd = -1;
+	freq_source = "unavailable";
+}
+
+static void freq_open(int cpu)
+{
+	char path[64];
+	uint64_t type;
+
+	freq_close();
+	freq_cpu = cpu;
+	if (cpu < 0)
+		return;
+
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	msr_fd = open(path, O_RDONLY);
+	if (msr_fd >= 0) {
+		uint64_t v;
+
+		if (pread(msr_fd, &v, sizeof(v), MSR_IA32_APERF) == (ssize_t)sizeof(v)) {
+			freq_source = "msr";
+			return;
+		}
+		close(msr_fd);
+		msr_fd = -1;
+	}
+
+	if (read_u64_file("/sys/bus/event_source/devices/msr/type", &type) != 0)
+		return;
+	perf_aperf_fd = perf_msr_open((int)type, "aperf", cpu);
+	perf_mperf_fd = perf_msr_open((int)type, "mperf", cpu);
+	if (perf_aperf_fd >= 0 && perf_mperf_fd >= 0) {
+		freq_source = "perf";
+		return;
+	}
+	freq_close();
+}
+
+static int freq_read(uint64_t *aperf, uint64_t *mperf)
+{
+	if (msr_fd >= 0)
+		return pread(msr_fd, aperf, sizeof(*aperf), MSR_IA32_APERF) == (ssize_t)sizeof(*aperf) &&
+		       pread(msr_fd, mperf, sizeof(*mperf), MSR_IA32_MPERF) == (ssize_t)sizeof(*mperf);
+	if (perf_aperf_fd >= 0)
+		return read(perf_aperf_fd, aperf, sizeof(*aperf)) == (ssize_t)sizeof(*aperf) &&
+		       read(perf_mperf_fd, mperf, sizeof(*mperf)) == (ssize_t)sizeof(*mperf);
+	return 0;
+}
+
+void energy_init(void)
+{
+	rapl_init();
+	freq_open(sched_getcpu());
+}
+
+void energy_print(void)
+{
+	int i;
+
+	printf("energy: rapl=");
+	for (i = 0; i < nrapl; i++)
+		printf("%s%s", i ? "," : "", rapl[i].name);
+	printf("%s freq=%s", nrapl ? "" : "unavailable", freq_source);
+	if (msr_fd >= 0 || perf_aperf_fd >= 0)
+		printf(" cpu=%d", freq_cpu);
+	printf("\n");
+}
+
+int energy_available(void)
+{
+	return nrapl || msr_fd >= 0 || perf_aperf_fd >= 0;
+}
+
+void energy_snap(struct energy_snap *s)
+{
+	int cpu = sched_getcpu();
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	/* Scenarios re-pin between runs; follow the CPU the test runs on. */
+	if (cpu != freq_cpu)
+		freq_open(cpu);
+	s->freq_ok = freq_read(&s->aperf, &s->mperf);
+	for (i = 0; i < nrapl; i++) {
+		if (read_u64_file(rapl[i].energy_path, &s->uj[i]) != 0)
+			s->uj[i] = 0;
+	}
+	s->t = now_sec();
+}
+
+void energy_diff(const struct energy_snap *a, const struct energy_snap *b, struct energy_delta *d)
+{
+	int i;
+
+	memset(d, 0, sizeof(*d));
+	d->sec = b->t - a->t;
+	for (i = 0; i < nrapl; i++) {
+		uint64_t uj = b->uj[i] - a->uj[i];
+
+		if (b->uj[i] < a->uj[i])
+			uj = rapl[i].range ? b->uj[i] + rapl[i].range - a->uj[i] : 0;
+		if (rapl[i].dram) {
+			d->have_dram = 1;
+			d->dram_j += (double)uj / 1e6;
+		} else {
+			d->have_pkg = 1;
+			d->pkg_j += (double)uj / 1e6;
+		}
+	}
+	/* MPERF ticks at the base (TSC) rate, APERF at the actual one. */
+	if (a->freq_ok && b->freq_ok && b->mperf > a->mperf)
+		d->mhz = timing_hz() * (double)(b->aperf - a->aperf) / (double)(b->mperf - a->mperf) / 1e6;
+}
@@ -0,0 +1,39 @@
+#ifndef CACHE_BENCH_ENERGY_H
+#define CACHE_BENCH_ENERGY_H
+
+#include <stdint.h>
+
+/*
+ * Energy and effective frequency around a test: RAPL package/DRAM counters
+ * from powercap, APERF/MPERF of the current CPU from /dev/cpu/N/msr or the
+ * perf msr PMU. Anything missing is left out of the report.
+ */
+
+#define ENERGY_MAX_DOMAINS 8
+
+struct energy_snap {
+	double t;
+	uint64_t uj[ENERGY_MAX_DOMAINS];
+	uint64_t aperf;
+	uint64_t mperf;
+	int freq_ok;
+};
+
+struct energy_delta {
+	double sec;
+	int have_pkg;
+	int have_dram;
+	double pkg_j;
+	double dram_j;
+	/* 0 when APERF/MPERF could not be read */
+	double mhz;
+};
+
+void energy_init(void);
+void energy_print(void);
+/* Nonzero when at least one counter can be read. */
+int energy_available(void);
+void energy_snap(struct energy_snap *s);
+void energy_diff(const struct energy_snap *a, const struct energy_snap *b, struct energy_delta *d);
+
+#endif
@@ -0,0 +1,158 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+/* Raw dump: "CBRAW001", then per series: u32 label_len, label, u32 unit_len, unit, u64 n, u64 v[n]. */
+#define SAMPLES_DUMP_MAGIC "CBRAW001"
+
+static FILE *dump_file;
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e, shift;
+
+	if (v < HIST_SUB_COUNT)
+		return (unsigned int)v;
+	e = 63u - (unsigned int)__builtin_clzll(v);
+	shift = e - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) | (unsigned int)((v >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* Highest value that maps to bucket idx. */
+static uint64_t hist_bucket_top(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t base;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	base = (uint64_t)(HIST_SUB_COUNT | (idx & (HIST_SUB_COUNT - 1))) << shift;
+	return base + ((1ull << shift) - 1);
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(struct hist *h, uint64_t v)
+{
+	h->counts[hist_index(v)]++;
+	h->n++;
+	h->sum += (double)v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!h->n)
+		return 0;
+	rank = (uint64_t)((pct / 100.0) * (double)h->n + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->n)
+		rank = h->n;
+
+	for (i = 0; i < HIST_NBUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t top = hist_bucket_top(i);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+void samples_init(struct samples *s, const char *unit)
+{
+	memset(s, 0, sizeof(*s));
+	hist_reset(&s->h);
+	s->unit = unit;
+}
+
+void samples_reset(struct samples *s)
+{
+	hist_reset(&s->h);
+	s->n = 0;
+}
+
+void samples_add(struct samples *s, uint64_t v)
+{
+	hist_record(&s->h, v);
+	if (s->n == s->cap) {
+		size_t cap = s->cap ? s->cap * 2 : 256;
+		uint64_t *nv = realloc(s->v, cap * sizeof(*nv));
+
+		/* Out of memory only costs the raw series; the histogram is complete. */
+		if (!nv)
+			return;
+		s->v = nv;
+		s->cap = cap;
+	}
+	s->v[s->n++] = v;
+}
+
+void samples_free(struct samples *s)
+{
+	free(s->v);
+	s->v = NULL;
+	s->n = 0;
+	s->cap = 0;
+}
+
+static void samples_dump(const char *label, const struct samples *s)
+{
+	const char *unit = s->unit ? s->unit : "";
+	uint32_t len;
+	uint64_t n = s->n;
+
+	len = (uint32_t)strlen(label);
+	fwrite(&len, sizeof(len), 1, dump_file);
+	fwrite(label, 1, len, dump_file);
+	len = (uint32_t)strlen(unit);
+	fwrite(&len, sizeof(len), 1, dump_file);
+	fwrite(unit, 1, len, dump_file);
+	fwrite(&n, sizeof(n), 1, dump_file);
+	fwrite(s->v, sizeof(s->v[0]), s->n, dump_file);
+}
+
+void samples_report(const char *label, const struct samples *s, const char *unit, double div)
+{
+	const struct hist *h = &s->h;
+
+	if (!h->n)
+		return;
+	printf("%s %s: mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f min=%.1f max=%.1f n=%" PRIu64 "\n",
+	       label, unit, h->sum / (double)h->n / div, (double)hist_percentile(h, 50.0) / div,
+	       (double)hist_percentile(h, 90.0) / div, (double)hist_percentile(h, 99.0) / div,
+	       (double)hist_percentile(h, 99.9) / div, (double)h->min / div, (double)h->max / div, h->n);
+	if (dump_file)
+		samples_dump(label, s);
+}
+
+int samples_dump_open(const char *path)
+{
+	dump_file = fopen(path, "wb");
+	if (!dump_file)
+		return -1;
+	fwrite(SAMPLES_DUMP_MAGIC, 1, 8, dump_file);
+	return 0;
+}
+
+void samples_dump_close(void)
+{
+	if (dump_file)
+		fclose(dump_file);
+	dump_file = NULL;
+}
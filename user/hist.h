@@ -0,0 +1,52 @@
+#ifndef CACHE_BENCH_HIST_H
+#define CACHE_BENCH_HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log-bucketed histogram in the HDR style: values below 2^HIST_SUB_BITS are
+ * exact, larger ones land in one of 2^HIST_SUB_BITS linear sub-buckets of
+ * their power of two (relative error below 1/2^HIST_SUB_BITS).
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+#define HIST_NBUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist {
+	uint64_t counts[HIST_NBUCKETS];
+	uint64_t n;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+};
+
+/* Histogram plus the raw values, kept for dumps and significance tests. */
+struct samples {
+	struct hist h;
+	/* Unit of the recorded values, e.g. "ns" or "cycles". */
+	const char *unit;
+	uint64_t *v;
+	size_t n;
+	size_t cap;
+};
+
+void hist_reset(struct hist *h);
+void hist_record(struct hist *h, uint64_t v);
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+void samples_init(struct samples *s, const char *unit);
+void samples_reset(struct samples *s);
+void samples_add(struct samples *s, uint64_t v);
+void samples_free(struct samples *s);
+/*
+ * Print mean and p50/p90/p99/p99.9/max as "<label> <unit>: ...", values
+ * divided by div to get unit, and append the raw series to the dump file if
+ * one is open.
+ */
+void samples_report(const char *label, const struct samples *s, const char *unit, double div);
+
+int samples_dump_open(const char *path);
+void samples_dump_close(void);
+
+#endif
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "hist.h"
+#include "loaded.h"
+#include "prefetch.h"
+#include "store.h"
+#include "timing.h"
+#include "topo.h"
+
+#define LOADED_LINE 64
+/* Traffic is issued, counted and throttled in chunks of this many bytes. */
+#define LOADED_CHUNK (64 * 1024)
+/* Hops per latency sample. */
+#define LOADED_HOPS 1024
+/* Chase without recording after the threads start, until they reach their rate. */
+#define LOADED_WARMUP 0.02
+/* Shortest bandwidth window per point; a few hundred samples can take well under a millisecond. */
+#define LOADED_WINDOW 0.25
+/* A thread that fell behind catches up by at most this much. */
+#define LOADED_SLACK 0.005
+
+enum loaded_kind {
+	LOADED_READ,
+	LOADED_WRITE,
+	LOADED_NTWRITE,
+};
+
+static const char *const loaded_kind_names[] = {
+	[LOADED_READ] = "read",
+	[LOADED_WRITE] = "write",
+	[LOADED_NTWRITE] = "ntwrite",
+};
+
+struct loaded_rate {
+	/* Per thread; exactly one of the three is set. */
+	double mbps;
+	double pct;
+	int max;
+};
+
+struct loaded_worker {
+	uint64_t *p;
+	size_t n64;
+	/* Bytes per second, 0 for unthrottled. */
+	double rate;
+	/* Bytes moved so far, read by the chasing thread. */
+	uint64_t bytes;
+	uint64_t sink;
+};
+
+struct loaded_point {
+	char name[24];
+	double mbps;
+	double p50_ns;
+	double p90_ns;
+	double p99_ns;
+};
+
+static int loaded_on;
+static enum loaded_kind loaded_kind;
+static int loaded_cpus[LOADED_MAX_THREADS];
+static int loaded_ncpus;
+static char loaded_cpus_str[128];
+static char loaded_place_str[512];
+static struct loaded_rate loaded_rates[LOADED_MAX_RATES];
+static int loaded_nrates;
+static char loaded_rates_str[128];
+
+static store_fn loaded_store;
+static pf_read_fn loaded_read;
+
+static struct topo_group loaded_group;
+static void *volatile loaded_sink;
+
+static int parse_rates(char *s)
+{
+	char *save, *tok;
+
+	loaded_nrates = 0;
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		struct loaded_rate *r;
+		char *end;
+		double v;
+
+		if (loaded_nrates >= LOADED_MAX_RATES)
+			return -1;
+		r = &loaded_rates[loaded_nrates++];
+		memset(r, 0, sizeof(*r));
+		if (!strcmp(tok, "max")) {
+			r->max = 1;
+			continue;
+		}
+		v = strtod(tok, &end);
+		if (end == tok || v <= 0.0)
+			return -1;
+		if (!strcmp(end, "%"))
+			r->pct = v;
+		else if (!*end)
+			r->mbps = v;
+		else
+			return -1;
+	}
+	return loaded_nrates ? 0 : -1;
+}
+
+int loaded_parse(const char *spec)
+{
+	char buf[256];
+	char *kind, *cpus, *rates;
+	size_t k;
+
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+	kind = buf;
+	cpus = strchr(kind, ':');
+	if (!cpus)
+		return -1;
+	*cpus++ = '\0';
+	rates = strchr(cpus, ':');
+	if (rates)
+		*rates++ = '\0';
+	else
+		rates = "10%,25%,50%,75%,90%,max";
+
+	for (k = 0; k < sizeof(loaded_kind_names) / sizeof(loaded_kind_names[0]); k++) {
+		if (!strcmp(kind, loaded_kind_names[k]))
+			break;
+	}
+	if (k == sizeof(loaded_kind_names) / sizeof(loaded_kind_names[0]))
+		return -1;
+	loaded_kind = (enum loaded_kind)k;
+	snprintf(loaded_cpus_str, sizeof(loaded_cpus_str), "%s", cpus);
+	snprintf(loaded_rates_str, sizeof(loaded_rates_str), "%s", rates);
+	/* A policy needs the topology, so the CPUs are resolved in loaded_init. */
+	if (!cpus[0])
+		return -1;
+	/* rates may point at the default literal; parse a copy. */
+	snprintf(buf, sizeof(buf), "%s", loaded_rates_str);
+	if (parse_rates(buf) != 0)
+		return -1;
+	loaded_on = 1;
+	return 0;
+}
+
+int loaded_enabled(void)
+{
+	return loaded_on;
+}
+
+int loaded_init(void)
+{
+	int self = sched_getcpu();
+
+	if (self < 0)
+		self = 0;
+	/* The chase runs on self; traffic there would time-share with it. */
+	loaded_ncpus = topo_place_helpers(loaded_cpus_str, self, loaded_cpus, LOADED_MAX_THREADS);
+	if (loaded_ncpus < 1) {
+		fprintf(stderr, "loaded: no cpus for %s\n", loaded_cpus_str);
+		return -1;
+	}
+	topo_describe(loaded_place_str, sizeof(loaded_place_str), self, loaded_cpus, loaded_ncpus);
+
+	loaded_store = NULL;
+	loaded_read = NULL;
+	switch (loaded_kind) {
+	case LOADED_READ:
+		loaded_read = pf_read_kernel(PF_READ_LOAD, PF_NONE);
+		break;
+	case LOADED_WRITE:
+		loaded_store = store_kernel(STORE_PLAIN);
+		break;
+	case LOADED_NTWRITE:
+		loaded_store = store_kernel(STORE_NT);
+		break;
+	}
+	if (!loaded_store && !loaded_read) {
+		fprintf(stderr, "no kernel for the loaded latency traffic\n");
+		return -1;
+	}
+	return 0;
+}
+
+void loaded_print(void)
+{
+	if (!loaded_on)
+		return;
+	printf("loaded: traffic=%s threads=%d cpus=%s (%s) rates=%s\n", loaded_kind_names[loaded_kind],
+	       loaded_ncpus, loaded_cpus_str, loaded_place_str, loaded_rates_str);
+}
+
+static void *loaded_worker_main(void *arg)
+{
+	struct loaded_worker *w = arg;
+	size_t chunk = LOADED_CHUNK / sizeof(uint64_t);
+	size_t off = 0;
+	uint64_t done = 0, base = 0, sum = 0;
+	double t0;
+
+	if (chunk > w->n64)
+		chunk = w->n64;
+	topo_group_ready(&loaded_group);
+	t0 = now_sec();
+	while (!topo_group_stopping(&loaded_group)) {
+		if (off + chunk > w->n64) {
+			off = 0;
+			base++;
+		}
+		switch (loaded_kind) {
+		case LOADED_READ:
+			sum += loaded_read(w->p + off, chunk, 0);
+			break;
+		case LOADED_WRITE:
+			loaded_store(w->p, off, off + chunk, base);
+			break;
+		case LOADED_NTWRITE:
+			loaded_store(w->p, off, off + chunk, base);
+#if defined(__i386__) || defined(__x86_64__)
+			_mm_sfence();
+#endif
+			break;
+		}
+		off += chunk;
+		done += chunk * sizeof(uint64_t);
+		__atomic_store_n(&w->bytes, done, __ATOMIC_RELAXED);
+
+		if (w->rate > 0.0) {
+			double now = now_sec();
+			double due = t0 + (double)done / w->rate;
+
+			/* Descheduled or too slow: do not burst to make up for it. */
+			if (due < now - LOADED_SLACK)
+				t0 = now - LOADED_SLACK - (double)done / w->rate;
+			while (now_sec() < due && !topo_group_stopping(&loaded_group))
+				cpu_relax();
+		}
+	}
+	w->sink = sum;
+	return NULL;
+}
+
+/* Sattolo's shuffle gives a single cycle through all lines. */
+int chase_build(void *chase, size_t lines)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ull;
+	size_t *next;
+	size_t i;
+
+	next = malloc(lines * sizeof(*next));
+	if (!next)
+		return -1;
+	for (i = 0; i < lines; i++)
+		next[i] = i;
+	for (i = lines - 1; i > 0; i--) {
+		size_t j, tmp;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		j = (size_t)(x % i);
+		tmp = next[i];
+		next[i] = next[j];
+		next[j] = tmp;
+	}
+	for (i = 0; i < lines; i++)
+		*(void *volatile *)((char *)chase + i * LOADED_LINE) = (char *)chase + next[i] * LOADED_LINE;
+	/* The chain may sit in WC memory. */
+	__sync_synchronize();
+	free(next);
+	return 0;
+}
+
+__attribute__((noinline)) void *chase_hops(void *p, size_t hops)
+{
+	for (; hops >= 4; hops -= 4) {
+		p = *(void *volatile *)p;
+		p = *(void *volatile *)p;
+		p = *(void *volatile *)p;
+		p = *(void *volatile *)p;
+	}
+	for (; hops; hops--)
+		p = *(void *volatile *)p;
+	return p;
+}
+
+static int workers_start(struct loaded_worker *w, int n, uint64_t *traffic, size_t traffic_n64, double rate)
+{
+	size_t slice = traffic_n64 / (size_t)n / (LOADED_LINE / sizeof(uint64_t)) * (LOADED_LINE / sizeof(uint64_t));
+	int i;
+
+	for (i = 0; i < n; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].p = traffic + (size_t)i * slice;
+		w[i].n64 = slice;
+		w[i].rate = rate;
+	}
+	return topo_group_start(&loaded_group, loaded_cpus, n, loaded_worker_main, w, sizeof(w[0]));
+}
+
+static uint64_t workers_bytes(const struct loaded_worker *w, int n)
+{
+	uint64_t b = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		b += __atomic_load_n(&w[i].bytes, __ATOMIC_RELAXED);
+	return b;
+}
+
+/*
+ * One point: traffic at rate bytes/s per thread (0 unthrottled) from nthreads
+ * threads, or none for the idle point, while the chase is sampled.
+ */
+static int loaded_point(const char *path, struct loaded_point *pt, struct samples *lat, void *chase,
+			uint64_t *traffic, size_t traffic_n64, int nthreads, double rate, int samples)
+{
+	struct loaded_worker w[LOADED_MAX_THREADS];
+	char label[320];
+	void *p = chase;
+	uint64_t b0, b1;
+	double t0, t1;
+	int s;
+
+	if (nthreads && workers_start(w, nthreads, traffic, traffic_n64, rate) != 0)
+		return -1;
+
+	t0 = now_sec();
+	while (now_sec() - t0 < LOADED_WARMUP)
+		p = chase_hops(p, LOADED_HOPS);
+
+	samples_reset(lat);
+	b0 = nthreads ? workers_bytes(w, nthreads) : 0;
+	t0 = now_sec();
+	for (s = 0; s < samples || now_sec() - t0 < LOADED_WINDOW; s++) {
+		uint64_t c0, c1;
+
+		c0 = tsc_begin();
+		p = chase_hops(p, LOADED_HOPS);
+		c1 = tsc_end();
+		samples_add(lat, (uint64_t)(cycles_to_sec(tsc_delta(c0, c1)) * 1e12 / LOADED_HOPS));
+	}
+	t1 = now_sec();
+	b1 = nthreads ? workers_bytes(w, nthreads) : 0;
+	if (nthreads)
+		topo_group_stop(&loaded_group);
+	loaded_sink = p;
+
+	pt->mbps = t1 > t0 ? (double)(b1 - b0) / (1024.0 * 1024.0) / (t1 - t0) : 0.0;
+	pt->p50_ns = (double)hist_percentile(&lat->h, 50.0) / 1e3;
+	pt->p90_ns = (double)hist_percentile(&lat->h, 90.0) / 1e3;
+	pt->p99_ns = (double)hist_percentile(&lat->h, 99.0) / 1e3;
+	printf("%s loaded %s %s: %.2f MB/s\n", path, loaded_kind_names[loaded_kind], pt->name, pt->mbps);
+	snprintf(label, sizeof(label), "%.255s loaded %s %s chase", path, loaded_kind_names[loaded_kind], pt->name);
+	samples_report(label, lat, "ns", 1e3);
+	return 0;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+	const struct loaded_point *x = a, *y = b;
+
+	return (x->mbps > y->mbps) - (x->mbps < y->mbps);
+}
+
+void loaded_run(const char *path, const char *traffic_path, void *chase, size_t chase_bytes, void *traffic,
+		size_t traffic_bytes, int samples)
+{
+	struct loaded_point pts[LOADED_MAX_RATES + 2];
+	size_t lines = chase_bytes / LOADED_LINE;
+	size_t traffic_n64 = traffic_bytes / sizeof(uint64_t);
+	double peak = 0.0;
+	struct samples lat;
+	int npts = 0, need_peak = 0;
+	int i;
+
+	if (lines < 2 || traffic_n64 / (size_t)loaded_ncpus < LOADED_LINE / sizeof(uint64_t)) {
+		fprintf(stderr, "%s loaded: chase or traffic region too small\n", path);
+		return;
+	}
+	if (chase_build(chase, lines) != 0) {
+		fprintf(stderr, "%s loaded: out of memory\n", path);
+		return;
+	}
+	printf("%s loaded: chase %zu lines, %s traffic on %s from %d threads\n", path, lines,
+	       loaded_kind_names[loaded_kind], traffic_path, loaded_ncpus);
+	samples_init(&lat, "ps");
+
+	snprintf(pts[npts].name, sizeof(pts[npts].name), "idle");
+	if (loaded_point(path, &pts[npts], &lat, chase, traffic, traffic_n64, 0, 0.0, samples) == 0)
+		npts++;
+
+	for (i = 0; i < loaded_nrates; i++)
+		need_peak |= loaded_rates[i].max || loaded_rates[i].pct > 0.0;
+	/* Percentages are of the unthrottled rate, so that point goes first. */
+	if (need_peak) {
+		snprintf(pts[npts].name, sizeof(pts[npts].name), "max");
+		if (loaded_point(path, &pts[npts], &lat, chase, traffic, traffic_n64, loaded_ncpus, 0.0, samples) != 0)
+			goto out;
+		peak = pts[npts].mbps / loaded_ncpus;
+		npts++;
+	}
+
+	for (i = 0; i < loaded_nrates; i++) {
+		const struct loaded_rate *r = &loaded_rates[i];
+		double mbps;
+
+		if (r->max)
+			continue;
+		if (r->pct > 0.0) {
+			mbps = peak * r->pct / 100.0;
+			snprintf(pts[npts].name, sizeof(pts[npts].name), "%g%%", r->pct);
+		} else {
+			mbps = r->mbps;
+			snprintf(pts[npts].name, sizeof(pts[npts].name), "%gMB/s", r->mbps);
+		}
+		if (mbps <= 0.0)
+			continue;
+		if (loaded_point(path, &pts[npts], &lat, chase, traffic, traffic_n64, loaded_ncpus,
+				 mbps * 1024.0 * 1024.0, samples) != 0)
+			goto out;
+		npts++;
+	}
+
+out:
+	qsort(pts, (size_t)npts, sizeof(pts[0]), point_cmp);
+	printf("\n==== loaded latency: %s, %s traffic on %s, cpus=%s ====\n", path, loaded_kind_names[loaded_kind],
+	       traffic_path, loaded_place_str);
+	printf("%-12s %12s %10s %10s %10s\n", "inject", "MB/s", "p50 ns", "p90 ns", "p99 ns");
+	for (i = 0; i < npts; i++)
+		printf("%-12s %12.2f %10.1f %10.1f %10.1f\n", pts[i].name, pts[i].mbps, pts[i].p50_ns, pts[i].p90_ns,
+		       pts[i].p99_ns);
+	samples_free(&lat);
+}
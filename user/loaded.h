@@ -0,0 +1,43 @@
+#ifndef CACHE_BENCH_LOADED_H
+#define CACHE_BENCH_LOADED_H
+
+#include <stddef.h>
+
+/*
+ * Loaded latency: background threads stream read, write or NT-write traffic
+ * with the bench kernels at a set injection rate while the calling thread
+ * chases pointers through a random cycle of cache lines. Each rate is one
+ * point of a latency-vs-bandwidth curve.
+ *
+ * Spec: kind:cpus[:rates]
+ *   kind   read | write | ntwrite
+ *   cpus   one background thread per CPU: a list (2,3 or 2-5) or a topology
+ *          policy relative to the chasing CPU, e.g. llc/2 (see topo.h)
+ *   rates  per thread: MB/s, N% of the unthrottled rate, or max
+ *          (default 10%,25%,50%,75%,90%,max); an idle point always runs first
+ */
+
+#define LOADED_MAX_THREADS 64
+#define LOADED_MAX_RATES 16
+
+int loaded_parse(const char *spec);
+int loaded_enabled(void);
+/* Fails when the CPUs do not resolve or the traffic kind has no kernel on this CPU. */
+int loaded_init(void);
+void loaded_print(void);
+/*
+ * One curve: at least samples chase samples per point over chase[0..chase_bytes),
+ * traffic split between the threads over traffic[0..traffic_bytes).
+ */
+void loaded_run(const char *path, const char *traffic_path, void *chase, size_t chase_bytes, void *traffic,
+		size_t traffic_bytes, int samples);
+
+/*
+ * Pointer chase shared with other latency probes: chase_build() links the
+ * 64-byte lines of chase[0..lines) into one random cycle that hardware
+ * prefetch cannot follow; chase_hops() follows hops links from p.
+ */
+int chase_build(void *chase, size_t lines);
+void *chase_hops(void *p, size_t hops);
+
+#endif
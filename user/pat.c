@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+#include "hist.h"
+#include "pat.h"
+#include "topo.h"
+
+/* Mirrors kmod/memcache_test.c. */
+struct memcache_attr_req {
+	uint64_t offset;
+	uint64_t length;
+	uint32_t attr;
+	uint32_t runs;
+	uint64_t set_ns;
+	uint64_t zap_ns;
+	uint64_t total_ns;
+};
+
+#define MEMCACHE_IOCTL_SET_ATTR _IOWR('m', 1, struct memcache_attr_req)
+
+/* Attribute values are the memcache types, i.e. the device minors. */
+#define MEMCACHE_ATTR_WB 0
+#define MEMCACHE_ATTR_UC 1
+#define MEMCACHE_ATTR_WC 2
+
+#define PAT_MAX_COUNTS 8
+
+static size_t pat_sizes[PAT_MAX_SIZES];
+static int pat_nsizes;
+static int pat_threads[PAT_MAX_COUNTS];
+static int pat_nthreads;
+static char pat_place[64];
+
+struct pat_helper {
+	volatile uint8_t *p;
+	size_t len;
+};
+
+static struct topo_group pat_group;
+
+static int parse_list(char *s, int sizes)
+{
+	char *save, *tok;
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (sizes) {
+			size_t v = parse_size(tok);
+
+			if (pat_nsizes >= PAT_MAX_SIZES || !v || v % 4096)
+				return -1;
+			pat_sizes[pat_nsizes++] = v;
+		} else {
+			char *end;
+			long v = strtol(tok, &end, 10);
+
+			if (pat_nthreads >= PAT_MAX_COUNTS || end == tok || *end || v < 1 || v > PAT_MAX_THREADS)
+				return -1;
+			pat_threads[pat_nthreads++] = (int)v;
+		}
+	}
+	return 0;
+}
+
+int pat_parse(const char *spec)
+{
+	char buf[256];
+	char *threads, *place = NULL;
+
+	pat_nsizes = 0;
+	pat_nthreads = 0;
+	pat_place[0] = '\0';
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+	threads = strchr(buf, ':');
+	if (threads)
+		*threads++ = '\0';
+	if (threads)
+		place = strchr(threads, ':');
+	if (place) {
+		*place++ = '\0';
+		if (!*place || snprintf(pat_place, sizeof(pat_place), "%s", place) >= (int)sizeof(pat_place))
+			return -1;
+	}
+	if (parse_list(buf, 1) != 0 || !pat_nsizes)
+		return -1;
+	if (threads && parse_list(threads, 0) != 0)
+		return -1;
+	if (!pat_nthreads)
+		pat_threads[pat_nthreads++] = 1;
+	return 0;
+}
+
+int pat_enabled(void)
+{
+	return pat_nsizes > 0;
+}
+
+/* One word per page, so every page of the range stays in this CPU's TLB and refaults after a zap. */
+static void *pat_helper_main(void *arg)
+{
+	struct pat_helper *h = arg;
+	size_t off;
+
+	topo_group_ready(&pat_group);
+	while (!topo_group_stopping(&pat_group)) {
+		for (off = 0; off < h->len; off += 4096)
+			(void)h->p[off];
+	}
+	return NULL;
+}
+
+/* Per direction: kernel total as samples for the report, set/zap phases as histograms. */
+struct pat_dir {
+	struct samples total;
+	struct hist set;
+	struct hist zap;
+	uint32_t runs;
+};
+
+static int pat_switch(const struct bench_target *t, size_t len, uint32_t attr, struct pat_dir *d)
+{
+	struct memcache_attr_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.offset = (uint64_t)t->offset;
+	req.length = len;
+	req.attr = attr;
+	if (ioctl(t->fd, MEMCACHE_IOCTL_SET_ATTR, &req) != 0)
+		return -1;
+	samples_add(&d->total, req.total_ns);
+	hist_record(&d->set, req.set_ns);
+	hist_record(&d->zap, req.zap_ns);
+	d->runs = req.runs;
+	return 0;
+}
+
+void pat_run(const struct bench_target *t, void *map, int iters)
+{
+	static const char *const attr_names[] = { "wb", "uc", "wc" };
+	struct pat_helper helper;
+	int cpus[PAT_MAX_THREADS];
+	int self = sched_getcpu(), ncpus;
+	double p50[PAT_MAX_SIZES][PAT_MAX_COUNTS][2];
+	struct pat_dir dir[2];
+	uint32_t attr;
+	int k, n, iter, d;
+
+	if (!target_is_memcache(t)) {
+		printf("%s pat: not a memcache device\n", t->path);
+		return;
+	}
+	attr = minor(t->st.st_rdev);
+	if (attr != MEMCACHE_ATTR_UC && attr != MEMCACHE_ATTR_WC) {
+		printf("%s pat: only the uc and wc devices can switch attribute\n", t->path);
+		return;
+	}
+
+	if (self < 0)
+		self = 0;
+	ncpus = topo_place_helpers(pat_place, self, cpus, PAT_MAX_THREADS);
+	if (ncpus < 0) {
+		printf("%s pat: no cpus for %s\n", t->path, pat_place);
+		return;
+	}
+
+	memset(p50, 0, sizeof(p50));
+	for (d = 0; d < 2; d++)
+		samples_init(&dir[d].total, "ns");
+
+	for (k = 0; k < pat_nsizes; k++) {
+		size_t len = pat_sizes[k];
+		char szname[24];
+
+		size_name(szname, sizeof(szname), len);
+		if (len > t->size_bytes) {
+			printf("%s pat %s: larger than the target\n", t->path, szname);
+			continue;
+		}
+		for (n = 0; n < pat_nthreads; n++) {
+			int nhelpers = pat_threads[n] - 1;
+			char label[320], place[512];
+			int err = 0;
+
+			if (nhelpers > ncpus) {
+				printf("%s pat %s threads=%d: only %d helper cpus (%s)\n", t->path, szname, pat_threads[n],
+				       ncpus, pat_place[0] ? pat_place : "other online");
+				continue;
+			}
+			helper.p = map;
+			helper.len = len;
+			/* All helpers touch the same range, so they share one argument. */
+			if (nhelpers && topo_group_start(&pat_group, cpus, nhelpers, pat_helper_main, &helper, 0) != 0)
+				continue;
+			for (d = 0; d < 2; d++) {
+				samples_reset(&dir[d].total);
+				hist_reset(&dir[d].set);
+				hist_reset(&dir[d].zap);
+			}
+			for (iter = 0; iter < iters; iter++) {
+				size_t off;
+
+				if (pat_switch(t, len, attr, &dir[0]) != 0 ||
+				    pat_switch(t, len, MEMCACHE_ATTR_WB, &dir[1]) != 0) {
+					err = errno;
+					break;
+				}
+				/* Fault the range back in before the next round. */
+				for (off = 0; off < len; off += 4096)
+					(void)((volatile uint8_t *)map)[off];
+			}
+			topo_group_stop(&pat_group);
+			if (err) {
+				printf("%s pat %s: SET_ATTR failed: %s\n", t->path, szname, strerror(err));
+				/* Leave the range WB whatever happened. */
+				pat_switch(t, len, MEMCACHE_ATTR_WB, &dir[1]);
+				goto out;
+			}
+
+			topo_describe(place, sizeof(place), self, cpus, nhelpers);
+			printf("%s pat %s threads=%d helpers=%s: to_%s set=%.1f zap=%.1f us runs=%u, to_wb set=%.1f zap=%.1f us (p50)\n",
+			       t->path, szname, pat_threads[n], nhelpers ? place : "-", attr_names[attr],
+			       (double)hist_percentile(&dir[0].set, 50.0) / 1e3,
+			       (double)hist_percentile(&dir[0].zap, 50.0) / 1e3, dir[0].runs,
+			       (double)hist_percentile(&dir[1].set, 50.0) / 1e3,
+			       (double)hist_percentile(&dir[1].zap, 50.0) / 1e3);
+			for (d = 0; d < 2; d++) {
+				snprintf(label, sizeof(label), "%.255s pat %s threads=%d to_%s", t->path, szname,
+					 pat_threads[n], d ? "wb" : attr_names[attr]);
+				samples_report(label, &dir[d].total, "us", 1e3);
+				p50[k][n][d] = (double)hist_percentile(&dir[d].total.h, 50.0) / 1e3;
+			}
+		}
+	}
+
+	printf("\n==== pat transition p50 us (to_%s/to_wb): %s, helpers %s ====\n", attr_names[attr], t->path,
+	       pat_place[0] ? pat_place : "other online");
+	printf("%-8s", "size");
+	for (n = 0; n < pat_nthreads; n++) {
+		char col[16];
+
+		snprintf(col, sizeof(col), "%dT", pat_threads[n]);
+		printf(" %17s", col);
+	}
+	printf("\n");
+	for (k = 0; k < pat_nsizes; k++) {
+		char szname[24];
+
+		size_name(szname, sizeof(szname), pat_sizes[k]);
+		printf("%-8s", szname);
+		for (n = 0; n < pat_nthreads; n++)
+			printf(" %8.1f/%8.1f", p50[k][n][0], p50[k][n][1]);
+		printf("\n");
+	}
+out:
+	for (d = 0; d < 2; d++)
+		samples_free(&dir[d].total);
+}
@@ -0,0 +1,26 @@
+#ifndef CACHE_BENCH_PAT_H
+#define CACHE_BENCH_PAT_H
+
+#include "target.h"
+
+/*
+ * Page-attribute transition cost: switch the first N bytes of a memcache UC
+ * or WC region between WB and the region's type with the module's SET_ATTR
+ * ioctl, while helper threads on other CPUs keep touching the range, so the
+ * user PTE zap has TLBs to shoot down.
+ *
+ * Spec: sizes[:threads[:cpus]], e.g. 4k,2m,16m:1,2,4,8:xsocket (threads
+ * default 1). One of the threads is the calling one; helper k runs on the
+ * k-th CPU of cpus, a list or topology policy (see topo.h), or on the k-th
+ * online CPU after the calling thread's without one.
+ */
+
+#define PAT_MAX_SIZES 8
+#define PAT_MAX_THREADS 64
+
+int pat_parse(const char *spec);
+int pat_enabled(void);
+/* iters round trips (to the type and back to WB) per size and thread count. */
+void pat_run(const struct bench_target *t, void *map, int iters);
+
+#endif
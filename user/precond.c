@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "precond.h"
+#include "target.h"
+#include "topo.h"
+
+#define PRECOND_LINE 64
+#define PRECOND_EVICT_DEFAULT (32u << 20)
+
+static const char *const precond_names[PRECOND_NR] = {
+	[PRECOND_NONE] = "none",
+	[PRECOND_COLD] = "cold",
+	[PRECOND_EVICT] = "evict",
+	[PRECOND_CLEAN] = "clean",
+	[PRECOND_DIRTY] = "dirty",
+	[PRECOND_REMOTE] = "remote",
+};
+
+static enum precond_state precond_states[PRECOND_MAX_STATES] = { PRECOND_NONE };
+static int precond_nstates = 1;
+static enum precond_state precond_cur;
+static size_t precond_evict_bytes;
+static char precond_remote_spec[64];
+
+static uint8_t *evict_buf;
+static size_t evict_len;
+static int have_clflushopt;
+
+/* The remote thread dirties [p, p + len) each time gen moves, then acks with done = gen. */
+static struct {
+	struct topo_group group;
+	int cpu;
+	volatile uint8_t *p;
+	size_t len;
+	unsigned int gen;
+	unsigned int done;
+} remote;
+
+int precond_parse(const char *spec)
+{
+	char buf[256];
+	char *save, *tok;
+	int n = 0;
+
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+	precond_evict_bytes = 0;
+	precond_remote_spec[0] = '\0';
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *arg = strchr(tok, ':');
+		int k;
+
+		if (arg)
+			*arg++ = '\0';
+		for (k = 0; k < PRECOND_NR; k++) {
+			if (!strcmp(tok, precond_names[k]))
+				break;
+		}
+		if (k == PRECOND_NR || n >= PRECOND_MAX_STATES)
+			return -1;
+		if (arg && k == PRECOND_EVICT) {
+			precond_evict_bytes = parse_size(arg);
+			if (!precond_evict_bytes)
+				return -1;
+		} else if (arg && k == PRECOND_REMOTE) {
+			if (!*arg || snprintf(precond_remote_spec, sizeof(precond_remote_spec), "%s", arg) >=
+					     (int)sizeof(precond_remote_spec))
+				return -1;
+		} else if (arg) {
+			return -1;
+		}
+		precond_states[n++] = (enum precond_state)k;
+	}
+	if (!n)
+		return -1;
+	precond_nstates = n;
+	return 0;
+}
+
+static int precond_uses(enum precond_state s)
+{
+	int k;
+
+	for (k = 0; k < precond_nstates; k++) {
+		if (precond_states[k] == s)
+			return 1;
+	}
+	return 0;
+}
+
+/* Read and write back one word per line, so every line ends up Modified in this CPU's cache. */
+static void dirty_lines(volatile uint8_t *p, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += PRECOND_LINE)
+		*(volatile uint64_t *)(p + off) = *(volatile uint64_t *)(p + off);
+}
+
+static void read_lines(const volatile uint8_t *p, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += PRECOND_LINE)
+		(void)*(const volatile uint64_t *)(p + off);
+}
+
+static void *remote_main(void *arg)
+{
+	unsigned int seen = 0;
+
+	(void)arg;
+	topo_group_ready(&remote.group);
+	for (;;) {
+		unsigned int gen;
+		int spins = 0;
+
+		while ((gen = __atomic_load_n(&remote.gen, __ATOMIC_ACQUIRE)) == seen &&
+		       !topo_group_stopping(&remote.group)) {
+			if (++spins < 1000)
+				cpu_relax();
+			else
+				sched_yield();
+		}
+		if (topo_group_stopping(&remote.group))
+			break;
+		dirty_lines(remote.p, remote.len);
+		seen = gen;
+		__atomic_store_n(&remote.done, gen, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void remote_stop(void)
+{
+	topo_group_stop(&remote.group);
+}
+
+static int remote_start(void)
+{
+	static const char *const fallback[] = { "llc/1", "xllc/1", "xsocket/1" };
+	int self = sched_getcpu();
+	int cpus[64];
+	size_t k;
+	int n = -1;
+
+	if (self < 0)
+		self = 0;
+	if (precond_remote_spec[0]) {
+		n = topo_place(precond_remote_spec, self, cpus, 64);
+	} else {
+		for (k = 0; k < sizeof(fallback) / sizeof(fallback[0]) && n < 1; k++)
+			n = topo_place(fallback[k], self, cpus, 64);
+	}
+	if (n < 1 || cpus[0] == self) {
+		fprintf(stderr, "precond: no other cpu for the remote state\n");
+		return -1;
+	}
+	memset(&remote, 0, sizeof(remote));
+	remote.cpu = cpus[0];
+	return topo_group_start(&remote.group, &remote.cpu, 1, remote_main, NULL, 0);
+}
+
+int precond_init(void)
+{
+	size_t want;
+	int need_evict;
+
+	remote_stop();
+	free(evict_buf);
+	evict_buf = NULL;
+	evict_len = 0;
+	precond_cur = precond_states[0];
+
+#if defined(__i386__) || defined(__x86_64__)
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		have_clflushopt = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_CLFLUSHOPT);
+	}
+#endif
+
+	need_evict = precond_uses(PRECOND_EVICT);
+#if !defined(__i386__) && !defined(__x86_64__)
+	/* No flush instruction to use: cold and clean evict instead. */
+	need_evict |= precond_uses(PRECOND_COLD) || precond_uses(PRECOND_CLEAN);
+#endif
+	if (need_evict) {
+		want = precond_evict_bytes;
+		if (!want) {
+			long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+			if (llc <= 0)
+				llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+			want = llc > 0 ? 4 * (size_t)llc : PRECOND_EVICT_DEFAULT;
+		}
+		if (posix_memalign((void **)&evict_buf, 4096, want) != 0) {
+			evict_buf = NULL;
+			fprintf(stderr, "precond: no memory for a %zu byte evict buffer\n", want);
+			return -1;
+		}
+		memset(evict_buf, 0, want);
+		evict_len = want;
+	}
+	if (precond_uses(PRECOND_REMOTE) && remote_start() != 0)
+		return -1;
+	return 0;
+}
+
+void precond_print(void)
+{
+	int k;
+
+	if (precond_nstates == 1 && precond_states[0] == PRECOND_NONE)
+		return;
+	printf("precond:");
+	for (k = 0; k < precond_nstates; k++)
+		printf("%s%s", k ? "," : " ", precond_names[precond_states[k]]);
+#if defined(__i386__) || defined(__x86_64__)
+	printf(" flush=%s", have_clflushopt ? "clflushopt" : "clflush");
+#else
+	printf(" flush=evict");
+#endif
+	if (evict_len)
+		printf(" evict=%zuk", evict_len >> 10);
+	if (remote.group.n)
+		printf(" remote=cpu%d(%s)", remote.cpu, topo_rel_name(topo_relation(sched_getcpu(), remote.cpu)));
+	printf("\n");
+}
+
+int precond_count(void)
+{
+	return precond_nstates;
+}
+
+const char *precond_select(int k)
+{
+	precond_cur = precond_states[k];
+	return precond_names[precond_cur];
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("clflushopt")))
+static void flush_opt(volatile uint8_t *p, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += PRECOND_LINE)
+		_mm_clflushopt((void *)(p + off));
+	_mm_sfence();
+}
+
+static void flush_legacy(volatile uint8_t *p, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += PRECOND_LINE)
+		_mm_clflush((const void *)(p + off));
+	_mm_mfence();
+}
+#endif
+
+static void evict(void)
+{
+	read_lines(evict_buf, evict_len);
+}
+
+/* Write back and drop every line of the region from all caches. */
+static void flush(volatile uint8_t *p, size_t len)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	if (have_clflushopt)
+		flush_opt(p, len);
+	else
+		flush_legacy(p, len);
+#else
+	(void)p;
+	(void)len;
+	if (evict_buf)
+		evict();
+#endif
+}
+
+void precond_apply(void *map, size_t len)
+{
+	volatile uint8_t *p = map;
+	unsigned int gen;
+
+	switch (precond_cur) {
+	case PRECOND_NONE:
+	case PRECOND_NR:
+		break;
+	case PRECOND_COLD:
+		flush(p, len);
+		break;
+	case PRECOND_EVICT:
+		evict();
+		break;
+	case PRECOND_CLEAN:
+		flush(p, len);
+		read_lines(p, len);
+		break;
+	case PRECOND_DIRTY:
+		dirty_lines(p, len);
+		break;
+	case PRECOND_REMOTE:
+		remote.p = p;
+		remote.len = len;
+		gen = __atomic_add_fetch(&remote.gen, 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&remote.done, __ATOMIC_ACQUIRE) != gen)
+			sched_yield();
+		break;
+	}
+}
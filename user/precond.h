@@ -0,0 +1,44 @@
+#ifndef CACHE_BENCH_PRECOND_H
+#define CACHE_BENCH_PRECOND_H
+
+#include <stddef.h>
+
+/*
+ * Cache state the region is put in before every timed pass, so hot and cold
+ * numbers are measured on purpose instead of inherited from the test before:
+ *
+ *   none     leave it as the last pass and verify left it
+ *   cold     clflushopt (clflush) every line: nothing cached
+ *   evict    sweep a buffer of 4x the LLC, or evict:<size>
+ *   clean    flush, then read every line: resident, unmodified
+ *   dirty    read and write back every line: resident, Modified here
+ *   remote   same from a thread on another CPU: Modified in its cache;
+ *            remote:<cpus> picks the CPU (list or topo.h policy, default
+ *            llc/1, then xllc/1 and xsocket/1)
+ *
+ * A comma separated list runs the tests once per state.
+ */
+
+enum precond_state {
+	PRECOND_NONE,
+	PRECOND_COLD,
+	PRECOND_EVICT,
+	PRECOND_CLEAN,
+	PRECOND_DIRTY,
+	PRECOND_REMOTE,
+	PRECOND_NR,
+};
+
+#define PRECOND_MAX_STATES 8
+
+int precond_parse(const char *spec);
+/* Allocates the evict buffer and starts the remote thread; -1 after printing why. */
+int precond_init(void);
+void precond_print(void);
+int precond_count(void);
+/* Makes state k of the list current; returns its name. */
+const char *precond_select(int k);
+/* Puts p[0..len) in the current state; a no-op for none. */
+void precond_apply(void *p, size_t len);
+
+#endif
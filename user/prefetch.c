@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "prefetch.h"
+
+static const char *const pf_hint_names[PF_HINT_NR] = {
+	[PF_NONE] = "none",
+	[PF_T0] = "t0",
+	[PF_T2] = "t2",
+	[PF_NTA] = "nta",
+	[PF_W] = "w",
+};
+
+const char *pf_hint_name(enum pf_hint h)
+{
+	return h < PF_HINT_NR ? pf_hint_names[h] : "?";
+}
+
+/* h is a constant in every caller, so this folds to one instruction. */
+static __inline__ __attribute__((always_inline)) void pf(const void *a, enum pf_hint h)
+{
+	switch (h) {
+	case PF_T0:
+		__builtin_prefetch(a, 0, 3);
+		break;
+	case PF_T2:
+		__builtin_prefetch(a, 0, 1);
+		break;
+	case PF_NTA:
+		__builtin_prefetch(a, 0, 0);
+		break;
+	case PF_W:
+		__builtin_prefetch(a, 1, 3);
+		break;
+	default:
+		break;
+	}
+}
+
+static __inline__ __attribute__((always_inline)) uint64_t read_load(const uint64_t *p, size_t n, size_t dist,
+								 enum pf_hint h)
+{
+	const volatile uint64_t *vp = p;
+	const char *ahead = (const char *)p + dist;
+	uint64_t s0 = 0, s1 = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		pf(ahead + i * sizeof(uint64_t), h);
+		s0 += vp[i] + vp[i + 2] + vp[i + 4] + vp[i + 6];
+		s1 += vp[i + 1] + vp[i + 3] + vp[i + 5] + vp[i + 7];
+	}
+	for (; i < n; i++)
+		s0 += vp[i];
+	return s0 + s1;
+}
+
+/* src_h prefetches the source, dst_h (only PF_W) the destination. */
+static __inline__ __attribute__((always_inline)) void copy_u64(uint64_t *dst, const uint64_t *src, size_t n,
+							    size_t dist, enum pf_hint src_h, enum pf_hint dst_h)
+{
+	const volatile uint64_t *vs = src;
+	volatile uint64_t *vd = dst;
+	const char *src_ahead = (const char *)src + dist;
+	const char *dst_ahead = (const char *)dst + dist;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		pf(src_ahead + i * sizeof(uint64_t), src_h);
+		pf(dst_ahead + i * sizeof(uint64_t), dst_h);
+		vd[i] = vs[i];
+		vd[i + 1] = vs[i + 1];
+		vd[i + 2] = vs[i + 2];
+		vd[i + 3] = vs[i + 3];
+		vd[i + 4] = vs[i + 4];
+		vd[i + 5] = vs[i + 5];
+		vd[i + 6] = vs[i + 6];
+		vd[i + 7] = vs[i + 7];
+	}
+	for (; i < n; i++)
+		vd[i] = vs[i];
+}
+
+static uint64_t read_load_none(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_load(p, n, dist, PF_NONE);
+}
+
+static uint64_t read_load_t0(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_load(p, n, dist, PF_T0);
+}
+
+static uint64_t read_load_t2(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_load(p, n, dist, PF_T2);
+}
+
+static uint64_t read_load_nta(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_load(p, n, dist, PF_NTA);
+}
+
+static void copy_none(uint64_t *dst, const uint64_t *src, size_t n, size_t dist)
+{
+	copy_u64(dst, src, n, dist, PF_NONE, PF_NONE);
+}
+
+static void copy_t0(uint64_t *dst, const uint64_t *src, size_t n, size_t dist)
+{
+	copy_u64(dst, src, n, dist, PF_T0, PF_NONE);
+}
+
+static void copy_t2(uint64_t *dst, const uint64_t *src, size_t n, size_t dist)
+{
+	copy_u64(dst, src, n, dist, PF_T2, PF_NONE);
+}
+
+static void copy_nta(uint64_t *dst, const uint64_t *src, size_t n, size_t dist)
+{
+	copy_u64(dst, src, n, dist, PF_NTA, PF_NONE);
+}
+
+/* Without prfchw the compiler would emit prefetcht0 for a write prefetch. */
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("prfchw")))
+#endif
+static void copy_w(uint64_t *dst, const uint64_t *src, size_t n, size_t dist)
+{
+	copy_u64(dst, src, n, dist, PF_NONE, PF_W);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/* A line per step, as four 16-byte streaming loads. */
+__attribute__((target("sse4.1")))
+static __inline__ __attribute__((always_inline)) uint64_t read_ntload(const uint64_t *p, size_t n, size_t dist,
+								   enum pf_hint h)
+{
+	const volatile uint64_t *vp = p;
+	const char *ahead = (const char *)p + dist;
+	__m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+	uint64_t lanes[2];
+	uint64_t s = 0;
+	size_t i = 0;
+
+	for (; i < n && ((uintptr_t)&p[i] & 0xf); i++)
+		s += vp[i];
+	for (; i + 8 <= n; i += 8) {
+		pf(ahead + i * sizeof(uint64_t), h);
+		s0 = _mm_add_epi64(s0, _mm_stream_load_si128((__m128i *)&p[i]));
+		s1 = _mm_add_epi64(s1, _mm_stream_load_si128((__m128i *)&p[i + 2]));
+		s0 = _mm_add_epi64(s0, _mm_stream_load_si128((__m128i *)&p[i + 4]));
+		s1 = _mm_add_epi64(s1, _mm_stream_load_si128((__m128i *)&p[i + 6]));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(s0, s1));
+	s += lanes[0] + lanes[1];
+	for (; i < n; i++)
+		s += vp[i];
+	return s;
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t read_ntload_none(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_ntload(p, n, dist, PF_NONE);
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t read_ntload_t0(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_ntload(p, n, dist, PF_T0);
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t read_ntload_t2(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_ntload(p, n, dist, PF_T2);
+}
+
+__attribute__((target("sse4.1")))
+static uint64_t read_ntload_nta(const uint64_t *p, size_t n, size_t dist)
+{
+	return read_ntload(p, n, dist, PF_NTA);
+}
+
+static int cpu_has_prefetchw(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+		return 0;
+	/* 3DNowPrefetch: PREFETCHW is implemented. */
+	return !!(ecx & (1u << 8));
+}
+#endif
+
+pf_read_fn pf_read_kernel(enum pf_read_kind kind, enum pf_hint h)
+{
+	static const pf_read_fn load[PF_HINT_NR] = {
+		[PF_NONE] = read_load_none,
+		[PF_T0] = read_load_t0,
+		[PF_T2] = read_load_t2,
+		[PF_NTA] = read_load_nta,
+	};
+#if defined(__i386__) || defined(__x86_64__)
+	static const pf_read_fn ntload[PF_HINT_NR] = {
+		[PF_NONE] = read_ntload_none,
+		[PF_T0] = read_ntload_t0,
+		[PF_T2] = read_ntload_t2,
+		[PF_NTA] = read_ntload_nta,
+	};
+#endif
+
+	if (h >= PF_HINT_NR)
+		return NULL;
+	switch (kind) {
+	case PF_READ_LOAD:
+		return load[h];
+	case PF_READ_NTLOAD:
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.1"))
+			return ntload[h];
+#endif
+		return NULL;
+	}
+	return NULL;
+}
+
+pf_copy_fn pf_copy_kernel(enum pf_hint h)
+{
+	switch (h) {
+	case PF_NONE:
+		return copy_none;
+	case PF_T0:
+		return copy_t0;
+	case PF_T2:
+		return copy_t2;
+	case PF_NTA:
+		return copy_nta;
+	case PF_W:
+#if defined(__i386__) || defined(__x86_64__)
+		return cpu_has_prefetchw() ? copy_w : NULL;
+#else
+		return copy_w;
+#endif
+	default:
+		return NULL;
+	}
+}
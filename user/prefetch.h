@@ -0,0 +1,36 @@
+#ifndef CACHE_BENCH_PREFETCH_H
+#define CACHE_BENCH_PREFETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Read and copy kernels with software prefetch dist bytes ahead of the
+ * current line. Each (kernel, hint) pair is its own specialised loop.
+ */
+
+enum pf_hint {
+	PF_NONE,
+	PF_T0,		/* prefetcht0 */
+	PF_T2,		/* prefetcht2 */
+	PF_NTA,		/* prefetchnta */
+	PF_W,		/* prefetchw, on the stream being written */
+	PF_HINT_NR,
+};
+
+enum pf_read_kind {
+	PF_READ_LOAD,	/* 64-bit loads */
+	PF_READ_NTLOAD,	/* movntdqa */
+};
+
+/* Sum of p[0..n). */
+typedef uint64_t (*pf_read_fn)(const uint64_t *p, size_t n, size_t dist);
+/* dst[i] = src[i] for i in [0, n). */
+typedef void (*pf_copy_fn)(uint64_t *dst, const uint64_t *src, size_t n, size_t dist);
+
+const char *pf_hint_name(enum pf_hint h);
+/* NULL when the CPU lacks the instruction or the pair makes no sense. */
+pf_read_fn pf_read_kernel(enum pf_read_kind kind, enum pf_hint h);
+pf_copy_fn pf_copy_kernel(enum pf_hint h);
+
+#endif
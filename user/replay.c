@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "replay.h"
+#include "timing.h"
+
+#define REPLAY_OFF_BITS 48
+#define REPLAY_SIZE_SHIFT 48
+#define REPLAY_OP_SHIFT 60
+/* Decoded ops per timed batch: 64KiB of decode buffer, small next to any LLC. */
+#define REPLAY_BATCH 4096
+
+static const char *const replay_op_names[REPLAY_OP_NR] = {
+	[REPLAY_LOAD] = "load",
+	[REPLAY_STORE] = "store",
+	[REPLAY_NTSTORE] = "ntstore",
+	[REPLAY_FENCE] = "fence",
+};
+
+/* One-letter forms for the text format. */
+static const char replay_op_letters[REPLAY_OP_NR] = { 'l', 's', 'n', 'f' };
+
+struct replay_dec {
+	uint8_t *p;
+	uint32_t size;
+	uint32_t op;
+};
+
+typedef uint64_t u64_unaligned __attribute__((aligned(1), may_alias));
+
+static volatile uint64_t replay_sink;
+
+static inline uint64_t rec_off(uint64_t r)
+{
+	return r & ((1ull << REPLAY_OFF_BITS) - 1);
+}
+
+static inline uint32_t rec_size(uint64_t r)
+{
+	return (uint32_t)(r >> REPLAY_SIZE_SHIFT) & 0xfff;
+}
+
+static inline uint32_t rec_op(uint64_t r)
+{
+	return (uint32_t)(r >> REPLAY_OP_SHIFT);
+}
+
+int replay_open(const char *path, struct replay_trace *tr)
+{
+	struct stat st;
+	char magic[8];
+	size_t i;
+
+	memset(tr, 0, sizeof(*tr));
+	tr->path = path;
+	tr->fd = open(path, O_RDONLY);
+	if (tr->fd < 0) {
+		fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(tr->fd, &st) != 0 || st.st_size < 8 || (st.st_size - 8) % 8 ||
+	    pread(tr->fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || memcmp(magic, REPLAY_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		goto err;
+	}
+	tr->map_len = (size_t)st.st_size;
+	tr->nrecs = (tr->map_len - 8) / 8;
+	if (!tr->nrecs) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		goto err;
+	}
+	/* Populated up front so the replay does not take page faults on the trace. */
+	tr->recs = mmap(NULL, tr->map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, tr->fd, 0);
+	if (tr->recs == MAP_FAILED) {
+		fprintf(stderr, "mmap %s failed: %s\n", path, strerror(errno));
+		tr->recs = NULL;
+		goto err;
+	}
+	tr->recs++;
+	for (i = 0; i < tr->nrecs; i++) {
+		uint64_t r = tr->recs[i];
+		uint32_t op = rec_op(r);
+
+		if (op >= REPLAY_OP_NR || (op != REPLAY_FENCE && !rec_size(r))) {
+			fprintf(stderr, "%s: bad record %zu: 0x%016" PRIx64 "\n", path, i, r);
+			goto err;
+		}
+		tr->ops[op]++;
+		if (op == REPLAY_FENCE)
+			continue;
+		tr->bytes += rec_size(r);
+		if (rec_off(r) + rec_size(r) > tr->span)
+			tr->span = rec_off(r) + rec_size(r);
+	}
+	return 0;
+
+err:
+	replay_close(tr);
+	return -1;
+}
+
+void replay_close(struct replay_trace *tr)
+{
+	if (tr->recs)
+		munmap((void *)(tr->recs - 1), tr->map_len);
+	if (tr->fd >= 0)
+		close(tr->fd);
+	tr->recs = NULL;
+	tr->fd = -1;
+}
+
+void replay_print(const struct replay_trace *tr)
+{
+	int k;
+
+	printf("trace: %s %zu ops (", tr->path, tr->nrecs);
+	for (k = 0; k < REPLAY_OP_NR; k++)
+		printf("%s%s=%" PRIu64, k ? " " : "", replay_op_names[k], tr->ops[k]);
+	printf(") bytes=%" PRIu64 " span=%" PRIu64 "\n", tr->bytes, tr->span);
+}
+
+/* Offsets past the region wrap; an access that would cross its end is moved back to fit. */
+static size_t decode(const uint64_t *recs, size_t n, struct replay_dec *out, uint8_t *base, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint64_t r = recs[i];
+		uint64_t off = rec_off(r) % len;
+		uint32_t size = rec_size(r);
+
+		if (size > len)
+			size = (uint32_t)len;
+		if (off + size > len)
+			off = len - size;
+		out[i].p = base + off;
+		out[i].size = size;
+		out[i].op = rec_op(r);
+	}
+	return n;
+}
+
+static inline uint64_t do_load(const uint8_t *p, uint32_t size)
+{
+	uint64_t v = 0;
+
+	for (; size >= 8; p += 8, size -= 8)
+		v += *(const volatile u64_unaligned *)p;
+	for (; size; p++, size--)
+		v += *(const volatile uint8_t *)p;
+	return v;
+}
+
+static inline void do_store(uint8_t *p, uint32_t size)
+{
+	uint64_t v = (uintptr_t)p;
+
+	for (; size >= 8; p += 8, size -= 8)
+		*(volatile u64_unaligned *)p = v;
+	for (; size; p++, size--)
+		*(volatile uint8_t *)p = (uint8_t)v;
+}
+
+/* movnti for the aligned words, plain stores for the bytes around them. */
+static inline void do_ntstore(uint8_t *p, uint32_t size)
+{
+#if defined(__x86_64__)
+	uint64_t v = (uintptr_t)p;
+
+	for (; size && ((uintptr_t)p & 7); p++, size--)
+		*(volatile uint8_t *)p = (uint8_t)v;
+	for (; size >= 8; p += 8, size -= 8)
+		_mm_stream_si64((long long *)p, (long long)v);
+	do_store(p, size);
+#else
+	do_store(p, size);
+#endif
+}
+
+static inline void do_fence(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	_mm_sfence();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static __attribute__((noinline)) uint64_t run_batch(const struct replay_dec *d, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		switch (d[i].op) {
+		case REPLAY_LOAD:
+			sum += do_load(d[i].p, d[i].size);
+			break;
+		case REPLAY_STORE:
+			do_store(d[i].p, d[i].size);
+			break;
+		case REPLAY_NTSTORE:
+			do_ntstore(d[i].p, d[i].size);
+			break;
+		default:
+			do_fence();
+			break;
+		}
+	}
+	return sum;
+}
+
+double replay_pass(const struct replay_trace *tr, void *map, size_t len)
+{
+	static struct replay_dec batch[REPLAY_BATCH];
+	uint64_t sum = 0;
+	double dt = 0.0;
+	size_t i;
+
+	for (i = 0; i < tr->nrecs; i += REPLAY_BATCH) {
+		size_t n = tr->nrecs - i < REPLAY_BATCH ? tr->nrecs - i : REPLAY_BATCH;
+		double t0, t1;
+
+		decode(tr->recs + i, n, batch, map, len);
+		t0 = now_sec();
+		sum += run_batch(batch, n);
+		t1 = now_sec();
+		dt += t1 - t0;
+	}
+	/* Outstanding NT stores belong to this pass. */
+	if (tr->ops[REPLAY_NTSTORE]) {
+		double t0 = now_sec();
+
+		do_fence();
+		dt += now_sec() - t0;
+	}
+	replay_sink = sum;
+	return dt;
+}
+
+static void convert_usage(void)
+{
+	fprintf(stderr, "Usage: cache_bench trace [-b base|auto] in.txt out.cbt\n");
+	fprintf(stderr, "One access per line: op offset size, op load|store|ntstore|fence (or l/s/n/f),\n"
+			"offset and size decimal or 0x hex, # starts a comment. Offsets are taken\n"
+			"relative to base; auto (default) uses the lowest one, so raw addresses work.\n"
+			"Accesses over %d bytes are split.\n", REPLAY_MAX_SIZE);
+}
+
+/* Parses one text line; 0 ok, 1 blank, -1 bad. */
+static int parse_line(char *line, int *op, uint64_t *off, uint64_t *size)
+{
+	char *tok, *end, *save;
+	int k;
+
+	line[strcspn(line, "#\n")] = '\0';
+	tok = strtok_r(line, " \t,", &save);
+	if (!tok)
+		return 1;
+	for (k = 0; k < REPLAY_OP_NR; k++) {
+		if (!strcasecmp(tok, replay_op_names[k]) ||
+		    (!tok[1] && tolower((unsigned char)tok[0]) == replay_op_letters[k]))
+			break;
+	}
+	if (k == REPLAY_OP_NR)
+		return -1;
+	*op = k;
+	*off = 0;
+	*size = 0;
+	if (k == REPLAY_FENCE)
+		return 0;
+	tok = strtok_r(NULL, " \t,", &save);
+	if (!tok)
+		return -1;
+	*off = strtoull(tok, &end, 0);
+	if (end == tok || *end)
+		return -1;
+	tok = strtok_r(NULL, " \t,", &save);
+	if (!tok)
+		return -1;
+	*size = strtoull(tok, &end, 0);
+	if (end == tok || *end || !*size)
+		return -1;
+	return 0;
+}
+
+int replay_convert_main(int argc, char **argv)
+{
+	uint64_t base = 0, off, size, nout = 0;
+	int auto_base = 1, op, opt, ret = 2;
+	unsigned long lineno;
+	char line[512];
+	FILE *in, *out;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "b:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			auto_base = !strcmp(optarg, "auto");
+			if (!auto_base) {
+				char *end;
+
+				base = strtoull(optarg, &end, 0);
+				if (end == optarg || *end) {
+					convert_usage();
+					return 2;
+				}
+			}
+			break;
+		default:
+			convert_usage();
+			return 2;
+		}
+	}
+	if (argc - optind != 2) {
+		convert_usage();
+		return 2;
+	}
+	in = fopen(argv[optind], "r");
+	if (!in) {
+		fprintf(stderr, "open %s failed: %s\n", argv[optind], strerror(errno));
+		return 2;
+	}
+	out = fopen(argv[optind + 1], "w");
+	if (!out) {
+		fprintf(stderr, "open %s failed: %s\n", argv[optind + 1], strerror(errno));
+		fclose(in);
+		return 2;
+	}
+
+	/* First pass for the lowest offset when the base is automatic. */
+	if (auto_base) {
+		base = UINT64_MAX;
+		for (lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+			int r = parse_line(line, &op, &off, &size);
+
+			if (r < 0) {
+				fprintf(stderr, "%s:%lu: bad line\n", argv[optind], lineno);
+				goto out;
+			}
+			if (!r && op != REPLAY_FENCE && off < base)
+				base = off;
+		}
+		if (base == UINT64_MAX)
+			base = 0;
+		rewind(in);
+	}
+
+	fwrite(REPLAY_MAGIC, 1, 8, out);
+	for (lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+		int r = parse_line(line, &op, &off, &size);
+
+		if (r < 0 || (op != REPLAY_FENCE && off < base)) {
+			fprintf(stderr, "%s:%lu: %s\n", argv[optind], lineno, r < 0 ? "bad line" : "offset below base");
+			goto out;
+		}
+		if (r)
+			continue;
+		if (op != REPLAY_FENCE)
+			off -= base;
+		do {
+			uint64_t chunk = size > REPLAY_MAX_SIZE ? REPLAY_MAX_SIZE : size;
+			uint64_t rec;
+			unsigned char le[8];
+			int b;
+
+			if (off >> REPLAY_OFF_BITS) {
+				fprintf(stderr, "%s:%lu: offset beyond 48 bits; pass -b\n", argv[optind], lineno);
+				goto out;
+			}
+			rec = off | chunk << REPLAY_SIZE_SHIFT | (uint64_t)op << REPLAY_OP_SHIFT;
+			for (b = 0; b < 8; b++)
+				le[b] = (unsigned char)(rec >> (8 * b));
+			if (fwrite(le, 1, 8, out) != 8) {
+				fprintf(stderr, "write %s failed: %s\n", argv[optind + 1], strerror(errno));
+				goto out;
+			}
+			nout++;
+			off += chunk;
+			size -= chunk;
+		} while (size);
+	}
+	printf("%s: %" PRIu64 " records, base 0x%" PRIx64 "\n", argv[optind + 1], nout, base);
+	ret = 0;
+out:
+	fclose(in);
+	if (fclose(out) != 0 && !ret) {
+		fprintf(stderr, "write %s failed: %s\n", argv[optind + 1], strerror(errno));
+		ret = 2;
+	}
+	/* No half-written trace left behind to be replayed by mistake. */
+	if (ret)
+		unlink(argv[optind + 1]);
+	return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef CACHE_BENCH_REPLAY_H
+#define CACHE_BENCH_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace replay: a recorded stream of loads, stores, NT stores and fences is
+ * played against a mapping. The trace file is the 8-byte magic "CBTRACE1"
+ * followed by little-endian 64-bit records:
+ *
+ *   bits  0..47  byte offset into the region (taken modulo its size)
+ *   bits 48..59  access size in bytes, 1..4095 (0 for a fence)
+ *   bits 60..63  op, enum replay_op
+ *
+ * Records are decoded in small batches outside the timed sections, so the
+ * timed part only issues the accesses.
+ */
+
+#define REPLAY_MAGIC "CBTRACE1"
+#define REPLAY_MAX_SIZE 4095
+
+enum replay_op {
+	REPLAY_LOAD,
+	REPLAY_STORE,
+	REPLAY_NTSTORE,
+	REPLAY_FENCE,	/* sfence */
+	REPLAY_OP_NR,
+};
+
+struct replay_trace {
+	const char *path;
+	int fd;
+	const uint64_t *recs;
+	size_t nrecs;
+	size_t map_len;
+	uint64_t ops[REPLAY_OP_NR];
+	/* Bytes loaded or stored by one pass, and the highest offset + size. */
+	uint64_t bytes;
+	uint64_t span;
+};
+
+/* Maps and checks the trace; -1 after printing why. */
+int replay_open(const char *path, struct replay_trace *tr);
+void replay_close(struct replay_trace *tr);
+void replay_print(const struct replay_trace *tr);
+/* One pass over map[0..len); returns the seconds spent in the timed sections. */
+double replay_pass(const struct replay_trace *tr, void *map, size_t len);
+
+/* "cache_bench trace ..." entry point: text to binary trace; returns the exit code. */
+int replay_convert_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "results.h"
+
+#define RESULTS_VERSION "CB1"
+#define RESULTS_FIELDS 13
+#define RESULTS_PARAMS_DIR "/sys/module/memcache_test/parameters"
+
+struct result_rec {
+	char *fields[RESULTS_FIELDS];
+	double mbps;
+	size_t n;
+	uint64_t *v;
+};
+
+enum {
+	RF_VERSION,
+	RF_RUN,
+	RF_TIME,
+	RF_HOST,
+	RF_CPU,
+	RF_KERNEL,
+	RF_PARAMS,
+	RF_TARGET,
+	RF_TEST,
+	RF_MBPS,
+	RF_UNIT,
+	RF_COUNT,
+	RF_SAMPLES,
+};
+
+static FILE *results_file;
+static char run_id[192];
+static char run_host[128];
+static char run_cpu[128];
+static char run_kernel[128];
+static char run_params[512];
+
+/* Tabs and newlines are the record syntax; keep them out of values. */
+static void sanitize(char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\t' || *s == '\n' || *s == '\r')
+			*s = ' ';
+	}
+}
+
+static void read_cpu_model(char *buf, size_t len)
+{
+	char line[256];
+	FILE *f;
+
+	snprintf(buf, len, "unknown");
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		char *c;
+
+		if (strncmp(line, "model name", 10) != 0)
+			continue;
+		c = strchr(line, ':');
+		if (!c)
+			continue;
+		c++;
+		while (*c == ' ')
+			c++;
+		c[strcspn(c, "\n")] = '\0';
+		snprintf(buf, len, "%s", c);
+		break;
+	}
+	fclose(f);
+}
+
+static void read_module_params(char *buf, size_t len)
+{
+	struct dirent **names;
+	size_t off = 0;
+	int n, i;
+
+	buf[0] = '\0';
+	n = scandir(RESULTS_PARAMS_DIR, &names, NULL, alphasort);
+	if (n < 0) {
+		snprintf(buf, len, "none");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		char path[512], val[64];
+		FILE *f;
+
+		if (names[i]->d_name[0] == '.')
+			goto next;
+		snprintf(path, sizeof(path), "%s/%s", RESULTS_PARAMS_DIR, names[i]->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			goto next;
+		if (fgets(val, sizeof(val), f)) {
+			val[strcspn(val, "\n")] = '\0';
+			if (off < len)
+				off += (size_t)snprintf(buf + off, len - off, "%s%s=%s", off ? "," : "",
+							names[i]->d_name, val);
+		}
+		fclose(f);
+next:
+		free(names[i]);
+	}
+	free(names);
+	if (!buf[0])
+		snprintf(buf, len, "none");
+}
+
+int results_open(const char *path)
+{
+	struct utsname u;
+
+	results_file = fopen(path, "a");
+	if (!results_file)
+		return -1;
+
+	if (uname(&u) == 0) {
+		snprintf(run_host, sizeof(run_host), "%s", u.nodename);
+		snprintf(run_kernel, sizeof(run_kernel), "%s", u.release);
+	} else {
+		snprintf(run_host, sizeof(run_host), "unknown");
+		snprintf(run_kernel, sizeof(run_kernel), "unknown");
+	}
+	read_cpu_model(run_cpu, sizeof(run_cpu));
+	read_module_params(run_params, sizeof(run_params));
+	snprintf(run_id, sizeof(run_id), "%s-%lld-%d", run_host, (long long)time(NULL), (int)getpid());
+	sanitize(run_host);
+	sanitize(run_cpu);
+	sanitize(run_kernel);
+	sanitize(run_params);
+	sanitize(run_id);
+
+	printf("results: run=%s store=%s\n", run_id, path);
+	return 0;
+}
+
+int results_enabled(void)
+{
+	return results_file != NULL;
+}
+
+void results_add(const char *target, const char *test, double mbps, const struct samples *s)
+{
+	char tgt[256], tst[64];
+	size_t i;
+
+	if (!results_file)
+		return;
+	snprintf(tgt, sizeof(tgt), "%s", target);
+	snprintf(tst, sizeof(tst), "%s", test);
+	sanitize(tgt);
+	sanitize(tst);
+
+	fprintf(results_file, "%s\t%s\t%lld\t%s\t%s\t%s\t%s\t%s\t%s\t%.3f\t%s\t%zu\t", RESULTS_VERSION,
+		run_id, (long long)time(NULL), run_host, run_cpu, run_kernel, run_params, tgt, tst, mbps,
+		s->unit ? s->unit : "", s->n);
+	for (i = 0; i < s->n; i++)
+		fprintf(results_file, "%s%" PRIu64, i ? "," : "", s->v[i]);
+	fputc('\n', results_file);
+	fflush(results_file);
+}
+
+void results_close(void)
+{
+	if (results_file)
+		fclose(results_file);
+	results_file = NULL;
+}
+
+static int parse_record(char *line, struct result_rec *r)
+{
+	char *save = NULL, *tok, *c;
+	int nf = 0;
+	size_t i;
+
+	line[strcspn(line, "\n")] = '\0';
+	for (tok = strtok_r(line, "\t", &save); tok && nf < RESULTS_FIELDS;
+	     tok = strtok_r(NULL, "\t", &save))
+		r->fields[nf++] = tok;
+	if (nf < RESULTS_FIELDS - 1 || strcmp(r->fields[RF_VERSION], RESULTS_VERSION) != 0)
+		return -1;
+	if (nf == RESULTS_FIELDS - 1)
+		r->fields[RF_SAMPLES] = "";
+
+	r->mbps = strtod(r->fields[RF_MBPS], NULL);
+	r->n = strtoul(r->fields[RF_COUNT], NULL, 10);
+	r->v = calloc(r->n ? r->n : 1, sizeof(r->v[0]));
+	if (!r->v)
+		return -1;
+	c = r->fields[RF_SAMPLES];
+	for (i = 0; i < r->n && *c; i++) {
+		r->v[i] = strtoull(c, &c, 10);
+		if (*c == ',')
+			c++;
+	}
+	r->n = i;
+	for (i = 0; i < RESULTS_FIELDS; i++) {
+		r->fields[i] = strdup(r->fields[i]);
+		if (!r->fields[i]) {
+			while (i-- > 0)
+				free(r->fields[i]);
+			free(r->v);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void free_record(struct result_rec *r)
+{
+	size_t i;
+
+	for (i = 0; i < RESULTS_FIELDS; i++)
+		free(r->fields[i]);
+	free(r->v);
+}
+
+static void free_store(struct result_rec *recs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		free_record(&recs[i]);
+	free(recs);
+}
+
+/* Returns -1 on open or allocation failure; an empty store is 0 with *count == 0. */
+static int load_store(const char *path, struct result_rec **out, size_t *count)
+{
+	struct result_rec *recs = NULL, *grown;
+	size_t n = 0, cap = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (getline(&line, &line_cap, f) > 0) {
+		struct result_rec r;
+
+		memset(&r, 0, sizeof(r));
+		if (parse_record(line, &r) != 0)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			grown = realloc(recs, cap * sizeof(*recs));
+			if (!grown) {
+				fprintf(stderr, "%s: out of memory after %zu records\n", path, n);
+				free_record(&r);
+				ret = -1;
+				break;
+			}
+			recs = grown;
+		}
+		recs[n++] = r;
+	}
+	free(line);
+	fclose(f);
+	if (ret) {
+		free_store(recs, n);
+		return ret;
+	}
+	*out = recs;
+	*count = n;
+	return 0;
+}
+
+struct ranked {
+	double v;
+	int group;
+};
+
+static int cmp_ranked(const void *a, const void *b)
+{
+	double x = ((const struct ranked *)a)->v, y = ((const struct ranked *)b)->v;
+
+	return (x > y) - (x < y);
+}
+
+/* Two-sided Mann-Whitney U test, normal approximation with tie correction. */
+static double mann_whitney_p(const uint64_t *a, size_t na, const uint64_t *b, size_t nb)
+{
+	struct ranked *all;
+	size_t n = na + nb, i, j, k;
+	double r1 = 0.0, ties = 0.0, u, mu, sigma, z;
+
+	if (na < 2 || nb < 2)
+		return 1.0;
+	all = malloc(n * sizeof(*all));
+	if (!all)
+		return 1.0;
+	for (i = 0; i < na; i++)
+		all[i] = (struct ranked){ (double)a[i], 0 };
+	for (i = 0; i < nb; i++)
+		all[na + i] = (struct ranked){ (double)b[i], 1 };
+	qsort(all, n, sizeof(*all), cmp_ranked);
+
+	for (i = 0; i < n; i = j) {
+		double rank, t;
+
+		for (j = i + 1; j < n && all[j].v == all[i].v; j++)
+			;
+		rank = ((double)i + (double)j + 1.0) / 2.0;
+		t = (double)(j - i);
+		ties += t * t * t - t;
+		for (k = i; k < j; k++) {
+			if (all[k].group == 0)
+				r1 += rank;
+		}
+	}
+	free(all);
+
+	u = r1 - (double)na * ((double)na + 1.0) / 2.0;
+	mu = (double)na * (double)nb / 2.0;
+	sigma = sqrt((double)na * (double)nb / 12.0 * (((double)n + 1.0) - ties / ((double)n * ((double)n - 1.0))));
+	if (sigma <= 0.0)
+		return 1.0;
+	z = (u - mu) / sigma;
+	return erfc(fabs(z) / sqrt(2.0));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double median_u64(const uint64_t *v, size_t n)
+{
+	uint64_t *c;
+	double m;
+
+	if (!n)
+		return 0.0;
+	c = malloc(n * sizeof(*c));
+	if (!c)
+		return 0.0;
+	memcpy(c, v, n * sizeof(*c));
+	qsort(c, n, sizeof(*c), cmp_u64);
+	m = (n & 1) ? (double)c[n / 2] : ((double)c[n / 2 - 1] + (double)c[n / 2]) / 2.0;
+	free(c);
+	return m;
+}
+
+static void compare_usage(void)
+{
+	fprintf(stderr, "Usage: cache_bench compare [-b baseline_run] [-r new_run] [-t pct] [-a alpha] store\n");
+	fprintf(stderr, "Default new run is the last one in the store; default baseline is the oldest\n"
+			"run from the same host recorded before it. Exits 1 when a test is slower by\n"
+			"more than pct (default 5) with Mann-Whitney p < alpha (default 0.01).\n");
+}
+
+static const struct result_rec *find_test(const struct result_rec *recs, size_t n, const char *run,
+					 const char *target, const char *test)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(recs[i].fields[RF_RUN], run) && !strcmp(recs[i].fields[RF_TARGET], target) &&
+		    !strcmp(recs[i].fields[RF_TEST], test))
+			return &recs[i];
+	}
+	return NULL;
+}
+
+static void print_run(const char *label, const struct result_rec *r)
+{
+	printf("%s: run=%s host=%s kernel=%s cpu=\"%s\" params=%s\n", label, r->fields[RF_RUN],
+	       r->fields[RF_HOST], r->fields[RF_KERNEL], r->fields[RF_CPU], r->fields[RF_PARAMS]);
+}
+
+int results_compare_main(int argc, char **argv)
+{
+	const char *base_run = NULL, *new_run = NULL;
+	const struct result_rec *nr = NULL, *br = NULL;
+	double threshold = 5.0, alpha = 0.01;
+	struct result_rec *recs;
+	size_t n = 0, i, first;
+	int regressions = 0, compared = 0;
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "b:r:t:a:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			base_run = optarg;
+			break;
+		case 'r':
+			new_run = optarg;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'a':
+			alpha = atof(optarg);
+			break;
+		default:
+			compare_usage();
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		compare_usage();
+		return 2;
+	}
+
+	if (load_store(argv[optind], &recs, &n) != 0)
+		return 2;
+	if (!n) {
+		fprintf(stderr, "%s: no records\n", argv[optind]);
+		free(recs);
+		return 2;
+	}
+
+	for (i = n; i-- > 0;) {
+		if (!new_run || !strcmp(recs[i].fields[RF_RUN], new_run)) {
+			nr = &recs[i];
+			break;
+		}
+	}
+	/* Without -b the baseline must have been recorded before the new run started. */
+	for (first = 0; nr && strcmp(recs[first].fields[RF_RUN], nr->fields[RF_RUN]); first++)
+		;
+	for (i = 0; nr && i < (base_run ? n : first); i++) {
+		if (!strcmp(recs[i].fields[RF_RUN], nr->fields[RF_RUN]))
+			continue;
+		if (base_run ? !strcmp(recs[i].fields[RF_RUN], base_run) :
+			       !strcmp(recs[i].fields[RF_HOST], nr->fields[RF_HOST])) {
+			br = &recs[i];
+			break;
+		}
+	}
+	if (!nr || !br) {
+		fprintf(stderr, "compare: %s run not found\n", nr ? "baseline" : "new");
+		free_store(recs, n);
+		return 2;
+	}
+	print_run("baseline", br);
+	print_run("new     ", nr);
+
+	printf("%-32s %-26s %12s %12s %8s %10s\n", "target", "test", "base MB/s", "new MB/s", "median%",
+	       "p");
+	for (i = 0; i < n; i++) {
+		const struct result_rec *a, *b = &recs[i];
+		double ma, mb, delta, p;
+		const char *verdict = "";
+
+		if (strcmp(b->fields[RF_RUN], nr->fields[RF_RUN]) != 0)
+			continue;
+		a = find_test(recs, n, br->fields[RF_RUN], b->fields[RF_TARGET], b->fields[RF_TEST]);
+		if (!a)
+			continue;
+
+		/* Samples are per-iteration times: a larger median is a slowdown. */
+		ma = median_u64(a->v, a->n);
+		mb = median_u64(b->v, b->n);
+		delta = (ma > 0.0 && mb > 0.0) ? (ma / mb - 1.0) * 100.0 : (b->mbps / a->mbps - 1.0) * 100.0;
+		p = mann_whitney_p(a->v, a->n, b->v, b->n);
+		if (delta < -threshold && p < alpha) {
+			verdict = "REGRESSION";
+			regressions++;
+		} else if (delta > threshold && p < alpha) {
+			verdict = "improved";
+		}
+		compared++;
+		printf("%-32s %-26s %12.2f %12.2f %+8.2f %10.2g %s\n", b->fields[RF_TARGET], b->fields[RF_TEST],
+		       a->mbps, b->mbps, delta, p, verdict);
+	}
+	printf("compared %d tests, %d regressions (threshold %.1f%%, alpha %g)\n", compared, regressions,
+	       threshold, alpha);
+	free_store(recs, n);
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CACHE_BENCH_RESULTS_H
+#define CACHE_BENCH_RESULTS_H
+
+#include "hist.h"
+
+/*
+ * Append-only results store. Each line is one test of one run, tab
+ * separated, keyed by run id, host, CPU model, kernel and module params, and
+ * carries the per-iteration samples so runs can be compared statistically.
+ */
+int results_open(const char *path);
+int results_enabled(void);
+void results_add(const char *target, const char *test, double mbps, const struct samples *s);
+void results_close(void);
+
+/* "cache_bench compare ..." entry point; returns the process exit code. */
+int results_compare_main(int argc, char **argv);
+
+#endif
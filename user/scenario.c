@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scenario.h"
+
+static int set_str(char *dst, size_t len, const char *v)
+{
+	return snprintf(dst, len, "%s", v) < (int)len ? 0 : -1;
+}
+
+static int set_int(int *dst, const char *v)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(v, &end, 0);
+	if (errno || end == v || *end)
+		return -1;
+	*dst = (int)n;
+	return 0;
+}
+
+static int scenario_set(struct scenario *s, const char *key, const char *v)
+{
+	if (!strcmp(key, "name"))
+		return set_str(s->name, sizeof(s->name), v);
+	if (!strcmp(key, "target"))
+		return set_str(s->target, sizeof(s->target), v);
+	/* iters and time replace each other, so a run can override its default. */
+	if (!strcmp(key, "iters")) {
+		s->budget = 0.0;
+		return set_int(&s->iters, v) || s->iters < 1 ? -1 : 0;
+	}
+	if (!strcmp(key, "time")) {
+		char *end;
+
+		s->iters = 0;
+		s->budget = strtod(v, &end);
+		return end == v || *end || s->budget <= 0.0 ? -1 : 0;
+	}
+	if (!strcmp(key, "tests"))
+		return set_str(s->tests, sizeof(s->tests), !strcmp(v, "all") ? "" : v);
+	if (!strcmp(key, "store"))
+		return set_str(s->store, sizeof(s->store), v);
+	if (!strcmp(key, "verify"))
+		return set_str(s->verify, sizeof(s->verify), v);
+	if (!strcmp(key, "prefetch"))
+		return set_str(s->prefetch, sizeof(s->prefetch), v);
+	if (!strcmp(key, "io"))
+		return set_str(s->io, sizeof(s->io), v);
+	if (!strcmp(key, "state"))
+		return set_str(s->state, sizeof(s->state), v);
+	if (!strcmp(key, "cpu"))
+		return set_int(&s->cpu, v) || s->cpu < 0 ? -1 : 0;
+	return -1;
+}
+
+int scenario_load(const char *path, struct scenario **out)
+{
+	struct scenario def, *runs = NULL;
+	char buf[1024];
+	int nruns = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memset(&def, 0, sizeof(def));
+	def.cpu = -1;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		struct scenario cur, *dst;
+		char *save, *tok, *c;
+		int is_run;
+
+		lineno++;
+		if ((c = strchr(buf, '#')))
+			*c = '\0';
+		tok = strtok_r(buf, " \t\r\n", &save);
+		if (!tok)
+			continue;
+		if (!strcmp(tok, "run")) {
+			is_run = 1;
+			cur = def;
+			cur.line = lineno;
+			snprintf(cur.name, sizeof(cur.name), "run%d", nruns + 1);
+			dst = &cur;
+		} else if (!strcmp(tok, "default")) {
+			is_run = 0;
+			dst = &def;
+		} else {
+			fprintf(stderr, "%s:%d: expected run or default, got %s\n", path, lineno, tok);
+			goto err;
+		}
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			char *eq = strchr(tok, '=');
+
+			if (!eq) {
+				fprintf(stderr, "%s:%d: expected key=value, got %s\n", path, lineno, tok);
+				goto err;
+			}
+			*eq = '\0';
+			if (scenario_set(dst, tok, eq + 1) != 0) {
+				fprintf(stderr, "%s:%d: bad %s=%s\n", path, lineno, tok, eq + 1);
+				goto err;
+			}
+		}
+
+		if (!is_run)
+			continue;
+		if (!cur.target[0]) {
+			fprintf(stderr, "%s:%d: run without target\n", path, lineno);
+			goto err;
+		}
+		dst = realloc(runs, (size_t)(nruns + 1) * sizeof(*runs));
+		if (!dst) {
+			fprintf(stderr, "%s: out of memory\n", path);
+			goto err;
+		}
+		runs = dst;
+		runs[nruns++] = cur;
+	}
+	fclose(f);
+
+	if (!nruns) {
+		fprintf(stderr, "%s: no runs\n", path);
+		free(runs);
+		return -1;
+	}
+	*out = runs;
+	return nruns;
+
+err:
+	fclose(f);
+	free(runs);
+	return -1;
+}
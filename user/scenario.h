@@ -0,0 +1,43 @@
+#ifndef CACHE_BENCH_SCENARIO_H
+#define CACHE_BENCH_SCENARIO_H
+
+/*
+ * Scenario file: one run per line as whitespace separated key=value pairs.
+ *
+ *   # comment
+ *   default iters=50 verify=sample
+ *   run name=wb target=/dev/memcache_wb:64m
+ *   run name=uc target=/dev/memcache_uc:8m iters=12 tests=write,read
+ *   run name=wc target=/dev/memcache_wc time=2 tests=ntwrite store=avx2 cpu=2
+ *   run name=cold target=/dev/memcache_wb:64m tests=read state=cold,dirty
+ *
+ * A "default" line sets values for the runs after it. Unset values fall back
+ * to the command line.
+ */
+
+struct scenario {
+	char name[64];
+	/* path[:size[:offset]], as for -d */
+	char target[320];
+	/* 0: time budget or the -i default */
+	int iters;
+	/* Seconds per test; iterations are sized from one timed pass. */
+	double budget;
+	/* Comma separated test names, empty for all. */
+	char tests[256];
+	/* -K, -V, -P and -I values, empty to keep the command line's. */
+	char store[16];
+	char verify[32];
+	char prefetch[16];
+	char io[64];
+	/* -C cache states, empty to keep the command line's. */
+	char state[64];
+	/* -1 to keep the command line's */
+	int cpu;
+	int line;
+};
+
+/* Returns the number of runs, or -1 after printing file:line: error. */
+int scenario_load(const char *path, struct scenario **out);
+
+#endif
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "store.h"
+
+struct store_isa {
+	const char *name;
+	/* __builtin_cpu_supports() feature, NULL when always present. */
+	const char *feature;
+	store_fn nt;
+};
+
+static const char *store_request = "auto";
+static const struct store_isa *store_nt_isa;
+
+static void store_plain_u64(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	volatile uint64_t *vp = p;
+	uint64_t v = store_word(lo, base);
+	size_t i = lo;
+
+	for (; i + 8 <= hi; i += 8, v += 8 * STORE_K_INDEX) {
+		vp[i] = v;
+		vp[i + 1] = v + STORE_K_INDEX;
+		vp[i + 2] = v + 2 * STORE_K_INDEX;
+		vp[i + 3] = v + 3 * STORE_K_INDEX;
+		vp[i + 4] = v + 4 * STORE_K_INDEX;
+		vp[i + 5] = v + 5 * STORE_K_INDEX;
+		vp[i + 6] = v + 6 * STORE_K_INDEX;
+		vp[i + 7] = v + 7 * STORE_K_INDEX;
+	}
+	for (; i < hi; i++, v += STORE_K_INDEX)
+		vp[i] = v;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static __inline__ __attribute__((always_inline)) void movnti_u64(uint64_t *addr, uint64_t v)
+{
+#if defined(__x86_64__)
+	asm volatile("movnti %1, %0" : "=m"(*addr) : "r"(v) : "memory");
+#else
+	asm volatile("movnti %1, %0" : "=m"(((uint32_t *)addr)[0]) : "r"((uint32_t)v) : "memory");
+	asm volatile("movnti %1, %0" : "=m"(((uint32_t *)addr)[1]) : "r"((uint32_t)(v >> 32)) : "memory");
+#endif
+}
+
+/* movnti from lo until p[i] is align-byte aligned; returns that index. */
+static __inline__ __attribute__((always_inline)) size_t nt_head(uint64_t *p, size_t lo, size_t hi, uint64_t base,
+							     size_t align)
+{
+	size_t i = lo;
+
+	for (; i < hi && ((uintptr_t)&p[i] & (align - 1)); i++)
+		movnti_u64(&p[i], store_word(i, base));
+	return i;
+}
+
+static __inline__ __attribute__((always_inline)) void nt_tail(uint64_t *p, size_t i, size_t hi, uint64_t base)
+{
+	for (; i < hi; i++)
+		movnti_u64(&p[i], store_word(i, base));
+}
+
+static void store_nt_movnti(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = nt_head(p, lo, hi, base, 64);
+	uint64_t v = store_word(i, base);
+
+	for (; i + 8 <= hi; i += 8, v += 8 * STORE_K_INDEX) {
+		movnti_u64(&p[i], v);
+		movnti_u64(&p[i + 1], v + STORE_K_INDEX);
+		movnti_u64(&p[i + 2], v + 2 * STORE_K_INDEX);
+		movnti_u64(&p[i + 3], v + 3 * STORE_K_INDEX);
+		movnti_u64(&p[i + 4], v + 4 * STORE_K_INDEX);
+		movnti_u64(&p[i + 5], v + 5 * STORE_K_INDEX);
+		movnti_u64(&p[i + 6], v + 6 * STORE_K_INDEX);
+		movnti_u64(&p[i + 7], v + 7 * STORE_K_INDEX);
+	}
+	nt_tail(p, i, hi, base);
+}
+
+__attribute__((target("sse2")))
+static void store_nt_sse2(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = nt_head(p, lo, hi, base, 64);
+	__m128i e = _mm_set_epi64x((long long)store_word(i + 1, base), (long long)store_word(i, base));
+	__m128i two = _mm_set1_epi64x((long long)(2 * STORE_K_INDEX));
+
+	for (; i + 8 <= hi; i += 8) {
+		__m128i e1 = _mm_add_epi64(e, two);
+		__m128i e2 = _mm_add_epi64(e1, two);
+		__m128i e3 = _mm_add_epi64(e2, two);
+
+		_mm_stream_si128((__m128i *)&p[i], e);
+		_mm_stream_si128((__m128i *)&p[i + 2], e1);
+		_mm_stream_si128((__m128i *)&p[i + 4], e2);
+		_mm_stream_si128((__m128i *)&p[i + 6], e3);
+		e = _mm_add_epi64(e3, two);
+	}
+	nt_tail(p, i, hi, base);
+}
+
+/* AVX has no 256-bit integer add; the halves are built with SSE2 and joined. */
+__attribute__((target("avx")))
+static void store_nt_avx(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = nt_head(p, lo, hi, base, 64);
+	__m128i e = _mm_set_epi64x((long long)store_word(i + 1, base), (long long)store_word(i, base));
+	__m128i two = _mm_set1_epi64x((long long)(2 * STORE_K_INDEX));
+
+	for (; i + 8 <= hi; i += 8) {
+		__m128i e1 = _mm_add_epi64(e, two);
+		__m128i e2 = _mm_add_epi64(e1, two);
+		__m128i e3 = _mm_add_epi64(e2, two);
+
+		_mm256_stream_si256((__m256i *)&p[i], _mm256_insertf128_si256(_mm256_castsi128_si256(e), e1, 1));
+		_mm256_stream_si256((__m256i *)&p[i + 4], _mm256_insertf128_si256(_mm256_castsi128_si256(e2), e3, 1));
+		e = _mm_add_epi64(e3, two);
+	}
+	nt_tail(p, i, hi, base);
+}
+
+__attribute__((target("avx2")))
+static void store_nt_avx2(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = nt_head(p, lo, hi, base, 64);
+	__m256i e = _mm256_set_epi64x((long long)store_word(i + 3, base), (long long)store_word(i + 2, base),
+				      (long long)store_word(i + 1, base), (long long)store_word(i, base));
+	__m256i four = _mm256_set1_epi64x((long long)(4 * STORE_K_INDEX));
+
+	for (; i + 8 <= hi; i += 8) {
+		__m256i e1 = _mm256_add_epi64(e, four);
+
+		_mm256_stream_si256((__m256i *)&p[i], e);
+		_mm256_stream_si256((__m256i *)&p[i + 4], e1);
+		e = _mm256_add_epi64(e1, four);
+	}
+	nt_tail(p, i, hi, base);
+}
+
+/* One full-line store per step. */
+__attribute__((target("avx512f")))
+static void store_nt_avx512(uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = nt_head(p, lo, hi, base, 64);
+	__m512i e = _mm512_set_epi64((long long)store_word(i + 7, base), (long long)store_word(i + 6, base),
+				     (long long)store_word(i + 5, base), (long long)store_word(i + 4, base),
+				     (long long)store_word(i + 3, base), (long long)store_word(i + 2, base),
+				     (long long)store_word(i + 1, base), (long long)store_word(i, base));
+	__m512i eight = _mm512_set1_epi64((long long)(8 * STORE_K_INDEX));
+
+	for (; i + 8 <= hi; i += 8) {
+		_mm512_stream_si512((void *)&p[i], e);
+		e = _mm512_add_epi64(e, eight);
+	}
+	nt_tail(p, i, hi, base);
+}
+
+/* Widest first; auto takes the first one the CPU supports. */
+static const struct store_isa store_isas[] = {
+	{ "avx512", "avx512f", store_nt_avx512 },
+	{ "avx2", "avx2", store_nt_avx2 },
+	{ "avx", "avx", store_nt_avx },
+	{ "sse2", "sse2", store_nt_sse2 },
+	{ "movnti", NULL, store_nt_movnti },
+};
+
+static int store_isa_supported(const struct store_isa *isa)
+{
+	if (!isa->feature)
+		return 1;
+	/* __builtin_cpu_supports() needs a literal. */
+	if (!strcmp(isa->feature, "avx512f"))
+		return __builtin_cpu_supports("avx512f");
+	if (!strcmp(isa->feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(isa->feature, "avx"))
+		return __builtin_cpu_supports("avx");
+	if (!strcmp(isa->feature, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	return 0;
+}
+#endif
+
+int store_parse(const char *s)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	size_t k;
+
+	if (!strcmp(s, "auto")) {
+		store_request = s;
+		return 0;
+	}
+	for (k = 0; k < sizeof(store_isas) / sizeof(store_isas[0]); k++) {
+		if (!strcmp(s, store_isas[k].name)) {
+			store_request = s;
+			return 0;
+		}
+	}
+#else
+	if (!strcmp(s, "auto")) {
+		store_request = s;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+int store_init(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	size_t k;
+	int any = !strcmp(store_request, "auto");
+
+	__builtin_cpu_init();
+	for (k = 0; k < sizeof(store_isas) / sizeof(store_isas[0]); k++) {
+		const struct store_isa *isa = &store_isas[k];
+
+		if (!any && strcmp(store_request, isa->name))
+			continue;
+		if (!store_isa_supported(isa)) {
+			if (!any) {
+				fprintf(stderr, "store kernel %s not supported by this cpu\n", isa->name);
+				return -1;
+			}
+			continue;
+		}
+		store_nt_isa = isa;
+		break;
+	}
+#endif
+	return 0;
+}
+
+void store_print(void)
+{
+	printf("store: plain=st64 nt=%s\n", store_nt_isa ? store_nt_isa->name : "none");
+}
+
+store_fn store_kernel(enum store_kind kind)
+{
+	switch (kind) {
+	case STORE_PLAIN:
+		return store_plain_u64;
+	case STORE_NT:
+		return store_nt_isa ? store_nt_isa->nt : NULL;
+	}
+	return NULL;
+}
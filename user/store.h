@@ -0,0 +1,56 @@
+#ifndef CACHE_BENCH_STORE_H
+#define CACHE_BENCH_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Word i of pass base holds i * STORE_K_INDEX + base * STORE_K_PASS. The
+ * multipliers differ by an odd number, so neither a word of a nearby index
+ * nor one left from a recent pass equals the expected value, as it would
+ * with i + base.
+ */
+#define STORE_K_INDEX 0x9e3779b97f4a7c15ULL
+#define STORE_K_PASS 0xc2b2ae3d27d4eb4eULL
+
+static inline uint64_t store_word(size_t i, uint64_t base)
+{
+	return (uint64_t)i * STORE_K_INDEX + base * STORE_K_PASS;
+}
+
+/*
+ * Fill kernels for the bench write tests: p[i] = store_word(i, base) for i
+ * in [lo, hi).
+ * Each kernel is one loop specialised for its instruction set. The
+ * non-temporal ones unroll over 64-byte aligned lines with a movnti head and
+ * tail, so every body step fills one whole write-combining buffer; the plain
+ * kernel does not align. A test picks its kernel once, so the timed pass
+ * does no per-store dispatch.
+ */
+typedef void (*store_fn)(uint64_t *p, size_t lo, size_t hi, uint64_t base);
+
+enum store_kind {
+	STORE_PLAIN,	/* 64-bit stores through a volatile pointer */
+	STORE_NT,	/* non-temporal stores, widest the CPU has unless -K says otherwise */
+};
+
+/* auto | movnti | sse2 | avx | avx2 | avx512 */
+int store_parse(const char *s);
+/* Fails when the kernel asked for with -K is not supported. */
+int store_init(void);
+void store_print(void);
+/* NULL when the kind has no kernel on this architecture. */
+store_fn store_kernel(enum store_kind kind);
+
+/* Fill p[0..n) except word skip; the range is split, the loops never test it. */
+static inline void store_fill(store_fn fn, uint64_t *p, size_t n, uint64_t base, size_t skip)
+{
+	if (skip >= n) {
+		fn(p, 0, n, base);
+		return;
+	}
+	fn(p, 0, skip, base);
+	fn(p, skip + 1, n, base);
+}
+
+#endif
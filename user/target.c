@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "target.h"
+
+#define MEMCACHE_IOCTL_GET_SIZE 0
+#define MEMCACHE_DRV_NAME "memcache_test"
+
+static int read_sysfs_line(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, (int)len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static const char *path_basename(const char *path)
+{
+	const char *b = strrchr(path, '/');
+
+	return b ? b + 1 : path;
+}
+
+static int memcache_major(void)
+{
+	static int major_cached = -2;
+	char line[128];
+	FILE *f;
+
+	if (major_cached != -2)
+		return major_cached;
+
+	major_cached = -1;
+	f = fopen("/proc/devices", "r");
+	if (!f)
+		return major_cached;
+	while (fgets(line, sizeof(line), f)) {
+		int maj;
+		char name[64];
+
+		if (sscanf(line, "%d %63s", &maj, name) == 2 && strcmp(name, MEMCACHE_DRV_NAME) == 0) {
+			major_cached = maj;
+			break;
+		}
+	}
+	fclose(f);
+	return major_cached;
+}
+
+static int memcache_match(const char *path, const struct stat *st)
+{
+	int maj;
+
+	if (!S_ISCHR(st->st_mode))
+		return 0;
+	maj = memcache_major();
+	if (maj >= 0)
+		return (int)major(st->st_rdev) == maj;
+	return strncmp(path_basename(path), "memcache_", 9) == 0;
+}
+
+static uint64_t memcache_probe_size(struct bench_target *t)
+{
+	uint64_t sz = 0;
+
+	if (ioctl(t->fd, MEMCACHE_IOCTL_GET_SIZE, &sz) != 0)
+		return 0;
+	return sz;
+}
+
+static int devdax_match(const char *path, const struct stat *st)
+{
+	char link[256], dest[256];
+	ssize_t n;
+
+	(void)path;
+	if (!S_ISCHR(st->st_mode))
+		return 0;
+	snprintf(link, sizeof(link), "/sys/dev/char/%u:%u/subsystem", major(st->st_rdev),
+		 minor(st->st_rdev));
+	n = readlink(link, dest, sizeof(dest) - 1);
+	if (n <= 0)
+		return 0;
+	dest[n] = '\0';
+	return strcmp(path_basename(dest), "dax") == 0;
+}
+
+static uint64_t devdax_probe_size(struct bench_target *t)
+{
+	char path[256], buf[64];
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/size", major(t->st.st_rdev),
+		 minor(t->st.st_rdev));
+	if (read_sysfs_line(path, buf, sizeof(buf)) != 0)
+		return 0;
+	return strtoull(buf, NULL, 0);
+}
+
+/* PCI BAR files: /sys/bus/pci/devices/<bdf>/resource<N>[_wc]. */
+static int pci_resource_match(const char *path, const struct stat *st)
+{
+	const char *b = path_basename(path);
+	unsigned int bar;
+	char tail[8] = "";
+
+	if (!S_ISREG(st->st_mode) || !strstr(path, "/sys/"))
+		return 0;
+	if (sscanf(b, "resource%u%7s", &bar, tail) < 1)
+		return 0;
+	return tail[0] == '\0' || strcmp(tail, "_wc") == 0;
+}
+
+static int file_match(const char *path, const struct stat *st)
+{
+	(void)path;
+	return S_ISREG(st->st_mode);
+}
+
+static uint64_t stat_probe_size(struct bench_target *t)
+{
+	return t->st.st_size > 0 ? (uint64_t)t->st.st_size : 0;
+}
+
+static const struct target_type target_types[] = {
+	{ "memcache", "ioctl", memcache_match, memcache_probe_size },
+	{ "devdax", "sysfs", devdax_match, devdax_probe_size },
+	{ "pci_resource", "stat", pci_resource_match, stat_probe_size },
+	{ "file", "stat", file_match, stat_probe_size },
+};
+
+size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v;
+
+	v = strtoull(s, &end, 0);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		return (size_t)v << 10;
+	case 'g':
+	case 'G':
+		return (size_t)v << 30;
+	case 'b':
+	case 'B':
+		return (size_t)v;
+	default:
+		return (size_t)v << 20;
+	}
+}
+
+void size_name(char *buf, size_t len, size_t sz)
+{
+	if (sz && !(sz & ((1u << 20) - 1)))
+		snprintf(buf, len, "%zum", sz >> 20);
+	else if (sz && !(sz & ((1u << 10) - 1)))
+		snprintf(buf, len, "%zuk", sz >> 10);
+	else
+		snprintf(buf, len, "%zub", sz);
+}
+
+static int is_size_token(const char *s)
+{
+	const char *p = s;
+
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (p == s)
+		return *p == '\0';
+	if (*p && strchr("kKmMgGbB", *p))
+		p++;
+	return *p == '\0';
+}
+
+void target_init(struct bench_target *t, const char *path, size_t size_bytes)
+{
+	memset(t, 0, sizeof(*t));
+	snprintf(t->path, sizeof(t->path), "%s", path);
+	t->size_bytes = size_bytes;
+	t->size_from_arg = size_bytes != 0;
+	t->fd = -1;
+}
+
+/*
+ * Paths may contain ':' themselves (PCI addresses), so only trailing tokens
+ * that look like sizes are split off.
+ */
+int target_parse(const char *spec, struct bench_target *t)
+{
+	char buf[sizeof(t->path)];
+	char *tok[2] = { NULL, NULL };
+	int ntok = 0;
+	char *c;
+
+	if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+		return -1;
+
+	while (ntok < 2 && (c = strrchr(buf, ':')) && is_size_token(c + 1)) {
+		*c = '\0';
+		tok[ntok++] = c + 1;
+	}
+	if (!buf[0])
+		return -1;
+
+	target_init(t, buf, 0);
+	if (ntok == 2) {
+		if (tok[1][0])
+			t->size_bytes = parse_size(tok[1]);
+		t->offset = (off_t)parse_size(tok[0]);
+	} else if (ntok == 1 && tok[0][0]) {
+		t->size_bytes = parse_size(tok[0]);
+	}
+	t->size_from_arg = t->size_bytes != 0;
+	return 0;
+}
+
+int target_open(struct bench_target *t)
+{
+	uint64_t avail;
+	size_t i;
+
+	t->fd = open(t->path, O_RDWR);
+	if (t->fd < 0) {
+		fprintf(stderr, "open %s failed: %s\n", t->path, strerror(errno));
+		return -1;
+	}
+	if (fstat(t->fd, &t->st) != 0) {
+		fprintf(stderr, "stat %s failed: %s\n", t->path, strerror(errno));
+		goto err;
+	}
+
+	t->type = NULL;
+	for (i = 0; i < sizeof(target_types) / sizeof(target_types[0]); i++) {
+		if (target_types[i].match(t->path, &t->st)) {
+			t->type = &target_types[i];
+			break;
+		}
+	}
+	if (!t->type) {
+		fprintf(stderr, "%s: unsupported target type\n", t->path);
+		goto err;
+	}
+
+	avail = t->type->probe_size(t);
+	if (avail && (uint64_t)t->offset >= avail) {
+		fprintf(stderr, "%s offset %lld beyond size %llu\n", t->path, (long long)t->offset,
+			(unsigned long long)avail);
+		goto err;
+	}
+	if (!t->size_bytes) {
+		if (!avail) {
+			fprintf(stderr, "%s %s size failed\n", t->path, t->type->size_source);
+			goto err;
+		}
+		t->size_bytes = (size_t)(avail - (uint64_t)t->offset);
+	} else if (avail && (uint64_t)t->offset + t->size_bytes > avail) {
+		fprintf(stderr, "%s size %zu + offset %lld exceeds %llu\n", t->path, t->size_bytes,
+			(long long)t->offset, (unsigned long long)avail);
+		goto err;
+	}
+	return 0;
+
+err:
+	close(t->fd);
+	t->fd = -1;
+	return -1;
+}
+
+void target_close(struct bench_target *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+int target_same_backing(const struct bench_target *a, const struct bench_target *b)
+{
+	if (a->fd < 0 || b->fd < 0)
+		return 0;
+	if (S_ISCHR(a->st.st_mode))
+		return S_ISCHR(b->st.st_mode) && a->st.st_rdev == b->st.st_rdev;
+	return a->st.st_dev == b->st.st_dev && a->st.st_ino == b->st.st_ino;
+}
+
+int target_is_memcache(const struct bench_target *t)
+{
+	return t->type && strcmp(t->type->name, "memcache") == 0;
+}
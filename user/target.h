@@ -0,0 +1,50 @@
+#ifndef CACHE_BENCH_TARGET_H
+#define CACHE_BENCH_TARGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MEMCACHE_DEV_WB "/dev/memcache_wb"
+#define MEMCACHE_DEV_UC "/dev/memcache_uc"
+#define MEMCACHE_DEV_WC "/dev/memcache_wc"
+
+struct bench_target;
+
+/*
+ * A kind of mmap-able object cache_bench can run against. Types are tried in
+ * registration order; the first whose match() accepts the path wins.
+ */
+struct target_type {
+	const char *name;
+	/* Where probe_size() gets the size from, for the report. */
+	const char *size_source;
+	int (*match)(const char *path, const struct stat *st);
+	/* Usable size in bytes from offset 0, or 0 when unknown. */
+	uint64_t (*probe_size)(struct bench_target *t);
+};
+
+struct bench_target {
+	char path[256];
+	const struct target_type *type;
+	size_t size_bytes;
+	off_t offset;
+	int size_from_arg;
+	int fd;
+	struct stat st;
+};
+
+/* path[:size[:offset]]; size/offset take k/m/g suffixes, a bare number is MiB. */
+int target_parse(const char *spec, struct bench_target *t);
+void target_init(struct bench_target *t, const char *path, size_t size_bytes);
+int target_open(struct bench_target *t);
+void target_close(struct bench_target *t);
+/* Nonzero if both targets map the same backing object. */
+int target_same_backing(const struct bench_target *a, const struct bench_target *b);
+int target_is_memcache(const struct bench_target *t);
+size_t parse_size(const char *s);
+/* Inverse of parse_size for a report: 2m, 64k or 100b. */
+void size_name(char *buf, size_t len, size_t sz);
+
+#endif
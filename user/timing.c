@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "timing.h"
+
+#define TIMING_CALIBRATE_NS 20000000L
+#define TIMING_OVERHEAD_SAMPLES 1000
+
+static double timing_freq;
+static uint64_t timing_cost;
+static const char *timing_source = "clock_gettime";
+static int timing_invariant;
+static int timing_use_tsc;
+static int timing_inited;
+int timing_have_rdtscp;
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static double tsc_hz_cpuid15(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 0x15)
+		return 0.0;
+	__cpuid_count(0x15, 0, eax, ebx, ecx, edx);
+	/* ecx is the crystal clock; many parts leave it 0 and need 0x16 or the kernel. */
+	if (!eax || !ebx || !ecx)
+		return 0.0;
+	return (double)ecx * (double)ebx / (double)eax;
+}
+
+static double tsc_hz_cpuid16(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 0x16)
+		return 0.0;
+	__cpuid_count(0x16, 0, eax, ebx, ecx, edx);
+	/* Base frequency in MHz, which is the TSC rate on parts that report it. */
+	return (eax & 0xffff) ? (double)(eax & 0xffff) * 1e6 : 0.0;
+}
+
+/* Exported by some kernels; the kernel's refined calibration is the best value. */
+static double tsc_hz_kernel(void)
+{
+	unsigned long long khz = 0;
+	FILE *f;
+
+	f = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+	if (!f)
+		return 0.0;
+	if (fscanf(f, "%llu", &khz) != 1)
+		khz = 0;
+	fclose(f);
+	return (double)khz * 1e3;
+}
+
+static double tsc_hz_calibrate(void)
+{
+	struct timespec req = { 0, TIMING_CALIBRATE_NS };
+	uint64_t a, b, ta, tb;
+
+	a = mono_ns();
+	ta = tsc_begin();
+	nanosleep(&req, NULL);
+	tb = tsc_end();
+	b = mono_ns();
+
+	if (b <= a || tb <= ta)
+		return 0.0;
+	return (double)(tb - ta) * 1e9 / (double)(b - a);
+}
+
+static void tsc_features(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+		return;
+	__cpuid(0x80000001, eax, ebx, ecx, edx);
+	timing_have_rdtscp = !!(edx & (1u << 27));
+	__cpuid(0x80000007, eax, ebx, ecx, edx);
+	timing_invariant = !!(edx & (1u << 8));
+}
+#else
+uint64_t tsc_begin(void)
+{
+	return mono_ns();
+}
+
+uint64_t tsc_end(void)
+{
+	return mono_ns();
+}
+#endif
+
+static uint64_t measure_overhead(void)
+{
+	uint64_t best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < TIMING_OVERHEAD_SAMPLES; i++) {
+		uint64_t t0 = tsc_begin();
+		uint64_t t1 = tsc_end();
+
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return best == UINT64_MAX ? 0 : best;
+}
+
+void timing_init(void)
+{
+	if (timing_inited)
+		return;
+	timing_inited = 1;
+
+#if defined(__i386__) || defined(__x86_64__)
+	tsc_features();
+	if ((timing_freq = tsc_hz_cpuid15()) > 0.0)
+		timing_source = "cpuid15";
+	else if ((timing_freq = tsc_hz_kernel()) > 0.0)
+		timing_source = "kernel";
+	else if ((timing_freq = tsc_hz_cpuid16()) > 0.0)
+		timing_source = "cpuid16";
+	else if ((timing_freq = tsc_hz_calibrate()) > 0.0)
+		timing_source = "calibrated";
+	else
+		timing_freq = 0.0;
+	/* A TSC that stops or changes rate is no wall clock; now_sec() uses clock_gettime then. */
+	timing_use_tsc = timing_invariant && timing_freq > 0.0;
+#endif
+
+	timing_cost = measure_overhead();
+}
+
+void timing_print(void)
+{
+	timing_init();
+	printf("timer: %.3f MHz source=%s invariant=%d rdtscp=%d overhead=%llu cycles\n",
+	       timing_hz() / 1e6, timing_source, timing_invariant, timing_have_rdtscp,
+	       (unsigned long long)timing_cost);
+}
+
+double timing_hz(void)
+{
+	timing_init();
+	return timing_freq > 0.0 ? timing_freq : 1e9;
+}
+
+uint64_t timing_overhead(void)
+{
+	timing_init();
+	return timing_cost;
+}
+
+uint64_t tsc_delta(uint64_t t0, uint64_t t1)
+{
+	uint64_t d = t1 - t0;
+
+	return d > timing_cost ? d - timing_cost : 0;
+}
+
+double cycles_to_sec(uint64_t cycles)
+{
+	return (double)cycles / timing_hz();
+}
+
+double now_sec(void)
+{
+	timing_init();
+#if defined(__i386__) || defined(__x86_64__)
+	if (timing_use_tsc)
+		return (double)tsc_begin() / timing_freq;
+#endif
+	return (double)mono_ns() / 1e9;
+}
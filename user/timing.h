@@ -0,0 +1,51 @@
+#ifndef CACHE_BENCH_TIMING_H
+#define CACHE_BENCH_TIMING_H
+
+#include <stdint.h>
+
+/*
+ * Cycle timer shared by cache_bench.c and aa.c. Bracket a measured region with
+ * tsc_begin()/tsc_end() and turn the pair into cycles with tsc_delta(), which
+ * removes the cost of the timer itself measured by timing_init().
+ */
+
+#if defined(__i386__) || defined(__x86_64__)
+static __inline__ __attribute__((always_inline)) uint64_t tsc_begin(void)
+{
+	unsigned int lo, hi;
+
+	/* lfence: earlier instructions finish before the counter is read. */
+	asm volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+extern int timing_have_rdtscp;
+
+static __inline__ __attribute__((always_inline)) uint64_t tsc_end(void)
+{
+	unsigned int lo, hi;
+
+	/* rdtscp waits for the measured code; lfence keeps later code out of the window. */
+	if (timing_have_rdtscp)
+		asm volatile("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi) :: "rcx", "memory");
+	else
+		asm volatile("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+#else
+uint64_t tsc_begin(void);
+uint64_t tsc_end(void);
+#endif
+
+void timing_init(void);
+void timing_print(void);
+/* Counter frequency in Hz (1e9 when falling back to clock_gettime). */
+double timing_hz(void);
+/* Cycles of an empty tsc_begin()/tsc_end() pair. */
+uint64_t timing_overhead(void);
+/* t1 - t0 minus the timer overhead, clamped at 0. */
+uint64_t tsc_delta(uint64_t t0, uint64_t t1);
+double cycles_to_sec(uint64_t cycles);
+double now_sec(void);
+
+#endif
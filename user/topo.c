@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topo.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define TOPO_MAX_CPUS 1024
+
+struct topo_cpu {
+	int online;
+	/* Lowest CPU of the core, of the CPUs sharing the L2 and of those sharing the LLC. */
+	int core;
+	int l2;
+	int llc;
+	int llc_level;
+	int pkg;
+	int node;
+};
+
+static struct topo_cpu topo[TOPO_MAX_CPUS];
+static int topo_ncpus;
+
+static const char *const topo_rel_names[TOPO_REL_NR] = {
+	[TOPO_SAME] = "same",
+	[TOPO_SMT] = "smt",
+	[TOPO_LLC] = "llc",
+	[TOPO_XLLC] = "xllc",
+	[TOPO_XSOCKET] = "xsocket",
+};
+
+int sysfs_read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, (int)len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int read_int(const char *path, int def)
+{
+	char buf[32];
+
+	return sysfs_read_line(path, buf, sizeof(buf)) == 0 ? atoi(buf) : def;
+}
+
+/*
+ * Appends the CPUs of a list like "0-3,8,10-11" to cpus in order; returns
+ * the new count, or -1 when it is malformed or longer than max.
+ */
+static int cpulist_parse(const char *s, int *cpus, int n, int max)
+{
+	const char *p = s;
+
+	while (*p) {
+		char *end;
+		long lo, hi;
+
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			return -1;
+		hi = lo;
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo)
+				return -1;
+		}
+		for (; lo <= hi; lo++) {
+			if (n >= max)
+				return -1;
+			cpus[n++] = (int)lo;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		p = end;
+	}
+	return n;
+}
+
+static int cpulist_first(const char *path)
+{
+	char buf[4096];
+	int cpus[1];
+
+	if (sysfs_read_line(path, buf, sizeof(buf)) != 0)
+		return -1;
+	/* Only the first entry is wanted; a longer list is not an error here. */
+	buf[strcspn(buf, ",-")] = '\0';
+	return cpulist_parse(buf, cpus, 0, 1) == 1 ? cpus[0] : -1;
+}
+
+static int cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *d;
+	int node = -1;
+
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+	d = opendir(path);
+	if (!d)
+		return -1;
+	while ((de = readdir(d))) {
+		if (!strncmp(de->d_name, "node", 4) && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+			node = atoi(de->d_name + 4);
+			break;
+		}
+	}
+	closedir(d);
+	return node;
+}
+
+static void topo_read_cpu(int cpu)
+{
+	struct topo_cpu *c = &topo[cpu];
+	char path[128], type[32];
+	int idx;
+
+	c->online = 1;
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+	c->core = cpulist_first(path);
+	if (c->core < 0)
+		c->core = cpu;
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+	c->pkg = read_int(path, 0);
+	c->node = cpu_node(cpu);
+
+	c->l2 = -1;
+	c->llc = -1;
+	c->llc_level = 0;
+	for (idx = 0;; idx++) {
+		int level, first;
+
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, idx);
+		level = read_int(path, -1);
+		if (level < 0)
+			break;
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/type", cpu, idx);
+		if (sysfs_read_line(path, type, sizeof(type)) == 0 && !strcmp(type, "Instruction"))
+			continue;
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+		first = cpulist_first(path);
+		if (first < 0)
+			continue;
+		if (level == 2)
+			c->l2 = first;
+		if (level >= c->llc_level) {
+			c->llc_level = level;
+			c->llc = first;
+		}
+	}
+	/* No cache info (some VMs): treat the package as one LLC. */
+	if (c->llc < 0)
+		c->llc = TOPO_MAX_CPUS + c->pkg;
+}
+
+void topo_init(void)
+{
+	char buf[4096];
+	int *cpus;
+	int n, i;
+
+	memset(topo, 0, sizeof(topo));
+	topo_ncpus = 0;
+	cpus = malloc(TOPO_MAX_CPUS * sizeof(*cpus));
+	if (!cpus)
+		return;
+	if (sysfs_read_line(SYSFS_CPU "/online", buf, sizeof(buf)) != 0)
+		snprintf(buf, sizeof(buf), "0");
+	n = cpulist_parse(buf, cpus, 0, TOPO_MAX_CPUS);
+	for (i = 0; i < n; i++) {
+		topo_read_cpu(cpus[i]);
+		if (cpus[i] + 1 > topo_ncpus)
+			topo_ncpus = cpus[i] + 1;
+	}
+	free(cpus);
+}
+
+static int count_distinct(int which)
+{
+	int seen[TOPO_MAX_CPUS * 2];
+	int nseen = 0, cpu, k;
+
+	for (cpu = 0; cpu < topo_ncpus; cpu++) {
+		const struct topo_cpu *c = &topo[cpu];
+		int v = which == 0 ? c->core : which == 1 ? c->l2 : which == 2 ? c->llc : which == 3 ? c->pkg : c->node;
+
+		if (!c->online)
+			continue;
+		for (k = 0; k < nseen && seen[k] != v; k++)
+			;
+		if (k == nseen)
+			seen[nseen++] = v;
+	}
+	return nseen;
+}
+
+void topo_print(void)
+{
+	int cpu, online = 0, level = 0;
+
+	for (cpu = 0; cpu < topo_ncpus; cpu++) {
+		if (topo[cpu].online) {
+			online++;
+			if (topo[cpu].llc_level > level)
+				level = topo[cpu].llc_level;
+		}
+	}
+	printf("topology: cpus=%d cores=%d l2s=%d llcs=%d", online, count_distinct(0), count_distinct(1),
+	       count_distinct(2));
+	if (level)
+		printf(" (L%d)", level);
+	printf(" packages=%d nodes=%d\n", count_distinct(3), count_distinct(4));
+}
+
+const char *topo_rel_name(enum topo_rel rel)
+{
+	return rel < TOPO_REL_NR ? topo_rel_names[rel] : "?";
+}
+
+enum topo_rel topo_relation(int a, int b)
+{
+	const struct topo_cpu *x, *y;
+
+	if (a == b)
+		return TOPO_SAME;
+	if (a < 0 || b < 0 || a >= topo_ncpus || b >= topo_ncpus || !topo[a].online || !topo[b].online)
+		return TOPO_XSOCKET;
+	x = &topo[a];
+	y = &topo[b];
+	if (x->core == y->core)
+		return TOPO_SMT;
+	if (x->llc == y->llc)
+		return TOPO_LLC;
+	if (x->pkg == y->pkg)
+		return TOPO_XLLC;
+	return TOPO_XSOCKET;
+}
+
+int topo_place(const char *spec, int base, int *cpus, int max)
+{
+	char name[32];
+	const char *slash;
+	int want = max, n = 0, pass, cpu, rel;
+
+	if (spec[0] >= '0' && spec[0] <= '9') {
+		n = cpulist_parse(spec, cpus, 0, max);
+		return n > 0 ? n : -1;
+	}
+
+	slash = strchr(spec, '/');
+	snprintf(name, sizeof(name), "%.*s", (int)(slash ? slash - spec : (long)strlen(spec)), spec);
+	if (slash) {
+		char *end;
+
+		want = (int)strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end || want < 1)
+			return -1;
+		if (want > max)
+			want = max;
+	}
+	for (rel = TOPO_SMT; rel < TOPO_REL_NR; rel++) {
+		if (!strcmp(name, topo_rel_names[rel]))
+			break;
+	}
+	if (rel == TOPO_REL_NR)
+		return -1;
+
+	/* First threads of cores first, so llc/xllc/xsocket spread over cores before siblings. */
+	for (pass = 0; pass < 2; pass++) {
+		for (cpu = 0; cpu < topo_ncpus && n < want; cpu++) {
+			if (!topo[cpu].online || (topo[cpu].core == cpu) != !pass)
+				continue;
+			if ((int)topo_relation(base, cpu) == rel)
+				cpus[n++] = cpu;
+		}
+	}
+	return n ? n : -1;
+}
+
+int topo_place_helpers(const char *spec, int base, int *cpus, int max)
+{
+	int n = 0, i, k, cpu;
+
+	if (spec && spec[0]) {
+		k = topo_place(spec, base, cpus, max);
+		if (k < 0)
+			return -1;
+		for (i = 0; i < k; i++) {
+			if (cpus[i] != base)
+				cpus[n++] = cpus[i];
+		}
+		return n;
+	}
+	for (i = 1; i < topo_ncpus && n < max; i++) {
+		cpu = (base + i) % topo_ncpus;
+		if (topo[cpu].online && cpu != base)
+			cpus[n++] = cpu;
+	}
+	return n;
+}
+
+void topo_describe(char *buf, size_t len, int base, const int *cpus, int n)
+{
+	size_t off = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < n && off < len; i++)
+		off += (size_t)snprintf(buf + off, len - off, "%s%d(%s)", i ? "," : "", cpus[i],
+					topo_rel_name(topo_relation(base, cpus[i])));
+}
+
+int topo_group_start(struct topo_group *g, const int *cpus, int n, void *(*fn)(void *), void *args,
+		     size_t stride)
+{
+	int i, err;
+
+	if (n > TOPO_GROUP_MAX)
+		return -1;
+	g->n = 0;
+	__atomic_store_n(&g->stop, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&g->ready, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < n; i++) {
+		pthread_attr_t attr;
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpus[i], &set);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		err = pthread_create(&g->tid[i], &attr, fn, (char *)args + (size_t)i * stride);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			fprintf(stderr, "thread on cpu %d failed: %s\n", cpus[i], strerror(err));
+			topo_group_stop(g);
+			return -1;
+		}
+		g->n = i + 1;
+	}
+	while (__atomic_load_n(&g->ready, __ATOMIC_ACQUIRE) < n)
+		sched_yield();
+	return 0;
+}
+
+void topo_group_stop(struct topo_group *g)
+{
+	int i;
+
+	__atomic_store_n(&g->stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < g->n; i++)
+		pthread_join(g->tid[i], NULL);
+	g->n = 0;
+}
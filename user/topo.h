@@ -0,0 +1,89 @@
+#ifndef CACHE_BENCH_TOPO_H
+#define CACHE_BENCH_TOPO_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * CPU topology from /sys/devices/system/cpu: SMT core, shared L2 and LLC,
+ * package and NUMA node of every online CPU. Multi-CPU tests pick their
+ * CPUs by relationship to the CPU the calling thread runs on:
+ *
+ *   smt      another hardware thread of the same core
+ *   llc      another core sharing the last-level cache
+ *   xllc     same package, different last-level cache
+ *   xsocket  different package
+ *
+ * A placement spec is either a CPU list (2,3 or 2-5) or policy[/N], which
+ * takes at most N CPUs of that relationship (all of them without /N), one
+ * thread per core first.
+ */
+
+enum topo_rel {
+	TOPO_SAME,
+	TOPO_SMT,
+	TOPO_LLC,
+	TOPO_XLLC,
+	TOPO_XSOCKET,
+	TOPO_REL_NR,
+};
+
+void topo_init(void);
+void topo_print(void);
+const char *topo_rel_name(enum topo_rel rel);
+/* Relationship of cpu b as seen from cpu a. */
+enum topo_rel topo_relation(int a, int b);
+/*
+ * Resolve spec against base into at most max CPUs; returns the count, or -1
+ * for a bad spec or a policy nothing on this machine matches.
+ */
+int topo_place(const char *spec, int base, int *cpus, int max);
+/*
+ * CPUs for helper threads of a test running on base: spec as for topo_place,
+ * or without one every other online CPU, those after base first. base is
+ * never returned. Returns the count, 0 when there is no other CPU, or -1
+ * for a bad spec.
+ */
+int topo_place_helpers(const char *spec, int base, int *cpus, int max);
+/* Writes "cpu(rel),..." for cpus seen from base. */
+void topo_describe(char *buf, size_t len, int base, const int *cpus, int n);
+
+/* First line of a sysfs or procfs file without the newline; -1 if unreadable. */
+int sysfs_read_line(const char *path, char *buf, size_t len);
+
+#define TOPO_GROUP_MAX 64
+
+/*
+ * Threads pinned one per CPU. Thread i runs fn(args + i * stride), calls
+ * topo_group_ready() once set up and returns when topo_group_stopping().
+ */
+struct topo_group {
+	pthread_t tid[TOPO_GROUP_MAX];
+	int n;
+	int ready;
+	int stop;
+};
+
+/* Returns once all n are ready, or -1 with none left running if one failed to start. */
+int topo_group_start(struct topo_group *g, const int *cpus, int n, void *(*fn)(void *), void *args,
+		     size_t stride);
+void topo_group_stop(struct topo_group *g);
+
+static inline void topo_group_ready(struct topo_group *g)
+{
+	__atomic_fetch_add(&g->ready, 1, __ATOMIC_RELEASE);
+}
+
+static inline int topo_group_stopping(const struct topo_group *g)
+{
+	return __atomic_load_n(&g->stop, __ATOMIC_RELAXED);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+#endif
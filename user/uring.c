@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = sys_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	/* One mapping for both rings since 5.4. */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+			  IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err;
+	if (u->cq_ring_sz) {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err;
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+	return 0;
+
+err:
+	err = errno;
+	uring_exit(u);
+	errno = err;
+	return -1;
+}
+
+void uring_exit(struct uring *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring_sz && u->cq_ring && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_sz);
+	if (u->fd >= 0)
+		close(u->fd);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+int uring_batch(struct uring *u, int write, int fd, void *const *bufs, const off_t *offs, size_t len, unsigned int n)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int mask = *u->sq_mask;
+	unsigned int k, submitted = 0, reaped = 0;
+	int ret = 0;
+
+	if (n > u->entries)
+		return -EINVAL;
+	for (k = 0; k < n; k++) {
+		unsigned int idx = (tail + k) & mask;
+		struct io_uring_sqe *sqe = &u->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)bufs[k];
+		sqe->len = (uint32_t)len;
+		sqe->off = (uint64_t)offs[k];
+		sqe->user_data = k;
+		u->sq_array[idx] = idx;
+	}
+	/* The kernel reads the entries once it sees the new tail. */
+	__atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	while (reaped < n) {
+		unsigned int head = *u->cq_head;
+		unsigned int ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == ctail) {
+			int r = sys_uring_enter(u->fd, n - submitted, n - reaped, IORING_ENTER_GETEVENTS);
+
+			if (r < 0 && errno != EINTR)
+				return -errno;
+			if (r > 0)
+				submitted += (unsigned int)r;
+			continue;
+		}
+		for (; head != ctail; head++, reaped++) {
+			const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+			if (!ret && cqe->res < 0)
+				ret = cqe->res;
+			else if (!ret && (size_t)cqe->res != len)
+				ret = -EIO;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef CACHE_BENCH_URING_H
+#define CACHE_BENCH_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Minimal io_uring on the raw syscalls: one ring, batches of plain reads or
+ * writes that are submitted together and waited for together.
+ */
+struct uring {
+	int fd;
+	unsigned int entries;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_sz;
+	size_t cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* -1 with errno set when io_uring is missing or not allowed. */
+int uring_init(struct uring *u, unsigned int entries);
+void uring_exit(struct uring *u);
+/*
+ * Reads (or writes) n chunks of len bytes, chunk k at bufs[k] and file offset
+ * offs[k], n at most the ring size. Returns 0, or -errno of the first failed
+ * or short transfer.
+ */
+int uring_batch(struct uring *u, int write, int fd, void *const *bufs, const off_t *offs, size_t len, unsigned int n);
+
+#endif
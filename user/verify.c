@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "store.h"
+#include "verify.h"
+
+#define VERIFY_SAMPLE_DEFAULT 8
+
+/* Checks p[lo..hi) against store_word(i, base); returns the first bad index or hi. */
+typedef size_t (*verify_fn)(const uint64_t *p, size_t lo, size_t hi, uint64_t base);
+
+static enum verify_mode verify_mode = VERIFY_EVERY;
+static int verify_every_n = VERIFY_SAMPLE_DEFAULT;
+static verify_fn verify_kernel;
+static const char *verify_kernel_name = "scalar";
+
+static size_t verify_scalar(const uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	const volatile uint64_t *vp = p;
+	uint64_t v = store_word(lo, base);
+	size_t i;
+
+	for (i = lo; i < hi; i++, v += STORE_K_INDEX)
+		if (vp[i] != v)
+			return i;
+	return hi;
+}
+
+/* First index >= lo whose address is aligned to align bytes, capped at hi. */
+static size_t align_index(const uint64_t *p, size_t lo, size_t hi, size_t align)
+{
+	size_t mis = (uintptr_t)&p[lo] & (align - 1);
+	size_t head = mis ? (align - mis) / sizeof(uint64_t) : 0;
+
+	return lo + head < hi ? lo + head : hi;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/* One 64-byte line per step; 64-bit equality from the 32-bit compare of SSE2. */
+__attribute__((target("sse2")))
+static size_t verify_sse2(const uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = align_index(p, lo, hi, 16);
+	size_t bad = verify_scalar(p, lo, i, base);
+	__m128i e, two;
+
+	if (bad != i)
+		return bad;
+	e = _mm_set_epi64x((long long)store_word(i + 1, base), (long long)store_word(i, base));
+	two = _mm_set1_epi64x((long long)(2 * STORE_K_INDEX));
+	for (; i + 8 <= hi; i += 8) {
+		__m128i e1 = _mm_add_epi64(e, two);
+		__m128i e2 = _mm_add_epi64(e1, two);
+		__m128i e3 = _mm_add_epi64(e2, two);
+		__m128i m;
+
+		m = _mm_and_si128(_mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&p[i]), e),
+				  _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&p[i + 2]), e1));
+		m = _mm_and_si128(m, _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&p[i + 4]), e2));
+		m = _mm_and_si128(m, _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)&p[i + 6]), e3));
+		if (_mm_movemask_epi8(m) != 0xffff)
+			break;
+		e = _mm_add_epi64(e3, two);
+	}
+	return verify_scalar(p, i, hi, base);
+}
+
+/*
+ * movntdqa: on WC memory each line is fetched once into a streaming buffer
+ * instead of one uncached read per load; on WB it is an ordinary load.
+ */
+__attribute__((target("sse4.1")))
+static size_t verify_sse41(const uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = align_index(p, lo, hi, 16);
+	size_t bad = verify_scalar(p, lo, i, base);
+	__m128i e, two;
+
+	if (bad != i)
+		return bad;
+	e = _mm_set_epi64x((long long)store_word(i + 1, base), (long long)store_word(i, base));
+	two = _mm_set1_epi64x((long long)(2 * STORE_K_INDEX));
+	for (; i + 8 <= hi; i += 8) {
+		__m128i e1 = _mm_add_epi64(e, two);
+		__m128i e2 = _mm_add_epi64(e1, two);
+		__m128i e3 = _mm_add_epi64(e2, two);
+		__m128i m;
+
+		m = _mm_and_si128(_mm_cmpeq_epi64(_mm_stream_load_si128((__m128i *)&p[i]), e),
+				  _mm_cmpeq_epi64(_mm_stream_load_si128((__m128i *)&p[i + 2]), e1));
+		m = _mm_and_si128(m, _mm_cmpeq_epi64(_mm_stream_load_si128((__m128i *)&p[i + 4]), e2));
+		m = _mm_and_si128(m, _mm_cmpeq_epi64(_mm_stream_load_si128((__m128i *)&p[i + 6]), e3));
+		if (_mm_movemask_epi8(m) != 0xffff)
+			break;
+		e = _mm_add_epi64(e3, two);
+	}
+	return verify_scalar(p, i, hi, base);
+}
+
+__attribute__((target("avx2")))
+static size_t verify_avx2(const uint64_t *p, size_t lo, size_t hi, uint64_t base)
+{
+	size_t i = align_index(p, lo, hi, 32);
+	size_t bad = verify_scalar(p, lo, i, base);
+	__m256i e, four;
+
+	if (bad != i)
+		return bad;
+	e = _mm256_set_epi64x((long long)store_word(i + 3, base), (long long)store_word(i + 2, base),
+			      (long long)store_word(i + 1, base), (long long)store_word(i, base));
+	four = _mm256_set1_epi64x((long long)(4 * STORE_K_INDEX));
+	for (; i + 8 <= hi; i += 8) {
+		__m256i e1 = _mm256_add_epi64(e, four);
+		__m256i m;
+
+		m = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_stream_load_si256((const __m256i *)&p[i]), e),
+				     _mm256_cmpeq_epi64(_mm256_stream_load_si256((const __m256i *)&p[i + 4]), e1));
+		if (_mm256_movemask_epi8(m) != -1)
+			break;
+		e = _mm256_add_epi64(e1, four);
+	}
+	return verify_scalar(p, i, hi, base);
+}
+#endif
+
+int verify_parse(const char *s)
+{
+	if (!strcmp(s, "every")) {
+		verify_mode = VERIFY_EVERY;
+	} else if (!strcmp(s, "deferred")) {
+		verify_mode = VERIFY_DEFERRED;
+	} else if (!strcmp(s, "off")) {
+		verify_mode = VERIFY_OFF;
+	} else if (!strncmp(s, "sample", 6) && (s[6] == '\0' || s[6] == ':')) {
+		verify_mode = VERIFY_SAMPLE;
+		verify_every_n = s[6] ? atoi(s + 7) : VERIFY_SAMPLE_DEFAULT;
+		if (verify_every_n < 1)
+			return -1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+void verify_init(void)
+{
+	verify_kernel = verify_scalar;
+	verify_kernel_name = "scalar";
+#if defined(__i386__) || defined(__x86_64__)
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		verify_kernel = verify_avx2;
+		verify_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		verify_kernel = verify_sse41;
+		verify_kernel_name = "sse4.1";
+	} else if (__builtin_cpu_supports("sse2")) {
+		verify_kernel = verify_sse2;
+		verify_kernel_name = "sse2";
+	}
+#endif
+#endif
+}
+
+void verify_print(void)
+{
+	switch (verify_mode) {
+	case VERIFY_EVERY:
+		printf("verify: every iteration kernel=%s\n", verify_kernel_name);
+		break;
+	case VERIFY_SAMPLE:
+		printf("verify: every %d iterations and the last kernel=%s\n", verify_every_n,
+		       verify_kernel_name);
+		break;
+	case VERIFY_DEFERRED:
+		printf("verify: last iteration only kernel=%s\n", verify_kernel_name);
+		break;
+	case VERIFY_OFF:
+		printf("verify: off\n");
+		break;
+	}
+}
+
+int verify_enabled(void)
+{
+	return verify_mode != VERIFY_OFF;
+}
+
+int verify_due(int iter, int iters)
+{
+	switch (verify_mode) {
+	case VERIFY_EVERY:
+		return 1;
+	case VERIFY_SAMPLE:
+		return iter % verify_every_n == 0 || iter == iters - 1;
+	case VERIFY_DEFERRED:
+		return iter == iters - 1;
+	case VERIFY_OFF:
+	default:
+		return 0;
+	}
+}
+
+size_t verify_seq_u64(const volatile uint64_t *p, size_t n, uint64_t base, size_t skip)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	size_t bad;
+
+	if (!verify_kernel)
+		verify_init();
+	if (skip >= n)
+		return verify_kernel(q, 0, n, base);
+	bad = verify_kernel(q, 0, skip, base);
+	if (bad != skip)
+		return bad;
+	return verify_kernel(q, skip + 1, n, base);
+}
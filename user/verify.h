@@ -0,0 +1,32 @@
+#ifndef CACHE_BENCH_VERIFY_H
+#define CACHE_BENCH_VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Checks the write pattern of the bench tests: word i holds
+ * store_word(i, iter), each word against its own expected value.
+ */
+
+enum verify_mode {
+	VERIFY_EVERY,
+	VERIFY_SAMPLE,
+	VERIFY_DEFERRED,
+	VERIFY_OFF,
+};
+
+/* every | sample[:N] | deferred | off */
+int verify_parse(const char *s);
+void verify_init(void);
+void verify_print(void);
+int verify_enabled(void);
+/* Whether iteration iter of iters should be checked under the current mode. */
+int verify_due(int iter, int iters);
+/*
+ * Index of the first word in p[0..n) that is not store_word(i, base), or n when all
+ * match. Word skip is not checked; pass n to check everything.
+ */
+size_t verify_seq_u64(const volatile uint64_t *p, size_t n, uint64_t base, size_t skip);
+
+#endif